@@ -0,0 +1,979 @@
+/*
+ * Beaglebone Pru IO
+ *
+ * Copyright (C) 2015 Rafael Vega <rvega@elsoftwarehamuerto.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Runs the PRU0 program's frame processing (pru0_main.c built for the
+ * host) against a mock register file, with synthetic ADC samples and
+ * gpio inputs. For each scenario prints how long a frame takes on this
+ * machine, how many peripheral registers it accesses (each one is a
+ * trip over the OCP bus on the PRU, the slow part) and how many
+ * messages it produces. Handy to try new channel modes and to estimate
+ * cycle budgets before flashing.
+ *
+ * Every message is decoded and each scenario checks that it got the
+ * messages and pin edges its channels should produce, the last column
+ * says ok or what went wrong. Exits with 1 if any check failed.
+ *
+ * ./pru0_benchmark [frames per scenario, at least 1024]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "definitions.h"
+#include "beaglebone_pruio_pins.h"
+
+// From pru0_main.c, built with -DBEAGLEBONE_PRUIO_SIMULATOR. See
+// pru0_simulator.h
+extern volatile unsigned int* shared_ram;
+void init_pru0();
+unsigned int process_frame();
+void wait_for_timer();
+void set_adc_channel(unsigned int channel_number, unsigned int config);
+void add_gpio_channel(int gpio_number);
+void set_gpio_debounce(int gpio_number, unsigned int time);
+void set_encoder(int gpio_number, unsigned int parameter);
+void set_velocity_key(int gpio_number, unsigned int parameter);
+void set_pwm_output(int gpio_number, unsigned int parameter);
+void stop_matrix();
+
+/////////////////////////////////////////////////////////////////////
+// RESULTS
+//
+
+// What a scenario produced, filled by the mock registers and by
+// reading the rings, then checked when the scenario ends.
+typedef struct results{
+   unsigned int frame;
+   unsigned long long adc_messages;
+   unsigned long long gpio_messages;
+   unsigned long long event_messages;
+   unsigned int adc_count[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
+   unsigned int adc_min[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
+   unsigned int adc_max[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
+   unsigned int adc_bits[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS]; // or of all values
+   unsigned int adc_settled_min[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS]; // second half
+   unsigned int adc_settled_max[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
+   unsigned int gpio_count[4*32];
+   unsigned int gpio_last[4*32];
+   unsigned int gpio_changed[4*32]; // frame of the last input change
+   unsigned int gpio_delay_min; // frames from an input change to its message
+   unsigned int gpio_delay_max;
+   unsigned int adc_steps; // steps of all sequences started
+   unsigned int datain_reads; // gpio module reads, this frame
+   unsigned int datain_reads_max; // in any frame
+   unsigned int rising_edges[4*32]; // gpio outputs
+   int encoder_counts[4*32]; // sum of the event values, by pin a
+   unsigned int matrix_presses;
+   unsigned int matrix_releases;
+   unsigned int matrix_wrong_keys;
+   unsigned int matrix_wrong_rows; // frames without exactly one row driven
+   unsigned int matrix_rows_left_driven; // after stop_matrix()
+   unsigned int note_ons[4*32]; // velocity keys, by first contact
+   unsigned int note_offs[4*32];
+   unsigned int velocity_min;
+   unsigned int velocity_max;
+   unsigned int pwm_high[4*32]; // timer polls with the pin high
+   unsigned int pwm_samples; // timer polls
+} results;
+
+static results r;
+static unsigned int settled_frame;
+
+/////////////////////////////////////////////////////////////////////
+// MOCK REGISTERS
+//
+
+// pru0_main.c accesses registers through these, see pru0_simulator.h
+volatile unsigned int beaglebone_pruio_simulator_r31;
+
+static volatile unsigned int mock_shared_ram[0x3000/4];
+
+// Reads from other registers return 0, writes are ignored.
+static volatile unsigned int scratch;
+
+// Write 1 to clear registers are returned with these bits set, so a
+// write can be told apart from a read, as in the simulator.
+#define W1C_UNTOUCHED 0xA5A50000
+
+// Adc registers up to the fifo keep what is written. A one shot
+// sequence converts every enabled step as soon as the step enable
+// register is written and disables them again, continuous steps
+// convert once per frame (see run_scenario()).
+static volatile unsigned int adc_registers[ADC_TSC_FIFO0DATA/4];
+
+#define FIFO_SIZE 64
+static unsigned int fifo[FIFO_SIZE];
+static unsigned int fifo_start;
+static unsigned int fifo_count;
+static volatile unsigned int fifo_threshold;
+
+// Gpio registers of the 4 modules. Set and clear data out writes are
+// applied at the next access, as in the simulator.
+static const unsigned long gpio_modules[4] = {GPIO0, GPIO1, GPIO2, GPIO3};
+static unsigned int gpio_datain[4];
+static volatile unsigned int gpio_dataout[4];
+static volatile unsigned int gpio_set[4];
+static volatile unsigned int gpio_clear[4];
+static volatile unsigned int gpio_oe[4];
+
+// IEP timer. The counter only moves while PRU0 polls the compare
+// status waiting for the next frame, MOCK_TIMER_POLL ns per poll, so
+// processing a frame takes no time.
+#define MOCK_TIMER_POLL 1000
+static unsigned int timer_count;
+static volatile unsigned int timer_compare;
+static unsigned int timer_status;
+static int timer_status_read;
+
+// Signal of the adc samples, see SCENARIOS.
+static int adc_signal;
+
+// Pwm outputs of the scenario, sampled at each timer poll.
+static int pwm_outputs;
+
+static unsigned long register_accesses;
+
+static unsigned int adc_sample(int signal, unsigned int frame, unsigned int ain);
+
+static void fifo_push(unsigned int data){
+   if(fifo_count < FIFO_SIZE){
+      fifo[(fifo_start + fifo_count) % FIFO_SIZE] = data;
+      fifo_count++;
+   }
+}
+
+// One sample per enabled step, tagged with the step id.
+static void adc_sequence(unsigned int steps){
+   unsigned int i;
+   for(i=1; i<=7; i++){
+      if(steps & (1<<i)){
+         fifo_push(((i-1)<<16) | adc_sample(adc_signal, r.frame, i-1));
+      }
+   }
+   r.adc_steps |= steps;
+}
+
+static void apply_writes(){
+   unsigned int module, set, i;
+
+   // Write 1 to clear.
+   if(timer_status_read){
+      if((scratch & 0xFFFF0000) != W1C_UNTOUCHED){
+         timer_status &= ~scratch;
+      }
+      timer_status_read = 0;
+   }
+
+   for(module=0; module<4; module++){
+      if(gpio_set[module] || gpio_clear[module]){
+         set = gpio_set[module] & ~gpio_dataout[module];
+         for(i=0; set!=0; i++, set>>=1){
+            r.rising_edges[module*32 + i] += set & 1;
+         }
+         gpio_dataout[module] = (gpio_dataout[module] | gpio_set[module]) & ~gpio_clear[module];
+         gpio_set[module] = 0;
+         gpio_clear[module] = 0;
+      }
+   }
+
+   // One shot steps, mode bits of the step config are 0.
+   unsigned int steps = adc_registers[ADC_TSC_STEPENABLE/4];
+   if(steps && (adc_registers[ADC_TSC_STEPCONFIG1/4] & 3) == 0){
+      adc_sequence(steps);
+      adc_registers[ADC_TSC_STEPENABLE/4] = 0;
+   }
+}
+
+volatile unsigned int* beaglebone_pruio_simulator_register(unsigned long address){
+   if(address >= PRU_SHARED_RAM && address < PRU_SHARED_RAM + sizeof(mock_shared_ram)){
+      return &(mock_shared_ram[(address - PRU_SHARED_RAM)/4]);
+   }
+
+   int i;
+
+   // A read-modify-write counts once.
+   apply_writes();
+   register_accesses++;
+   scratch = 0;
+   switch(address){
+      case ADC_TSC + ADC_TSC_FIFO0THRESHOLD:
+         return &fifo_threshold;
+      case ADC_TSC + ADC_TSC_IRQSTATUS:
+         if(fifo_count > fifo_threshold){
+            scratch = (1<<2);
+         }
+         return &scratch;
+      case ADC_TSC + ADC_TSC_FIFO0COUNT:
+         scratch = fifo_count;
+         return &scratch;
+      case ADC_TSC + ADC_TSC_FIFO0DATA:
+         if(fifo_count > 0){
+            scratch = fifo[fifo_start];
+            fifo_start = (fifo_start + 1) % FIFO_SIZE;
+            fifo_count--;
+         }
+         return &scratch;
+      case IEP + IEP_TMR_CNT:
+         scratch = timer_count;
+         return &scratch;
+      case IEP + IEP_TMR_CMP0:
+         return &timer_compare;
+      case IEP + IEP_TMR_CMP_STS:
+         // Counter resets on the compare event.
+         timer_count += MOCK_TIMER_POLL;
+         if(timer_compare > 0 && timer_count >= timer_compare){
+            timer_count -= timer_compare;
+            timer_status |= 1;
+         }
+         scratch = W1C_UNTOUCHED | timer_status;
+         timer_status_read = 1;
+         for(i=3; i<pwm_outputs*4; i+=4){
+            r.pwm_high[i] += (gpio_dataout[i/32] >> (i%32)) & 1;
+         }
+         r.pwm_samples++;
+         return &scratch;
+   }
+   if(address >= ADC_TSC && address < ADC_TSC + sizeof(adc_registers)){
+      return &(adc_registers[(address - ADC_TSC)/4]);
+   }
+
+   unsigned int module;
+   for(module=0; module<4; module++){
+      switch(address - gpio_modules[module]){
+         case GPIO_DATAIN:
+            r.datain_reads++;
+            scratch = gpio_datain[module];
+            return &scratch;
+         case GPIO_DATAOUT:
+            return &(gpio_dataout[module]);
+         case GPIO_SETDATAOUT:
+            return &(gpio_set[module]);
+         case GPIO_CLEARDATAOUT:
+            return &(gpio_clear[module]);
+         case GPIO_OE:
+            return &(gpio_oe[module]);
+      }
+   }
+   return &scratch;
+}
+
+static void reset_mock_registers(){
+   unsigned int i;
+   memset((void*)adc_registers, 0, sizeof(adc_registers));
+   fifo_start = fifo_count = 0;
+   fifo_threshold = FIFO_SIZE - 1;
+   for(i=0; i<4; i++){
+      gpio_datain[i] = 0;
+      gpio_dataout[i] = 0;
+      gpio_set[i] = 0;
+      gpio_clear[i] = 0;
+      gpio_oe[i] = 0xFFFFFFFF; // all inputs
+   }
+   timer_count = 0;
+   timer_compare = 0;
+   timer_status = 0;
+   timer_status_read = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// SCENARIOS
+//
+
+#define SIGNAL_STEADY 0
+#define SIGNAL_RAMP 1 // ADC: slow ramp. GPIO: one input changes per frame.
+#define SIGNAL_NOISE 2 // ADC: random values. GPIO: all inputs change.
+#define SIGNAL_JITTER 3 // ADC: resting input with a few LSBs of noise.
+#define SIGNAL_QUADRATURE 4 // GPIO: encoders move one edge every 4 frames.
+#define SIGNAL_KEYS 5 // GPIO: one matrix key pressed, moves every 64 frames.
+#define SIGNAL_STRIKES 6 // GPIO: velocity keys pressed every 16 frames.
+#define SIGNAL_MUX 7 // ADC: input and mux input selected, see mux_sample().
+
+// ADC config word, see definitions.h
+#define ADC_CONFIG(mode, parameter1) (((mode)<<28) | (parameter1))
+
+typedef struct scenario scenario;
+
+// Returns NULL if the scenario produced what it should, or what went
+// wrong.
+typedef const char *(*check_function)(scenario *s, unsigned int frames);
+
+struct scenario{
+   const char *name;
+   check_function check; // besides check_channels(), can be NULL
+   int adc_channels; // channels 0 to n-1
+   unsigned int adc_config;
+   int adc_signal;
+   int gpio_inputs; // spread over the 4 modules
+   int gpio_signal;
+   unsigned int adc_options; // continuous mode adds a sequence per frame
+   unsigned int adc_mux; // 0 is the default 8 input mux on AIN6
+   unsigned int gpio_debounce; // ns, 0 is off
+   int encoders; // on pins 4n+1 (A) and 4n+2 (B), 4 edges per count
+   unsigned int matrix; // rows on pins 4n+3, columns on pins 4n+1
+   int velocity_keys; // on pins 4n+1 (first) and 4n+2 (second)
+   int pwm_outputs; // on pins 4n+3
+   unsigned int adc_added_frame; // adc channels added on this frame, 0 is before the first
+};
+
+// Value of an input behind a mux: the input in bits 10-8 and the mux
+// input picked by the select lines in bits 7-4. Inputs without a mux
+// read just the input number.
+static unsigned int mux_sample(unsigned int ain){
+   unsigned int mux = mock_shared_ram[ADC_MUX];
+   unsigned int pins = (mux & ADC_MUX_PINS_MASK) >> ADC_MUX_PINS_SHIFT;
+   unsigned int i, gpio_number, input = 0;
+   if((mux & (1 << ain)) == 0){
+      return ain << 8;
+   }
+   for(i=0; i<pins; i++){
+      gpio_number = (mock_shared_ram[ADC_MUX_SELECT] >> (8*i)) & 0xFF;
+      input |= ((gpio_dataout[gpio_number/32] >> (gpio_number%32)) & 1) << i;
+   }
+   return (ain << 8) | (input << 4);
+}
+
+static unsigned int adc_sample(int signal, unsigned int frame, unsigned int ain){
+   switch(signal){
+      case SIGNAL_MUX:
+         return mux_sample(ain);
+      case SIGNAL_RAMP:
+         return (frame >> 2) & 0xfff;
+      case SIGNAL_NOISE:
+         return rand() & 0xfff;
+      case SIGNAL_JITTER:
+         return 0x7fe + (rand() & 3);
+      default:
+         return 0x800;
+   }
+}
+
+// Row pins of the key matrix scenario driven low, see run_scenario().
+static unsigned int matrix_rows_driven(){
+   unsigned int i, pin, count = 0;
+   apply_writes();
+   for(i=0; i<8; i++){
+      pin = i*4 + 3;
+      count += (((gpio_oe[pin/32] | gpio_dataout[pin/32]) >> (pin%32)) & 1) == 0;
+   }
+   return count;
+}
+
+// Matrix key pressed on a frame, row in bits 6-4 and column in bits 3-0
+// as in the event messages.
+#define MATRIX_KEY(frame) (((frame) >> 6) & 127)
+
+static void set_gpio_inputs(int signal, unsigned int frame){
+   int i, phase;
+   unsigned int row, column;
+   for(i=0; i<4; i++){
+      switch(signal){
+         case SIGNAL_RAMP:
+            // Inputs are every 4th pin.
+            if(i == (frame & 3)){
+               gpio_datain[i] ^= 1 << (((frame >> 2) & 7) * 4);
+            }
+            break;
+         case SIGNAL_NOISE:
+            gpio_datain[i] = (frame & 1) ? 0xFFFFFFFF : 0;
+            break;
+         case SIGNAL_QUADRATURE:
+            // A and B go 00, 10, 11, 01.
+            phase = (frame >> 2) & 3;
+            gpio_datain[i] = 0x11111111 * (((phase==1 || phase==2) << 1) | ((phase>=2) << 2));
+            break;
+         case SIGNAL_KEYS:
+            // The pressed key's column reads low while its row is
+            // driven low.
+            row = (MATRIX_KEY(frame) >> 4) * 4 + 3;
+            column = (MATRIX_KEY(frame) & 15) * 4 + 1;
+            apply_writes();
+            gpio_datain[i] = 0xFFFFFFFF;
+            if(i == column/32 && (((gpio_oe[row/32] | gpio_dataout[row/32]) >> (row%32)) & 1) == 0){
+               gpio_datain[i] &= ~(1 << (column%32));
+            }
+            break;
+         case SIGNAL_STRIKES:
+            // First contact closes (low) on frame 2, second on 6, both
+            // open on 12.
+            phase = frame & 15;
+            gpio_datain[i] = ~(0x11111111 * (((phase>=2 && phase<12) << 1) | ((phase>=6 && phase<12) << 2)));
+            break;
+         default:
+            gpio_datain[i] = 0;
+            break;
+      }
+   }
+}
+
+/////////////////////////////////////////////////////////////////////
+// CHECKS
+//
+
+// Largest value an adc channel can send with its config.
+static unsigned int adc_value_max(unsigned int config){
+   unsigned int parameter1 = config & 0xFF;
+   if((config >> 28) == 2){
+      return parameter1 - 1; // ranges
+   }
+   return (1 << parameter1) - 1;
+}
+
+// Gpio messages expected from the inputs of a scenario, each input
+// sends its value when added and then every change.
+static unsigned long long gpio_messages_expected(scenario *s, unsigned int frames){
+   switch(s->gpio_signal){
+      case SIGNAL_STEADY:
+         return s->gpio_inputs;
+      case SIGNAL_RAMP:
+         return s->gpio_inputs + frames - 1;
+      case SIGNAL_NOISE:
+         return (unsigned long long)s->gpio_inputs * frames;
+   }
+   return 0;
+}
+
+// Checks done for every scenario: each channel in use sent values in
+// its range and nothing else sent messages.
+static const char *check_channels(scenario *s, unsigned int frames){
+   unsigned int i;
+   for(i=0; i<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; i++){
+      if(i < (unsigned int)s->adc_channels){
+         if(r.adc_count[i] == 0){
+            return "adc channel sent nothing";
+         }
+         if(r.adc_max[i] > adc_value_max(s->adc_config)){
+            return "adc value out of range";
+         }
+      }
+      else if(r.adc_count[i] != 0){
+         return "message from unused adc channel";
+      }
+   }
+   // Debounced inputs are checked by check_debounce().
+   if(!s->gpio_debounce && r.gpio_messages != gpio_messages_expected(s, frames)){
+      return "wrong number of gpio messages";
+   }
+   for(i=0; i<(unsigned int)s->gpio_inputs; i++){
+      unsigned int pin = i*4;
+      if(r.gpio_count[pin] == 0){
+         return "gpio input sent nothing";
+      }
+      if(!s->gpio_debounce && r.gpio_last[pin] != ((gpio_datain[pin/32] >> (pin%32)) & 1)){
+         return "gpio value does not match input";
+      }
+   }
+   if(!s->encoders && !s->matrix && !s->velocity_keys && r.event_messages != 0){
+      return "unexpected event messages";
+   }
+   if(mock_shared_ram[ADC_RING_BUFFER_DROPPED] || mock_shared_ram[GPIO_RING_BUFFER_DROPPED]){
+      return "messages dropped";
+   }
+   if(mock_shared_ram[TIMING_OVERRUNS]){
+      return "frame overruns";
+   }
+   return NULL;
+}
+
+// Channel 0 is AIN0, only step 1 should be converting.
+static const char *check_one_step(scenario *s, unsigned int frames){
+   if(r.adc_steps != (1<<1)){
+      return "adc steps of unused channels enabled";
+   }
+   return NULL;
+}
+
+// 16 samples per value on every step, so channels without a mux are
+// not averaged over 8 frames and change every frame with noise.
+static const char *check_hardware_average(scenario *s, unsigned int frames){
+   unsigned int ain;
+   for(ain=0; ain<ADC_AINS; ain++){
+      if(((adc_registers[(ADC_TSC_STEPCONFIG1 + 8*ain)/4] >> 2) & 7) != 4){
+         return "step not averaging 16 samples";
+      }
+   }
+   if(r.adc_count[0] < frames/2){
+      return "too few values without a mux";
+   }
+   return NULL;
+}
+
+// Steps convert continuously and the fifo threshold is 4 sequences
+// of the 7 steps in use.
+static const char *check_continuous(scenario *s, unsigned int frames){
+   unsigned int ain;
+   for(ain=0; ain<ADC_AINS; ain++){
+      if((adc_registers[(ADC_TSC_STEPCONFIG1 + 8*ain)/4] & 3) != 1){
+         return "step not continuous";
+      }
+   }
+   if(fifo_threshold != 7*4 - 1){
+      return "wrong fifo threshold";
+   }
+   return NULL;
+}
+
+// Jitter never moves an input 4 steps away from its first value, each
+// channel sends that value only.
+static const char *check_deadband(scenario *s, unsigned int frames){
+   unsigned int i;
+   for(i=0; i<(unsigned int)s->adc_channels; i++){
+      if(r.adc_count[i] != 1){
+         return "jitter went through the deadband";
+      }
+   }
+   return NULL;
+}
+
+// Uniform noise over the whole range. Once the smoothing has settled,
+// channels behind the mux (one sample every 8 frames, not averaged)
+// stay near the middle.
+static const char *check_filter(scenario *s, unsigned int frames){
+   unsigned int i;
+   for(i=6; i<(unsigned int)s->adc_channels; i++){
+      if(r.adc_settled_min[i] < 64 || r.adc_settled_max[i] > 192){
+         return "noise not smoothed";
+      }
+   }
+   return NULL;
+}
+
+// 16 noisy samples per value give 14 bit values: the top bit and the
+// 2 bits below the adc's 12 are used.
+static const char *check_oversampling(scenario *s, unsigned int frames){
+   unsigned int i;
+   for(i=0; i<(unsigned int)s->adc_channels; i++){
+      if((r.adc_bits[i] & 0x2003) != 0x2003){
+         return "values don't use 14 bits";
+      }
+   }
+   return NULL;
+}
+
+// Channels are numbered from AIN0 up, 16 for each input with a mux.
+// Each one only gets samples of its own input and mux input.
+static const char *check_mux_channels(scenario *s, unsigned int frames){
+   unsigned int ain, input, channel_number = 0;
+   for(ain=0; ain<ADC_AINS; ain++){
+      for(input=0; input<((s->adc_mux & (1<<ain)) ? 16 : 1) && channel_number<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; input++){
+         unsigned int expected = (ain << 8) | (input << 4);
+         if(r.adc_min[channel_number] != expected || r.adc_max[channel_number] != expected){
+            return "sample went to the wrong channel";
+         }
+         channel_number++;
+      }
+   }
+   return NULL;
+}
+
+// Inputs are in all 4 gpio modules, each module is read once per
+// frame however many of its pins are inputs.
+static const char *check_module_reads(scenario *s, unsigned int frames){
+   if(r.datain_reads_max != 4){
+      return "wrong number of gpio module reads";
+   }
+   return NULL;
+}
+
+// Debounced inputs. Bouncing ones never read the same for long enough
+// and only send their level on the first frame. Slow ones send every
+// change once it has been steady for the debounce time.
+static const char *check_debounce(scenario *s, unsigned int frames){
+   unsigned int i, delay = s->gpio_debounce / timer_compare;
+   if(s->gpio_signal == SIGNAL_NOISE){
+      for(i=0; i<(unsigned int)s->gpio_inputs; i++){
+         if(r.gpio_count[i*4] != 1 || r.gpio_last[i*4] != 0){
+            return "bounce went through the debounce";
+         }
+      }
+      return NULL;
+   }
+   if(r.gpio_delay_min < delay || r.gpio_delay_max > delay + 1){
+      return "change not sent after the debounce time";
+   }
+   if(r.gpio_messages + delay + 1 < gpio_messages_expected(s, frames)){
+      return "debounced changes lost";
+   }
+   return NULL;
+}
+
+// A leads B and each encoder moves one edge every 4 frames, 4 edges
+// per count: one count clockwise every 16 frames.
+static const char *check_encoders(scenario *s, unsigned int frames){
+   unsigned int i;
+   for(i=0; i<(unsigned int)s->encoders; i++){
+      if(r.encoder_counts[i*4 + 1] < (int)(frames/16) - 1 || r.encoder_counts[i*4 + 1] > (int)(frames/16)){
+         return "wrong encoder counts";
+      }
+   }
+   return NULL;
+}
+
+// One row driven per frame, each key pressed while held and released
+// when the next one is pressed. Rows are inputs again once stopped.
+static const char *check_matrix(scenario *s, unsigned int frames){
+   if(r.matrix_wrong_rows){
+      return "not one matrix row driven";
+   }
+   if(r.matrix_wrong_keys){
+      return "wrong matrix key";
+   }
+   if(r.matrix_presses + 1 < frames/64 || r.matrix_presses > frames/64 + 1 ||
+         r.matrix_releases + 1 != r.matrix_presses){
+      return "wrong number of matrix keys";
+   }
+   if(r.matrix_rows_left_driven){
+      return "matrix rows driven after stop";
+   }
+   return NULL;
+}
+
+// Fastest time of the velocity key scenario, 1024ns units.
+#define VELOCITY_KEY_FASTEST 100
+
+// Every key is struck once per 16 frames, the contacts closing 4 frames
+// apart.
+static const char *check_velocity_keys(scenario *s, unsigned int frames){
+   unsigned int i, velocity = 127 * VELOCITY_KEY_FASTEST / ((4*timer_compare) >> 10);
+   for(i=0; i<(unsigned int)s->velocity_keys; i++){
+      if(r.note_ons[i*4 + 1] + 1 < frames/16 || r.note_ons[i*4 + 1] > frames/16 + 1 ||
+            r.note_offs[i*4 + 1] + 1 < r.note_ons[i*4 + 1] || r.note_offs[i*4 + 1] > r.note_ons[i*4 + 1]){
+         return "wrong number of notes";
+      }
+   }
+   if(r.velocity_min + 1 < velocity || r.velocity_max > velocity + 1){
+      return "wrong velocity";
+   }
+   return NULL;
+}
+
+// Pwm slot n has a duty of n/16 of its period. Edges can be a few
+// timer polls late around the frame, the shortest phase is longer.
+#define PWM_PERIOD (10*PWM_PERIOD_MIN)
+#define PWM_DUTY(slot) ((slot) * PWM_PERIOD / 16)
+
+// Each output is high for its duty and has a rising edge per period,
+// none at duty 0.
+static const char *check_pwm(scenario *s, unsigned int frames){
+   unsigned int i, periods = (unsigned long long)frames * timer_compare / PWM_PERIOD;
+   for(i=0; i<(unsigned int)s->pwm_outputs; i++){
+      double duty = (double)r.pwm_high[i*4 + 3] / r.pwm_samples;
+      if(duty < (double)PWM_DUTY(i)/PWM_PERIOD - 0.08 || duty > (double)PWM_DUTY(i)/PWM_PERIOD + 0.08){
+         return "wrong pwm duty";
+      }
+      if(i == 0 ? r.rising_edges[i*4 + 3] != 0 :
+            r.rising_edges[i*4 + 3] + 2 < periods || r.rising_edges[i*4 + 3] > periods + 2){
+         return "wrong number of pwm periods";
+      }
+   }
+   return NULL;
+}
+
+// Channels added a few frames in, half way through the 8 frame average
+// of the channels without a mux. Each one sends the steady input once,
+// at its bit width.
+static const char *check_added_channels(scenario *s, unsigned int frames){
+   unsigned int i, bits = s->adc_config & 0xFF;
+   unsigned int expected = (bits > 12) ? 0x800 << (bits - 12) : 0x800 >> (12 - bits);
+   for(i=0; i<(unsigned int)s->adc_channels; i++){
+      if(r.adc_count[i] != 1 || r.adc_min[i] != expected){
+         return "first value not from the input";
+      }
+   }
+   return NULL;
+}
+
+// Mux words, see definitions.h. Select lines are P8_27, P8_28, P8_29
+// and P8_30.
+#define ADC_MUX_DEFAULT ((1<<6) | (3<<ADC_MUX_PINS_SHIFT))
+#define ADC_MUX_SELECT_PINS (86 | (88<<8) | (87<<16) | (89<<24))
+
+static scenario scenarios[] = {
+   {"idle", NULL, 0, 0, SIGNAL_STEADY, 0, SIGNAL_STEADY},
+   {"adc 1 channel noise", check_one_step, 1, ADC_CONFIG(1, 12), SIGNAL_NOISE, 0, SIGNAL_STEADY},
+   {"adc 8 bits steady", NULL, 14, ADC_CONFIG(1, 8), SIGNAL_STEADY, 0, SIGNAL_STEADY},
+   {"adc 8 bits ramp", NULL, 14, ADC_CONFIG(1, 8), SIGNAL_RAMP, 0, SIGNAL_STEADY},
+   {"adc 12 bits noise", NULL, 14, ADC_CONFIG(1, 12), SIGNAL_NOISE, 0, SIGNAL_STEADY},
+   {"adc 8 ranges ramp", NULL, 14, ADC_CONFIG(2, 8), SIGNAL_RAMP, 0, SIGNAL_STEADY},
+   {"adc 12 bits jitter", NULL, 14, ADC_CONFIG(1, 12), SIGNAL_JITTER, 0, SIGNAL_STEADY},
+   {"adc 8 bits late", check_added_channels, 14, ADC_CONFIG(1, 8), SIGNAL_STEADY, 0, SIGNAL_STEADY,
+      0, 0, 0, 0, 0, 0, 0, 3},
+   {"adc deadband late", check_added_channels, 14, ADC_CONFIG(3, 12) | (4<<8), SIGNAL_STEADY, 0, SIGNAL_STEADY,
+      0, 0, 0, 0, 0, 0, 0, 3},
+   {"adc deadband jitter", check_deadband, 14, ADC_CONFIG(3, 12) | (4<<8), SIGNAL_JITTER, 0, SIGNAL_STEADY},
+   {"adc oversampled 14", check_oversampling, 6, ADC_CONFIG(4, 14), SIGNAL_NOISE, 0, SIGNAL_STEADY},
+   {"adc 12 bits late", check_added_channels, 14, ADC_CONFIG(1, 12), SIGNAL_STEADY, 0, SIGNAL_STEADY,
+      0, 0, 0, 0, 0, 0, 0, 3},
+   {"adc oversampled late", check_added_channels, 6, ADC_CONFIG(4, 14), SIGNAL_STEADY, 0, SIGNAL_STEADY,
+      0, 0, 0, 0, 0, 0, 0, 3},
+   {"adc filtered noise", check_filter, 14, ADC_CONFIG(1, 8) | ((ADC_FILTER_MEDIAN | 4)<<24), SIGNAL_NOISE, 0, SIGNAL_STEADY},
+   {"adc hw average 16", check_hardware_average, 14, ADC_CONFIG(1, 12), SIGNAL_NOISE, 0, SIGNAL_STEADY, 4},
+   {"adc continuous x4", check_continuous, 14, ADC_CONFIG(1, 12), SIGNAL_NOISE, 0, SIGNAL_STEADY,
+      4 | ADC_OPTIONS_CONTINUOUS | (4 << ADC_OPTIONS_THRESHOLD_SHIFT)},
+   {"adc 3 mux x16 noise", NULL, 52, ADC_CONFIG(1, 12), SIGNAL_NOISE, 0, SIGNAL_STEADY,
+      0, 0x7 | (4<<ADC_MUX_PINS_SHIFT)},
+   {"adc 3 mux x16 select", check_mux_channels, 52, ADC_CONFIG(1, 12), SIGNAL_MUX, 0, SIGNAL_STEADY,
+      0, 0x7 | (4<<ADC_MUX_PINS_SHIFT)},
+   {"gpio steady", check_module_reads, 0, 0, SIGNAL_STEADY, 32, SIGNAL_STEADY},
+   {"gpio one change", NULL, 0, 0, SIGNAL_STEADY, 32, SIGNAL_RAMP},
+   {"gpio all change", check_module_reads, 0, 0, SIGNAL_STEADY, 32, SIGNAL_NOISE},
+   {"gpio one debounced", check_debounce, 0, 0, SIGNAL_STEADY, 32, SIGNAL_RAMP, 0, 0, 1000000},
+   {"gpio all bouncing", check_debounce, 0, 0, SIGNAL_STEADY, 32, SIGNAL_NOISE, 0, 0, 1000000},
+   {"encoders turning", check_encoders, 0, 0, SIGNAL_STEADY, 0, SIGNAL_QUADRATURE, 0, 0, 0, 32},
+   {"matrix 8x16 typing", check_matrix, 0, 0, SIGNAL_STEADY, 0, SIGNAL_KEYS, 0, 0, 0, 0,
+      8 | (16<<MATRIX_COLUMNS_SHIFT) | (2<<MATRIX_DEBOUNCE_SHIFT)},
+   {"velocity keys", check_velocity_keys, 0, 0, SIGNAL_STEADY, 0, SIGNAL_STRIKES, 0, 0, 0, 0, 0, 32},
+   {"pwm 16 outputs", check_pwm, 0, 0, SIGNAL_STEADY, 0, SIGNAL_STEADY, 0, 0, 0, 0, 0, 0, 16},
+   {"everything noise", NULL, 14, ADC_CONFIG(1, 12), SIGNAL_NOISE, 32, SIGNAL_NOISE}
+};
+#define SCENARIOS (sizeof(scenarios)/sizeof(scenario))
+
+/////////////////////////////////////////////////////////////////////
+// RUN
+//
+
+static void record_message(unsigned int message){
+   unsigned int number, value;
+   if(message & ((unsigned int)1<<31)){
+      number = (message >> ADC_MESSAGE_CHANNEL_SHIFT) & ADC_MESSAGE_CHANNEL_MASK;
+      value = message & ADC_MESSAGE_VALUE_MASK;
+      if(r.adc_count[number] == 0 || value < r.adc_min[number]){
+         r.adc_min[number] = value;
+      }
+      if(r.adc_count[number] == 0 || value > r.adc_max[number]){
+         r.adc_max[number] = value;
+      }
+      if(r.frame >= settled_frame){
+         if(value < r.adc_settled_min[number]){
+            r.adc_settled_min[number] = value;
+         }
+         if(value > r.adc_settled_max[number]){
+            r.adc_settled_max[number] = value;
+         }
+      }
+      r.adc_bits[number] |= value;
+      r.adc_count[number]++;
+      r.adc_messages++;
+   }
+   else if(message & (1<<30)){
+      number = message & 0xFF;
+      value = (message >> 8) & 0xFFFF;
+      if(((message >> 24) & 0x3F) == EVENT_ENCODER){
+         r.encoder_counts[number] += (short)value;
+      }
+      else if(((message >> 24) & 0x3F) == EVENT_VELOCITY_KEY){
+         if(value){
+            r.note_ons[number]++;
+            if(value < r.velocity_min){
+               r.velocity_min = value;
+            }
+            if(value > r.velocity_max){
+               r.velocity_max = value;
+            }
+         }
+         else{
+            r.note_offs[number]++;
+         }
+      }
+      else if(((message >> 24) & 0x3F) == EVENT_MATRIX){
+         if(value){
+            r.matrix_presses++;
+            r.matrix_wrong_keys += number != MATRIX_KEY(r.frame);
+         }
+         else{
+            r.matrix_releases++;
+            r.matrix_wrong_keys += number != ((MATRIX_KEY(r.frame) - 1) & 127);
+         }
+      }
+      r.event_messages++;
+   }
+   else{
+      number = message & 0xFF;
+      if(number < 4*32){
+         // The first message is the level when the input was added.
+         if(r.gpio_count[number] > 0){
+            value = r.frame - r.gpio_changed[number];
+            if(value < r.gpio_delay_min){
+               r.gpio_delay_min = value;
+            }
+            if(value > r.gpio_delay_max){
+               r.gpio_delay_max = value;
+            }
+         }
+         r.gpio_count[number]++;
+         r.gpio_last[number] = (message >> 8) & 1;
+      }
+      r.gpio_messages++;
+   }
+}
+
+// Reads everything in a ring, like the ARM code would. Returns the
+// number of messages.
+static unsigned int drain_ring(unsigned int data, unsigned int start, unsigned int end, unsigned int size){
+   unsigned int used = (shared_ram[end] - shared_ram[start]) & (2*size - 1);
+   unsigned int i;
+   for(i=0; i<used; i+=2){ // timestamps are on
+      record_message(shared_ram[data + ((shared_ram[start] + i) & (size - 1))]);
+   }
+   shared_ram[start] = shared_ram[end];
+   return used / 2;
+}
+
+static uint64_t now(){
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (uint64_t)t.tv_sec*1000000000 + t.tv_nsec;
+}
+
+// Returns 1 if the checks failed.
+static int run_scenario(scenario *s, unsigned int frames){
+   unsigned int i, frame;
+   unsigned long long messages = 0, accesses = 0;
+   uint64_t total = 0, max = 0;
+
+   memset(&r, 0, sizeof(r));
+   for(i=0; i<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; i++){
+      r.adc_settled_min[i] = 0xFFFF;
+   }
+   r.gpio_delay_min = 0xFFFFFFFF;
+   r.velocity_min = 0xFFFF;
+   settled_frame = frames / 2;
+   reset_mock_registers();
+   adc_signal = s->adc_signal;
+   pwm_outputs = s->pwm_outputs;
+
+   mock_shared_ram[MESSAGE_OPTIONS] = MESSAGE_OPTIONS_TIMESTAMPS;
+   mock_shared_ram[ADC_OPTIONS] = s->adc_options;
+   mock_shared_ram[ADC_MUX] = s->adc_mux ? s->adc_mux : ADC_MUX_DEFAULT;
+   mock_shared_ram[ADC_MUX_SELECT] = ADC_MUX_SELECT_PINS;
+   mock_shared_ram[MATRIX] = s->matrix;
+   for(i=0; i<4; i++){
+      mock_shared_ram[MATRIX_ROW_PINS + i/2] = 0;
+      mock_shared_ram[MATRIX_COLUMN_PINS + i] = 0;
+   }
+   for(i=0; i<8; i++){
+      mock_shared_ram[MATRIX_ROW_PINS + i/4] |= (i*4 + 3) << (8*(i%4));
+   }
+   for(i=0; i<16; i++){
+      mock_shared_ram[MATRIX_COLUMN_PINS + i/4] |= (i*4 + 1) << (8*(i%4));
+   }
+   init_pru0();
+   if(s->adc_added_frame == 0){
+      for(i=0; i<(unsigned int)s->adc_channels; i++){
+         set_adc_channel(i, s->adc_config);
+      }
+   }
+   for(i=0; i<(unsigned int)s->gpio_inputs; i++){
+      add_gpio_channel(i*4);
+      set_gpio_debounce(i*4, s->gpio_debounce);
+   }
+   for(i=0; i<(unsigned int)s->encoders; i++){
+      set_encoder(i*4 + 1, ENCODER_ENABLE | (i*4 + 2) | (2 << ENCODER_STEPS_SHIFT));
+   }
+   for(i=0; i<(unsigned int)s->velocity_keys; i++){
+      set_velocity_key(i*4 + 1, VELOCITY_KEY_ENABLE | (i*4 + 2) | (VELOCITY_KEY_FASTEST << VELOCITY_KEY_FASTEST_SHIFT));
+   }
+   for(i=0; i<(unsigned int)s->pwm_outputs; i++){
+      mock_shared_ram[PWM_OUTPUTS + 2*i] = PWM_PERIOD;
+      mock_shared_ram[PWM_OUTPUTS + 2*i + 1] = PWM_DUTY(i);
+      set_pwm_output(i*4 + 3, PWM_OUTPUT_ENABLE | i);
+   }
+
+   for(frame=0; frame<frames; frame++){
+      r.frame = frame;
+
+      // As the set adc channel command would, between frames.
+      if(frame > 0 && frame == s->adc_added_frame){
+         for(i=0; i<(unsigned int)s->adc_channels; i++){
+            set_adc_channel(i, s->adc_config);
+         }
+      }
+
+      // Continuous steps convert by themselves, once per frame here.
+      if(adc_registers[ADC_TSC_STEPCONFIG1/4] & 3){
+         adc_sequence(adc_registers[ADC_TSC_STEPENABLE/4]);
+      }
+      unsigned int levels[4];
+      memcpy(levels, gpio_datain, sizeof(levels));
+      set_gpio_inputs(s->gpio_signal, frame);
+      for(i=0; i<4*32; i++){
+         if(((levels[i/32] ^ gpio_datain[i/32]) >> (i%32)) & 1){
+            r.gpio_changed[i] = frame;
+         }
+      }
+
+      register_accesses = 0;
+      r.datain_reads = 0;
+      uint64_t start = now();
+      process_frame();
+      uint64_t time = now() - start;
+      total += time;
+      if(time > max){
+         max = time;
+      }
+      accesses += register_accesses;
+      if(r.datain_reads > r.datain_reads_max){
+         r.datain_reads_max = r.datain_reads;
+      }
+      if(s->matrix && matrix_rows_driven() != 1){
+         r.matrix_wrong_rows++;
+      }
+
+      messages += drain_ring(ADC_RING_BUFFER_DATA, ADC_RING_BUFFER_START, ADC_RING_BUFFER_END, ADC_RING_BUFFER_SIZE);
+      messages += drain_ring(GPIO_RING_BUFFER_DATA, GPIO_RING_BUFFER_START, GPIO_RING_BUFFER_END, GPIO_RING_BUFFER_SIZE);
+
+      // Pwm edges and velocity key contacts happen in here.
+      wait_for_timer();
+   }
+
+   if(s->matrix){
+      stop_matrix();
+      r.matrix_rows_left_driven = matrix_rows_driven();
+   }
+
+   const char *error = check_channels(s, frames);
+   if(error == NULL && s->check != NULL){
+      error = s->check(s, frames);
+   }
+   printf("%-20s %10.0f %10llu %12.1f %12.2f  %s\n", s->name, (double)total/frames,
+         (unsigned long long)max, (double)accesses/frames, (double)messages/frames,
+         error ? error : "ok");
+   return error != NULL;
+}
+
+int main(int argc, const char *argv[]){
+   unsigned int frames = argc > 1 ? atoi(argv[1]) : 100000;
+   if(frames == 0){
+      frames = 100000;
+   }
+   if(frames < 1024){
+      frames = 1024;
+   }
+
+   printf("%-20s %10s %10s %12s %12s  %s\n", "scenario", "ns/frame", "max ns",
+         "registers", "messages", "check");
+   unsigned int i;
+   int failed = 0;
+   for(i=0; i<SCENARIOS; i++){
+      failed |= run_scenario(&scenarios[i], frames);
+   }
+   return failed;
+}
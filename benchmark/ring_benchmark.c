@@ -0,0 +1,428 @@
+/*
+ * Beaglebone Pru IO
+ *
+ * Copyright (C) 2015 Rafael Vega <rvega@elsoftwarehamuerto.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Throughput and latency of the ring buffer protocol between the PRU
+ * and the ARM code (see beaglebone_pruio.h and pru0_main.c).
+ *
+ * ./ring_benchmark host [seconds]
+ *    A thread stands in for the PRU: it writes ADC messages with 
+ *    timestamps to a ring in host memory, same as buffer_write() in 
+ *    pru0_main.c. Compares ring sizes, reading one message at a time 
+ *    or in batches, and the barrier the producer uses before moving 
+ *    the end pointer. Runs with the producer as fast as possible 
+ *    (throughput) and at a fixed rate (latency).
+ *
+ * ./ring_benchmark pru [seconds]
+ *    Real PRU (or libbeaglebone_pruio_simulator), all ADC channels at 
+ *    12 bits and the highest scan rate. Compares read sizes and 
+ *    spinning vs. beaglebone_pruio_wait(). Latency uses the PRU clock,
+ *    mapped to CLOCK_MONOTONIC through the state table timestamp.
+ *
+ * Latencies are from the moment the message was written to the moment
+ * it was read, in nanoseconds. In host mode, producer and consumer 
+ * yield when they have nothing to do, so on a single core (like the 
+ * BeagleBone's) they take turns.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <beaglebone_pruio.h>
+#include <beaglebone_pruio_pins.h>
+
+/////////////////////////////////////////////////////////////////////
+// RESULTS
+//
+
+#define MAX_LATENCIES (1<<20)
+static unsigned int latencies[MAX_LATENCIES];
+static unsigned long long latency_count;
+
+typedef struct benchmark_result{
+   unsigned long long messages;
+   unsigned long long dropped;
+   double seconds;
+} benchmark_result;
+
+static uint64_t now(){
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (uint64_t)t.tv_sec*1000000000 + t.tv_nsec;
+}
+
+static void add_latency(unsigned int latency){
+   // Keep the last MAX_LATENCIES
+   latencies[latency_count % MAX_LATENCIES] = latency;
+   latency_count++;
+}
+
+static int compare_latencies(const void *a, const void *b){
+   unsigned int x = *(const unsigned int*)a;
+   unsigned int y = *(const unsigned int*)b;
+   return (x > y) - (x < y);
+}
+
+static unsigned int percentile(unsigned int count, double p){
+   unsigned int i = (unsigned int)(p * (count - 1));
+   return latencies[i];
+}
+
+static void print_header(){
+   printf("%-6s %6s %-7s %-8s %9s %11s %9s %8s %8s %8s %8s\n", 
+         "mode", "ring", "read", "strategy", "rate", "msgs/s", "dropped", 
+         "p50", "p99", "p99.9", "max");
+}
+
+static void print_result(const char *mode, unsigned int ring_messages, int batch, const char *strategy, unsigned int rate, benchmark_result *result){
+   char read[16], rate_text[16];
+   if(batch){
+      sprintf(read, "batch%i", batch);
+   }
+   else{
+      strcpy(read, "single");
+   }
+   if(rate){
+      sprintf(rate_text, "%u", rate);
+   }
+   else{
+      strcpy(rate_text, "max");
+   }
+
+   printf("%-6s %6u %-7s %-8s %9s %11.0f %9llu ", mode, ring_messages, read, 
+         strategy, rate_text, result->messages / result->seconds, result->dropped);
+
+   unsigned int count = latency_count < MAX_LATENCIES ? latency_count : MAX_LATENCIES;
+   if(count == 0){
+      printf("%8s %8s %8s %8s\n", "-", "-", "-", "-");
+      return;
+   }
+   qsort(latencies, count, sizeof(unsigned int), compare_latencies);
+   printf("%8u %8u %8u %8u\n", percentile(count, 0.5), percentile(count, 0.99), 
+         percentile(count, 0.999), latencies[count-1]);
+}
+
+/////////////////////////////////////////////////////////////////////
+// CONSUMER
+//
+
+static beaglebone_pruio_message messages[1024];
+
+// Reads what is available with batch 0 (one message at a time, full
+// barrier per message) or up to batch messages per call. Returns the 
+// number of messages read. Latency is calculated with clock_offset 
+// added to CLOCK_MONOTONIC, so it's in the producer's clock.
+static int consume(int batch, uint64_t clock_offset){
+   int i, count = 0;
+   if(batch == 0){
+      while(count < 1024 && beaglebone_pruio_messages_are_available()){
+         beaglebone_pruio_read_message(&messages[count]);
+         count++;
+      }
+   }
+   else{
+      count = beaglebone_pruio_read_messages(messages, batch);
+   }
+
+   if(count > 0){
+      unsigned int time = (unsigned int)(now() + clock_offset);
+      for(i=0; i<count; i++){
+         // The PRU clock mapping can be a few microseconds ahead, don't
+         // let those latencies wrap around.
+         unsigned int latency = time - messages[i].timestamp;
+         add_latency(latency < 0x80000000 ? latency : 0);
+      }
+   }
+   return count;
+}
+
+/////////////////////////////////////////////////////////////////////
+// HOST MODE
+//
+
+#define BARRIER_RELEASE 0
+#define BARRIER_FULL 1
+static const char *barrier_names[] = {"release", "full"};
+
+#define MAX_RING_SIZE (1<<16)
+static volatile unsigned int ring_data[MAX_RING_SIZE];
+static volatile unsigned int ring_pointers[12];
+
+typedef struct producer_config{
+   beaglebone_pruio_ring *ring;
+   unsigned int rate; // messages per second, 0 for as fast as possible
+   int barrier;
+   volatile int finished;
+   unsigned long long dropped;
+} producer_config;
+
+// Same as buffer_write_with_timestamp() in pru0_main.c, drop newest
+// policy. Timestamps are the low 32 bits of CLOCK_MONOTONIC.
+static void* producer(void *param){
+   producer_config *config = (producer_config*)param;
+   beaglebone_pruio_ring *ring = config->ring;
+   unsigned int end = *ring->end;
+   unsigned int mask = 2*ring->size - 1;
+   unsigned int channel = 0;
+   uint64_t period = config->rate ? 1000000000 / config->rate : 0;
+   uint64_t next = now();
+
+   while(!config->finished){
+      if(period){
+         while(now() < next && !config->finished){
+            sched_yield();
+         }
+         next += period;
+      }
+
+      // As fast as possible waits for free space, at a fixed rate the
+      // message is dropped like the PRU does.
+      unsigned int used = (end - *ring->start) & mask;
+      if(used >= ring->size){
+         if(period){
+            config->dropped++;
+         }
+         else{
+            sched_yield();
+         }
+         continue;
+      }
+
+      unsigned int position = end & (ring->size-1);
+      ring->data[position] = (1<<31) | (channel<<16) | 0x800;
+      ring->data[position+1] = (unsigned int)now();
+      channel = (channel+1) % BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS;
+
+      end = (end+2) & mask;
+      if(config->barrier == BARRIER_RELEASE){
+         __atomic_store_n(ring->end, end, __ATOMIC_RELEASE);
+      }
+      else{
+         __sync_synchronize();
+         *ring->end = end;
+      }
+   }
+   return NULL;
+}
+
+static void init_host_ring(beaglebone_pruio_ring *ring, volatile unsigned int *data, unsigned int size, volatile unsigned int *pointers){
+   ring->data = data;
+   ring->size = size;
+   ring->start = &pointers[0];
+   ring->end = &pointers[1];
+   ring->skipped = &pointers[2];
+   ring->skipped_ack = &pointers[3];
+   pointers[0] = pointers[1] = pointers[2] = pointers[3] = 0;
+}
+
+static int run_host(unsigned int ring_size, int batch, int barrier, unsigned int rate, double seconds, benchmark_result *result){
+   // The library reads from these, see beaglebone_pruio.h. The gpio 
+   // ring stays empty.
+   beaglebone_pruio_message_size = 2;
+   init_host_ring(&beaglebone_pruio_adc_ring, ring_data, ring_size, &ring_pointers[0]);
+   init_host_ring(&beaglebone_pruio_gpio_ring, &ring_data[ring_size], 64, &ring_pointers[4]);
+
+   producer_config config;
+   config.ring = &beaglebone_pruio_adc_ring;
+   config.rate = rate;
+   config.barrier = barrier;
+   config.finished = 0;
+   config.dropped = 0;
+
+   latency_count = 0;
+   result->messages = 0;
+
+   pthread_t thread;
+   if(pthread_create(&thread, NULL, &producer, &config)){
+      return 1;
+   }
+   uint64_t start = now();
+   uint64_t finish = start + (uint64_t)(seconds * 1e9);
+   while(now() < finish){
+      int count = consume(batch, 0);
+      if(count == 0){
+         sched_yield();
+      }
+      result->messages += count;
+   }
+   config.finished = 1;
+   pthread_join(thread, NULL);
+
+   result->seconds = (now() - start) * 1e-9;
+   result->dropped = config.dropped;
+   return 0;
+}
+
+static int benchmark_host(double seconds){
+   unsigned int ring_sizes[] = {64, 256, 1024, 4096};
+   int batches[] = {0, 16, 256};
+   unsigned int rates[] = {0, 100000};
+   int i, j, k, l;
+   benchmark_result result;
+
+   print_header();
+   for(l=0; l<2; l++){
+      for(i=0; i<4; i++){
+         for(j=0; j<3; j++){
+            for(k=0; k<2; k++){
+               if(run_host(ring_sizes[i], batches[j], k, rates[l], seconds, &result)){
+                  fprintf(stderr, "Could not start producer thread.\n");
+                  return 1;
+               }
+               print_result("host", ring_sizes[i]/2, batches[j], barrier_names[k], rates[l], &result);
+            }
+         }
+      }
+   }
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// PRU MODE
+//
+
+// Difference between the PRU clock (message timestamps) and 
+// CLOCK_MONOTONIC. The PRU writes the state table timestamp when a 
+// value changes, catch the moment it does.
+static int get_clock_offset(uint64_t *offset){
+   beaglebone_pruio_snapshot snapshot;
+   if(beaglebone_pruio_get_snapshot(&snapshot)){
+      return 1;
+   }
+   unsigned int last = snapshot.timestamp;
+   uint64_t timeout = now() + 1000000000;
+   while(now() < timeout){
+      if(beaglebone_pruio_get_snapshot(&snapshot) == 0 && snapshot.timestamp != last){
+         *offset = (uint64_t)snapshot.timestamp - now();
+         return 0;
+      }
+   }
+   return 1;
+}
+
+static int run_pru(int batch, int wait, double seconds, benchmark_result *result){
+   uint64_t offset = 0;
+   beaglebone_pruio_buffer_stats stats;
+   beaglebone_pruio_get_buffer_stats(&stats);
+   unsigned int dropped = stats.adc.dropped;
+
+   // Empty the buffers, then synchronize the clocks.
+   while(consume(256, 0) > 0);
+   int have_offset = (get_clock_offset(&offset) == 0);
+   while(consume(256, 0) > 0);
+
+   latency_count = 0;
+   result->messages = 0;
+   beaglebone_pruio_reset_timing();
+   uint64_t start = now();
+   uint64_t finish = start + (uint64_t)(seconds * 1e9);
+   while(now() < finish){
+      if(wait){
+         beaglebone_pruio_wait(10);
+      }
+      int count = consume(batch, have_offset ? offset : 0);
+      if(count == 0 && !wait){
+         sched_yield();
+      }
+      result->messages += count;
+   }
+   if(!have_offset){
+      latency_count = 0;
+   }
+
+   result->seconds = (now() - start) * 1e-9;
+   beaglebone_pruio_get_buffer_stats(&stats);
+   result->dropped = stats.adc.dropped - dropped;
+   return 0;
+}
+
+static int benchmark_pru(double seconds){
+   int batches[] = {0, 16, 64};
+   int i, j, channel;
+   benchmark_result result;
+
+   beaglebone_pruio_set_timestamps(1);
+   if(beaglebone_pruio_start()){
+      fprintf(stderr, "Could not start PRU.\n");
+      return 1;
+   }
+   for(channel=0; channel<beaglebone_pruio_get_adc_channel_count(); channel++){
+      beaglebone_pruio_init_adc_pin(channel, 12);
+   }
+   // Highest rate the PRU accepts and keeps up with. Overruns would 
+   // make the PRU clock fall behind and spoil latencies.
+   int rate = 12500;
+   beaglebone_pruio_timing timing;
+   while(rate > 13){
+      if(beaglebone_pruio_set_scan_rate(rate) == 0){
+         beaglebone_pruio_reset_timing();
+         usleep(200000);
+         beaglebone_pruio_get_timing(&timing);
+         if(timing.overruns == 0){
+            break;
+         }
+      }
+      rate -= rate/8;
+   }
+   printf("Scan rate: %i values per second per channel\n", beaglebone_pruio_get_scan_rate());
+
+   beaglebone_pruio_buffer_stats stats;
+   beaglebone_pruio_get_buffer_stats(&stats);
+   print_header();
+   for(i=0; i<3; i++){
+      for(j=0; j<2; j++){
+         run_pru(batches[i], j, seconds, &result);
+         print_result("pru", stats.adc.size, batches[i], j ? "wait" : "spin", 0, &result);
+
+         // The PRU clock falls behind when frames overrun.
+         beaglebone_pruio_get_timing(&timing);
+         if(timing.overruns){
+            printf("       %u frame overruns, latencies are not reliable\n", timing.overruns);
+         }
+      }
+   }
+
+   beaglebone_pruio_close();
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// MAIN
+//
+
+int main(int argc, const char *argv[]){
+   if(argc < 2 || (strcmp(argv[1], "host") && strcmp(argv[1], "pru"))){
+      fprintf(stderr, "Usage: %s host|pru [seconds per run]\n", argv[0]);
+      return 1;
+   }
+   double seconds = argc > 2 ? atof(argv[2]) : 1;
+   if(seconds <= 0){
+      seconds = 1;
+   }
+
+   if(strcmp(argv[1], "host") == 0){
+      return benchmark_host(seconds);
+   }
+   return benchmark_pru(seconds);
+}
@@ -35,24 +35,27 @@ void signal_handler(int signal){
 static pthread_t monitor_thread;
 
 static void* monitor_inputs(void* param){
-   beaglebone_pruio_message message;
+   beaglebone_pruio_message messages[64];
    beaglebone_midi_message midi_messages[16];
    int n_midi_messages = 0;
+   int n_messages = 0;
 
    while(!finished){
-      while(beaglebone_pruio_messages_are_available() && !finished){
-         beaglebone_pruio_read_message(&message);
-
-         // Message from gpio
-         if(message.is_gpio){
-            printf("GPIO %i: %i\n", message.gpio_number, message.value);
-         }
-
-         // Messages from adc
-         if(!message.is_gpio){
-            printf("ADC %i: %i\n", message.adc_channel, message.value);
+      do{
+         n_messages = beaglebone_pruio_read_messages(messages, 64);
+         int i;
+         for(i=0; i<n_messages; ++i){
+            // Message from gpio
+            if(messages[i].is_gpio){
+               printf("GPIO %i: %i (%u ns)\n", messages[i].gpio_number, messages[i].value, messages[i].timestamp);
+            }
+
+            // Messages from adc
+            if(!messages[i].is_gpio){
+               printf("ADC %i: %i (%u ns)\n", messages[i].adc_channel, messages[i].value, messages[i].timestamp);
+            }
          }
-      }
+      } while(n_messages==64 && !finished);
       
       // Midi messages
       beaglebone_midi_receive_messages(midi_messages, &n_midi_messages);
@@ -70,7 +73,9 @@ static void* monitor_inputs(void* param){
         printf("Data 2: %i \n\n", midi_messages[i].data[2]);
       } 
 
-      usleep(1000);
+      // Sleep until the PRU has new messages, but no longer than 1ms
+      // so MIDI input is still checked regularly.
+      beaglebone_pruio_wait(1);
    }
 
    return NULL;
@@ -101,15 +106,17 @@ int main(int argc, const char *argv[]){
    signal(SIGINT, signal_handler);
 
    if(beaglebone_midi_start()){
-     return 1;
+     // Keep going without MIDI, there is no UART in the simulator.
+     fprintf(stderr, "MIDI input not available.\n");
    }
+   beaglebone_pruio_set_timestamps(1);
    if(beaglebone_pruio_start()){
      beaglebone_midi_stop();
      return 1;
    }
    if(start_monitor_thread()){
      beaglebone_midi_stop();
-     beaglebone_pruio_stop();
+     beaglebone_pruio_close();
      return 1;
    }
 
@@ -185,8 +192,17 @@ int main(int argc, const char *argv[]){
      sleep(1);
    }
 
-   beaglebone_pruio_stop();
+   beaglebone_pruio_buffer_stats stats;
+   beaglebone_pruio_get_buffer_stats(&stats);
+   printf("GPIO dropped messages: %u, max. buffer use: %u of %u\n", stats.gpio.dropped, stats.gpio.high_watermark, stats.gpio.size);
+   printf("ADC dropped messages: %u, max. buffer use: %u of %u\n", stats.adc.dropped, stats.adc.high_watermark, stats.adc.size);
+
+   beaglebone_pruio_timing timing;
+   beaglebone_pruio_get_timing(&timing);
+   printf("PRU cycles per frame: avg. %u, max. %u of %u, overruns: %u\n", timing.frame.average, timing.frame.max, timing.frame_cycles, timing.overruns);
+
    stop_monitor_thread();
+   beaglebone_pruio_close();
    beaglebone_midi_stop();
 
    return 0;
@@ -9,6 +9,10 @@
 /*                                                                            */
 /*    Rvega: Made page 0 (instructions memory size) bigger and page 1 (data,  */
 /*           etc smaller)                                                     */
+/*    Page 1 is now the whole 8KB of PRU0 data ram, channel state and         */
+/*    overflow buffers did not fit in 2KB anymore.                            */
+/*    Page 0 is the whole 8KB of PRU0 instruction ram too, for the encoder,   */
+/*    key matrix, velocity key and pwm code.                                  */
 /******************************************************************************/
 
 -cr
@@ -19,9 +23,9 @@
 MEMORY
 {
     PAGE 0:
-      PRUIMEM:   o = 0x00000000  l = 0x00001800  /* PRU0 Instruction RAM */
+      PRUIMEM:   o = 0x00000000  l = 0x00002000  /* PRU0 Instruction RAM */
     PAGE 1:
-      PRUDMEM:   o = 0x00000000  l = 0x00000800  /* PRU0 Data RAM */
+      PRUDMEM:   o = 0x00000000  l = 0x00002000  /* PRU0 Data RAM */
 }
 
 SECTIONS
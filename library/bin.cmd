@@ -3,7 +3,7 @@
 
 ROMS {
                 PAGE 0:
-                text: o = 0x0, l = 0x1800, files={text.bin}
+                text: o = 0x0, l = 0x2000, files={text.bin}
                 PAGE 1:
-                data: o = 0x0, l = 0x0800, files={data.bin}
+                data: o = 0x0, l = 0x2000, files={data.bin}
 }
@@ -6,14 +6,14 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <stropts.h>
+#include <sys/ioctl.h>
 /* #include <sys/signal.h> */
-#include <asm/termios.h>
+#include <asm/termbits.h>
 
 #define BEAGLEBONE_MIDI_BUFFER_SIZE 128
 #define BEAGLEBONE_MIDI_UART_NUMBER 4
 
-static int uart;
+static int uart = -1;
 static uint8_t uart_buffer[BEAGLEBONE_MIDI_BUFFER_SIZE];
 static int read_counter = 0;
 static beaglebone_midi_message current_message;
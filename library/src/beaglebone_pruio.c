@@ -16,27 +16,16 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <dirent.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
-#include <prussdrv.h>
-#include <pruss_intc_mapping.h>
-#include <fcntl.h>
-#include <sys/mman.h>
+#include <poll.h>
 
 #include "beaglebone_pruio.h"
+#include "beaglebone_pruio_backend.h"
 #include "definitions.h"
 #include "beaglebone_pruio_pins.h"
 
-#ifndef BEAGLEBONE_PRUIO_START_ADDR_0
-   #error "BEAGLEBONE_PRUIO_START_ADDR_0 must be defined."
-#endif
-
-#ifndef BEAGLEBONE_PRUIO_PREFIX
-   #error "BEAGLEBONE_PRUIO_PREFIX must be defined."
-#endif
-
 /* #define DEBUG */
 
 
@@ -53,40 +42,34 @@ volatile unsigned int* gpio1_data_out = NULL;
 volatile unsigned int* gpio2_data_out = NULL;
 volatile unsigned int* gpio3_data_out = NULL;
 
-static int map_device_registers(){
-   // Get pointers to hardware registers. See memory map in manual for addresses.
-   
-   int memdev = open("/dev/mem", O_RDWR | O_SYNC);
-   
-   // Get pointer to gpio0 registers (start at address 0x44e07000, length 0x1000 (4KB)).
-   volatile void* gpio0 = mmap(0, 0x1000, PROT_READ|PROT_WRITE, MAP_SHARED, memdev, GPIO0);
-   if(gpio0 == MAP_FAILED){ return 1; }
-   gpio0_output_enable = (volatile unsigned int*)(gpio0 + GPIO_OE);
-   gpio0_data_out = (volatile unsigned int*)(gpio0 + GPIO_DATAOUT);
-
-   // same for gpio1, 2 and 3.
-   volatile void* gpio1 = mmap(0, 0x1000, PROT_READ|PROT_WRITE, MAP_SHARED, memdev, GPIO1);
-   if(gpio1 == MAP_FAILED){
-      return 1;
-   }
-   gpio1_output_enable = (volatile unsigned int*)(gpio1 + GPIO_OE);
-   gpio1_data_out = (volatile unsigned int*)(gpio1 + GPIO_DATAOUT);
-
-   volatile void* gpio2 = mmap(0, 0x1000, PROT_READ|PROT_WRITE, MAP_SHARED, memdev, GPIO2);
-   if(gpio2 == MAP_FAILED){
-      return 1;
-   }
-   gpio2_output_enable = (volatile unsigned int*)(gpio2 + GPIO_OE);
-   gpio2_data_out = (volatile unsigned int*)(gpio2 + GPIO_DATAOUT);
-
-   volatile void* gpio3 = mmap(0, 0x1000, PROT_READ|PROT_WRITE, MAP_SHARED, memdev, GPIO3);
-   if(gpio3 == MAP_FAILED){
-      return 1;
-   }
-   gpio3_output_enable = (volatile unsigned int*)(gpio3 + GPIO_OE);
-   gpio3_data_out = (volatile unsigned int*)(gpio3 + GPIO_DATAOUT);
-
-   return 0;
+volatile unsigned int* gpio0_set_data_out = NULL;
+volatile unsigned int* gpio1_set_data_out = NULL;
+volatile unsigned int* gpio2_set_data_out = NULL;
+volatile unsigned int* gpio3_set_data_out = NULL;
+
+volatile unsigned int* gpio0_clear_data_out = NULL;
+volatile unsigned int* gpio1_clear_data_out = NULL;
+volatile unsigned int* gpio2_clear_data_out = NULL;
+volatile unsigned int* gpio3_clear_data_out = NULL;
+
+static void map_gpio_registers(volatile void *gpio_modules[4]){
+   // Register blocks of the gpio modules come from the backend.
+   gpio0_output_enable = (volatile unsigned int*)(gpio_modules[0] + GPIO_OE);
+   gpio0_data_out = (volatile unsigned int*)(gpio_modules[0] + GPIO_DATAOUT);
+   gpio0_set_data_out = (volatile unsigned int*)(gpio_modules[0] + GPIO_SETDATAOUT);
+   gpio0_clear_data_out = (volatile unsigned int*)(gpio_modules[0] + GPIO_CLEARDATAOUT);
+   gpio1_output_enable = (volatile unsigned int*)(gpio_modules[1] + GPIO_OE);
+   gpio1_data_out = (volatile unsigned int*)(gpio_modules[1] + GPIO_DATAOUT);
+   gpio1_set_data_out = (volatile unsigned int*)(gpio_modules[1] + GPIO_SETDATAOUT);
+   gpio1_clear_data_out = (volatile unsigned int*)(gpio_modules[1] + GPIO_CLEARDATAOUT);
+   gpio2_output_enable = (volatile unsigned int*)(gpio_modules[2] + GPIO_OE);
+   gpio2_data_out = (volatile unsigned int*)(gpio_modules[2] + GPIO_DATAOUT);
+   gpio2_set_data_out = (volatile unsigned int*)(gpio_modules[2] + GPIO_SETDATAOUT);
+   gpio2_clear_data_out = (volatile unsigned int*)(gpio_modules[2] + GPIO_CLEARDATAOUT);
+   gpio3_output_enable = (volatile unsigned int*)(gpio_modules[3] + GPIO_OE);
+   gpio3_data_out = (volatile unsigned int*)(gpio_modules[3] + GPIO_DATAOUT);
+   gpio3_set_data_out = (volatile unsigned int*)(gpio_modules[3] + GPIO_SETDATAOUT);
+   gpio3_clear_data_out = (volatile unsigned int*)(gpio_modules[3] + GPIO_CLEARDATAOUT);
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -95,244 +78,115 @@ static int map_device_registers(){
 typedef struct gpio_pin{ 
    beaglebone_pruio_gpio_mode mode;
    int gpio_number;
+   int reserved; // part of an encoder, see reserve_gpio_pin()
 } gpio_pin;
 static gpio_pin used_pins[BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS];
 static int used_pins_count = 0;
 
+// Analog mux topology, see comments in definitions.h. Defaults to one
+// 8 input mux on AIN6 selected by P8_27, P8_28 and P8_29.
+static unsigned int adc_mux_ains = 1<<6;
+static int adc_mux_pins[ADC_MUX_MAX_PINS] = {P8_27, P8_28, P8_29, 0};
+static int adc_mux_pin_count = 3;
+static unsigned int adc_mux_settle = 0;
+
+// Key matrix, see comments in definitions.h. No matrix by default.
+static int matrix_rows[BEAGLEBONE_PRUIO_MAX_MATRIX_ROWS];
+static int matrix_row_count = 0;
+static int matrix_columns[BEAGLEBONE_PRUIO_MAX_MATRIX_COLUMNS];
+static int matrix_column_count = 0;
+static unsigned int matrix_options = 0;
+
+static int reserve_gpio_pin(int gpio_number, beaglebone_pruio_gpio_mode mode);
+
 static int init_gpio(){
    // Only pinmux is set here, enabling GPIO modules, 
    // clocks, debounce, etc. is set on the PRU side.
 
    // Pins used to control analog mux:
-   int e1 = beaglebone_pruio_init_gpio_pin(P8_27, BEAGLEBONE_PRUIO_GPIO_MODE_OUTPUT);
-   int e2 = beaglebone_pruio_init_gpio_pin(P8_28, BEAGLEBONE_PRUIO_GPIO_MODE_OUTPUT);
-   int e3 = beaglebone_pruio_init_gpio_pin(P8_29, BEAGLEBONE_PRUIO_GPIO_MODE_OUTPUT); 
+   int i;
+   if(adc_mux_ains != 0){
+      for(i=0; i<adc_mux_pin_count; ++i){
+         if(beaglebone_pruio_init_gpio_pin(adc_mux_pins[i], BEAGLEBONE_PRUIO_GPIO_MODE_OUTPUT)){
+            return 1;
+         }
+      }
+   }
 
-   if(e1 || e2 || e3){
-      return 1;
-   } 
-   else{
-      return 0;
+   // Key matrix rows and columns, the PRU drives the rows.
+   for(i=0; i<matrix_row_count; ++i){
+      if(reserve_gpio_pin(matrix_rows[i], BEAGLEBONE_PRUIO_GPIO_MODE_OUTPUT)){
+         return 1;
+      }
    }
+   for(i=0; i<matrix_column_count; ++i){
+      if(reserve_gpio_pin(matrix_columns[i], BEAGLEBONE_PRUIO_GPIO_MODE_INPUT)){
+         return 1;
+      }
+   }
+   return 0;
 }
 
-static int get_gpio_pin_name(int gpio_number, char* pin_name){
-   switch(gpio_number){
-      case P8_07: 
-         strcpy(pin_name, "P8_07");
-         break;
-      case P8_08: 
-         strcpy(pin_name, "P8_08");
-         break;
-      case P8_09: 
-         strcpy(pin_name, "P8_09");
-         break;
-      case P8_10: 
-         strcpy(pin_name, "P8_10");
-         break;
-      case P8_11: 
-         strcpy(pin_name, "P8_11");
-         break;
-      case P8_12: 
-         strcpy(pin_name, "P8_12");
-         break;
-      case P8_13: 
-         strcpy(pin_name, "P8_13");
-         break;
-      case P8_14: 
-         strcpy(pin_name, "P8_14");
-         break;
-      case P8_15: 
-         strcpy(pin_name, "P8_15");
-         break;
-      case P8_16: 
-         strcpy(pin_name, "P8_16");
-         break;
-      case P8_17: 
-         strcpy(pin_name, "P8_17");
-         break;
-      case P8_18: 
-         strcpy(pin_name, "P8_18");
-         break;
-      case P8_19: 
-         strcpy(pin_name, "P8_19");
-         break;
-      case P8_26: 
-         strcpy(pin_name, "P8_26");
-         break;
-      case P8_27: 
-         strcpy(pin_name, "P8_27");
-         break;
-      case P8_28: 
-         strcpy(pin_name, "P8_28");
-         break;
-      case P8_29: 
-         strcpy(pin_name, "P8_29");
-         break;
-      case P8_30: 
-         strcpy(pin_name, "P8_30");
-         break;
-      case P8_31: 
-         strcpy(pin_name, "P8_31");
-         break;
-      case P8_32: 
-         strcpy(pin_name, "P8_32");
-         break;
-      case P8_33: 
-         strcpy(pin_name, "P8_33");
-         break;
-      case P8_34: 
-         strcpy(pin_name, "P8_34");
-         break;
-      case P8_35: 
-         strcpy(pin_name, "P8_35");
-         break;
-      case P8_36: 
-         strcpy(pin_name, "P8_36");
-         break;
-      case P8_37: 
-         strcpy(pin_name, "P8_37");
-         break;
-      case P8_38: 
-         strcpy(pin_name, "P8_38");
-         break;
-      case P8_39: 
-         strcpy(pin_name, "P8_39");
-         break;
-      case P8_40: 
-         strcpy(pin_name, "P8_40");
-         break;
-      case P8_41: 
-         strcpy(pin_name, "P8_41");
-         break;
-      case P8_42: 
-         strcpy(pin_name, "P8_42");
-         break;
-      case P8_43: 
-         strcpy(pin_name, "P8_43");
-         break;
-      case P8_44: 
-         strcpy(pin_name, "P8_44");
-         break;
-      case P8_45: 
-         strcpy(pin_name, "P8_45");
-         break;
-      case P8_46:
-         strcpy(pin_name, "P8_46");
-         break;
-      /* case P9_11:  */
-      /*    strcpy(pin_name, "P9_11"); */
-      /*    break; */
-      case P9_12: 
-         strcpy(pin_name, "P9_12");
-         break;
-      /* case P9_13:  */
-      /*    strcpy(pin_name, "P9_13"); */
-      /*    break; */
-      case P9_14: 
-         strcpy(pin_name, "P9_14");
-         break;
-      case P9_15: 
-         strcpy(pin_name, "P9_15");
-         break;
-      case P9_16: 
-         strcpy(pin_name, "P9_16");
-         break;
-      /* case P9_17:  */
-      /*    strcpy(pin_name, "P9_17"); */
-      /*    break; */
-      /* case P9_18:  */
-      /*    strcpy(pin_name, "P9_18"); */
-      /*    break; */
-      case P9_21: 
-         strcpy(pin_name, "P9_21");
-         break;
-      case P9_22: 
-         strcpy(pin_name, "P9_22");
-         break;
-      case P9_23: 
-         strcpy(pin_name, "P9_23");
-         break;
-      case P9_24: 
-         strcpy(pin_name, "P9_24");
-         break;
-      case P9_26: 
-         strcpy(pin_name, "P9_26");
-         break;
-      case P9_27: 
-         strcpy(pin_name, "P9_27");
-         break;
-      case P9_30: 
-         strcpy(pin_name, "P9_30");
-         break;
-      case P9_41A: 
-         strcpy(pin_name, "P9_41A");
-         break;
-      case P9_42A: 
-         strcpy(pin_name, "P9_42A");
-         break;
-      default: 
-         return 1;
+/////////////////////////////////////////////////////////////////////
+// COMMANDS TO PRU
+//
+
+static int pru_running = 0;
+
+static int send_command(unsigned int command, unsigned int number, unsigned int parameter){
+   // See comments for the command buffer in definitions.h
+   if(!pru_running){
+      fprintf(stderr, "libbeaglebone_pruio: PRU0 is not running.\n");
+      return 1;
+   }
+   volatile unsigned int *start = &(beaglebone_pruio_shared_ram[COMMAND_BUFFER_START]);
+   volatile unsigned int *end = &(beaglebone_pruio_shared_ram[COMMAND_BUFFER_END]);
+   volatile unsigned int *data = &(beaglebone_pruio_shared_ram[COMMAND_BUFFER_DATA]);
+
+   // PRU0 empties the buffer every frame, wait a few frames if full.
+   int attempt;
+   for(attempt=0; attempt<100; ++attempt){
+      unsigned int s = __atomic_load_n(start, __ATOMIC_ACQUIRE);
+      if(*end != (s ^ COMMAND_BUFFER_SIZE)){
          break;
+      }
+      usleep(100);
    }
+   if(attempt == 100){
+      fprintf(stderr, "libbeaglebone_pruio: PRU0 is not reading commands.\n");
+      return 1;
+   }
+
+   unsigned int position = *end & (COMMAND_BUFFER_SIZE-1);
+   data[position] = (command << 24) | (number & 0xFF);
+   data[position+1] = parameter;
+   __atomic_store_n(end, (*end + 2) & (2*COMMAND_BUFFER_SIZE - 1), __ATOMIC_RELEASE);
    return 0;
 }
 
-static int get_gpio_config_file(int gpio_number, char* path){
-   char pin_name[256] = "";
-   if(get_gpio_pin_name(gpio_number, pin_name)){
-      return 1; 
+static int wait_for_commands(){
+   // Wait until PRU0 has read all commands sent so far.
+   volatile unsigned int *start = &(beaglebone_pruio_shared_ram[COMMAND_BUFFER_START]);
+   volatile unsigned int *end = &(beaglebone_pruio_shared_ram[COMMAND_BUFFER_END]);
+   int attempt;
+   for(attempt=0; attempt<1000; ++attempt){
+      if(__atomic_load_n(start, __ATOMIC_ACQUIRE) == *end){
+         return 0;
+      }
+      usleep(100);
    }
+   fprintf(stderr, "libbeaglebone_pruio: PRU0 is not reading commands.\n");
+   return 1;
+}
 
-   char tmp[256] = "/sys/devices/platform/ocp/ocp:";
-   strcat(tmp, pin_name);
-   strcat(tmp, "_mux/state");
-   strcpy(path, tmp);
-   return 0;
+/////////////////////////////////////////////////////////////////////
+// SCAN RATE
+//
 
-   // look for a path that looks like ocp.* in /sys/devices/
-   /* DIR *dir = opendir("/sys/devices/"); */
-   /* if(dir==NULL){ */
-   /*    return 1; */
-   /* } */
-   /* struct dirent* dir_info; */
-   /* while(dir){ */
-   /*    dir_info = readdir(dir); */
-   /*    if(dir_info==NULL){ */
-   /*       closedir(dir); */
-   /*       return 1; */
-   /*    } */
-   /*    // Substring "ocp." */
-   /*    if(strstr(dir_info->d_name, "ocp.")!=NULL){ */
-   /*       strcat(tmp, "/sys/devices/"); */
-   /*       strcat(tmp, dir_info->d_name); */
-   /*       strcat(tmp, "/"); */
-   /*  */
-   /*       DIR *dir2 = opendir(tmp); */
-   /*       if(dir2==NULL){ */
-   /*          return 1; */
-   /*       } */
-   /*       while(dir2){ */
-   /*          dir_info = readdir(dir2); */
-   /*          if(dir_info==NULL){ */
-   /*             closedir(dir2); */
-   /*             closedir(dir); */
-   /*             return 1; */
-   /*          } */
-   /*          // Substring pin name */
-   /*          if(strstr(dir_info->d_name, pin_name)!=NULL){ */
-   /*             strcat(tmp, dir_info->d_name); */
-   /*             strcat(tmp, "/state"); */
-   /*             break; // while dir2 */
-   /*          } */
-   /*       } */
-   /*       closedir(dir2); */
-   /*       break; // while dir1 */
-   /*    } */
-   /* } */
-   /* closedir(dir); */
-   /* strcpy(path, tmp); */
-   return 0;
+static unsigned int frame_period = FRAME_PERIOD_DEFAULT;
+
+static int send_frame_period(unsigned int period){
+   return send_command(COMMAND_SET_FRAME_PERIOD, 0, period) || wait_for_commands();
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -344,12 +198,23 @@ typedef struct adc_channel{
    unsigned char parameter1;
    unsigned char parameter2;
    unsigned char parameter3;
+   unsigned char filter;
 } adc_channel;
 
 static adc_channel used_adc_channels[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
 static int used_adc_channels_count = 0;
 
+static unsigned int adc_channel_config(adc_channel *channel){
+   // See comments in definitions.h
+   return (channel->mode << 28) | (channel->filter << 24) | (channel->parameter3 << 16) | (channel->parameter2 << 8) | (channel->parameter1);
+}
+
 static int init_adc_channel(unsigned char channel_number, beaglebone_pruio_adc_mode mode, unsigned char parameter1, unsigned char parameter2, unsigned char parameter3){
+   if(channel_number >= beaglebone_pruio_get_adc_channel_count()){
+      fprintf(stderr, "libbeaglebone_pruio: ADC channel out of range.\n");
+      return 1;
+   }
+
    // Check if channel already in use.
    int i;
    for(i=0; i<used_adc_channels_count; ++i){
@@ -371,155 +236,420 @@ static int init_adc_channel(unsigned char channel_number, beaglebone_pruio_adc_m
    new_channel.parameter1 = parameter1;
    new_channel.parameter2 = parameter2;
    new_channel.parameter3 = parameter3;
-   used_adc_channels[used_adc_channels_count] = new_channel;
-   used_adc_channels_count++;
+   new_channel.filter = 0;
 
    /** 
     * Tell the PRU unit that we are interested in input from this channel.
     * See comments in definitions.h
     */
-   unsigned int config = (mode << 28) | (parameter3 << 16) | (parameter2 << 8) | (parameter1);
-   beaglebone_pruio_shared_ram[ADC0_CONFIG+channel_number] = config;
+   if(send_command(COMMAND_SET_ADC_CHANNEL, channel_number, adc_channel_config(&new_channel))){
+      return 1;
+   }
+
+   used_adc_channels[used_adc_channels_count] = new_channel;
+   used_adc_channels_count++;
 
    return 0;
 }
 
+static int set_adc_channel_filter(unsigned char channel_number, unsigned char filter){
+   int i;
+   for(i=0; i<used_adc_channels_count; ++i){
+      if(used_adc_channels[i].channel_number==channel_number){
+         adc_channel channel = used_adc_channels[i];
+         channel.filter = filter;
+         if(send_command(COMMAND_SET_ADC_CHANNEL, channel_number, adc_channel_config(&channel))){
+            return 1;
+         }
+         used_adc_channels[i] = channel;
+         return 0;
+      }
+   }
+   return 1;
+}
+
+static int deinit_adc_channel(unsigned char channel_number){
+   int i;
+   for(i=0; i<used_adc_channels_count; ++i){
+      if(used_adc_channels[i].channel_number==channel_number){
+         // Mode 0 turns the channel off in the PRU.
+         if(send_command(COMMAND_SET_ADC_CHANNEL, channel_number, BEAGLEBONE_PRUIO_ADC_MODE_OFF << 28)){
+            return 1;
+         }
+         used_adc_channels_count--;
+         used_adc_channels[i] = used_adc_channels[used_adc_channels_count];
+         return 0;
+      }
+   }
+   return 1;
+}
+
 /////////////////////////////////////////////////////////////////////
 // PRU Initialization
 //
 
-int beaglebone_pruio_load_device_tree_overlay(char* dto){
-   // Check if the device tree overlay is loaded, load if needed.
-   int device_tree_overlay_loaded = 0; 
-   FILE* f;
-   f = fopen("/sys/devices/platform/bone_capemgr/slots","rt");
-   if(f==NULL){
-      return 1;
+// Set once the backend is open. beaglebone_pruio_stop() keeps it open,
+// so starting again is quick.
+static int pru_system_ready = 0;
+static int event_fd = -1;
+
+/////////////////////////////////////////////////////////////////////////
+// Ring buffer (see header file for more)
+//
+
+static int timestamps_enabled = 0;
+static beaglebone_pruio_overflow_policy overflow_policy = BEAGLEBONE_PRUIO_OVERFLOW_DROP_NEWEST;
+
+// Adc options, see comments in definitions.h
+static unsigned int adc_averaging = 0;
+static unsigned int adc_threshold = 0; // 0 is one shot mode
+
+// One bit for each gpio pin used as input, one word per gpio module.
+static unsigned int input_pins[4];
+
+static void buffer_init(){
+   int i;
+   // Channels are configured by sending commands to the PRU, see 
+   // comments in definitions.h
+   beaglebone_pruio_shared_ram[COMMAND_BUFFER_START] = 0;
+   beaglebone_pruio_shared_ram[COMMAND_BUFFER_END] = 0;
+   beaglebone_pruio_shared_ram[PRU_STATE] = PRU_STATE_STOPPED;
+   for(i=0; i<4; ++i){
+      input_pins[i] = 0;
    }
-   char line[256];
-   while(fgets(line, 256, f) != NULL){
-      if(strstr(line, dto) != NULL){
-         device_tree_overlay_loaded = 1; 
-      }
+
+   // Read once by the PRU at startup.
+   unsigned int options = (overflow_policy << MESSAGE_OPTIONS_OVERFLOW_SHIFT) & MESSAGE_OPTIONS_OVERFLOW_MASK;
+   if(timestamps_enabled){
+      options |= MESSAGE_OPTIONS_TIMESTAMPS;
+      beaglebone_pruio_message_size = 2;
+   }
+   else{
+      beaglebone_pruio_message_size = 1;
+   }
+   beaglebone_pruio_shared_ram[MESSAGE_OPTIONS] = options;
+
+   options = adc_averaging & ADC_OPTIONS_AVERAGING_MASK;
+   if(adc_threshold > 0){
+      options |= ADC_OPTIONS_CONTINUOUS;
+      options |= (adc_threshold << ADC_OPTIONS_THRESHOLD_SHIFT) & ADC_OPTIONS_THRESHOLD_MASK;
+   }
+   beaglebone_pruio_shared_ram[ADC_OPTIONS] = options;
+
+   unsigned int pins = 0;
+   for(i=0; i<adc_mux_pin_count; ++i){
+      pins |= (adc_mux_pins[i] & 0xFF) << (8*i);
+   }
+   beaglebone_pruio_shared_ram[ADC_MUX] = (adc_mux_ains & ADC_MUX_AINS_MASK) | (adc_mux_pin_count << ADC_MUX_PINS_SHIFT);
+   beaglebone_pruio_shared_ram[ADC_MUX_SELECT] = pins;
+   beaglebone_pruio_shared_ram[ADC_MUX_SETTLE] = adc_mux_settle;
+
+   beaglebone_pruio_shared_ram[MATRIX] = matrix_options | matrix_row_count | (matrix_column_count << MATRIX_COLUMNS_SHIFT);
+   for(i=0; i<2; ++i){
+      beaglebone_pruio_shared_ram[MATRIX_ROW_PINS + i] = 0;
+   }
+   for(i=0; i<4; ++i){
+      beaglebone_pruio_shared_ram[MATRIX_COLUMN_PINS + i] = 0;
+   }
+   for(i=0; i<matrix_row_count; ++i){
+      beaglebone_pruio_shared_ram[MATRIX_ROW_PINS + i/4] |= (matrix_rows[i] & 0xFF) << (8*(i%4));
+   }
+   for(i=0; i<matrix_column_count; ++i){
+      beaglebone_pruio_shared_ram[MATRIX_COLUMN_PINS + i/4] |= (matrix_columns[i] & 0xFF) << (8*(i%4));
    }
-   fclose(f);
 
-   if(!device_tree_overlay_loaded){
-      f = fopen("/sys/devices/platform/bone_capemgr/slots","w");
-      if(f==NULL){
+   // Pointer values are inited to 0 in pru
+   beaglebone_pruio_ring* ring = &beaglebone_pruio_adc_ring;
+   ring->data = &(beaglebone_pruio_shared_ram[ADC_RING_BUFFER_DATA]);
+   ring->size = ADC_RING_BUFFER_SIZE;
+   ring->start = &(beaglebone_pruio_shared_ram[ADC_RING_BUFFER_START]);
+   ring->end = &(beaglebone_pruio_shared_ram[ADC_RING_BUFFER_END]);
+   ring->skipped = &(beaglebone_pruio_shared_ram[ADC_RING_BUFFER_SKIPPED]);
+   ring->skipped_ack = &(beaglebone_pruio_shared_ram[ADC_RING_BUFFER_SKIPPED_ACK]);
+
+   ring = &beaglebone_pruio_gpio_ring;
+   ring->data = &(beaglebone_pruio_shared_ram[GPIO_RING_BUFFER_DATA]);
+   ring->size = GPIO_RING_BUFFER_SIZE;
+   ring->start = &(beaglebone_pruio_shared_ram[GPIO_RING_BUFFER_START]);
+   ring->end = &(beaglebone_pruio_shared_ram[GPIO_RING_BUFFER_END]);
+   ring->skipped = &(beaglebone_pruio_shared_ram[GPIO_RING_BUFFER_SKIPPED]);
+   ring->skipped_ack = &(beaglebone_pruio_shared_ram[GPIO_RING_BUFFER_SKIPPED_ACK]);
+}
+
+/////////////////////////////////////////////////////////////////////
+// "Public" functions.
+//
+
+int beaglebone_pruio_start(){
+   if(pru_running){
+      return 0;
+   }
+
+   // Only needed the first time or after beaglebone_pruio_close().
+   if(!pru_system_ready){
+      volatile void *gpio_modules[4];
+      if(beaglebone_pruio_backend_open(&beaglebone_pruio_shared_ram, gpio_modules, &event_fd)){
          return 1;
       }
-      fprintf(f, "%s", dto);
-      fclose(f);
+      map_gpio_registers(gpio_modules);
+      pru_system_ready = 1;
    }
 
-   usleep(100000);
+   buffer_init();
+
+   if(beaglebone_pruio_backend_start_pru0()){
+      fprintf(stderr, "libbeaglebone_pruio: Could not load PRU0 program.\n");
+      return 1;
+   }
+
+   pru_running = 1;
+
+   if(frame_period != FRAME_PERIOD_DEFAULT && send_frame_period(frame_period)){
+      frame_period = FRAME_PERIOD_DEFAULT;
+   }
+
+   if(init_gpio()){
+      fprintf(stderr, "libbeaglebone_pruio: Could not init GPIO.\n");
+      return 1;
+   }
 
    return 0;
 }
 
-static int load_device_tree_overlays(){
-   if(beaglebone_pruio_load_device_tree_overlay("PRUIO-DTO")){
+int beaglebone_pruio_set_timestamps(int enabled){
+   // The PRU reads this option only once when it starts.
+   if(pru_running){
       return 1;
    }
+   timestamps_enabled = (enabled != 0);
    return 0;
 }
 
-static int init_pru_system(){
-   tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
-   if(prussdrv_init()) return 1;
-   if(prussdrv_open(PRU_EVTOUT_0)) return 1;
-   if(prussdrv_pruintc_init(&pruss_intc_initdata)) return 1;
+int beaglebone_pruio_set_overflow_policy(beaglebone_pruio_overflow_policy policy){
+   // The PRU reads this option only once when it starts.
+   if(pru_running){
+      return 1;
+   }
+   overflow_policy = policy;
+   return 0;
+}
 
-   // Get pointer to shared ram
-   void* p;
-   if(prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, &p)) return 1;
-   beaglebone_pruio_shared_ram = (volatile unsigned int*)p;
+int beaglebone_pruio_set_adc_averaging(int samples){
+   // The PRU reads this option only once when it starts.
+   if(pru_running){
+      return 1;
+   }
+   // The adc averages 2^n samples.
+   unsigned int n;
+   for(n=0; n<=ADC_AVERAGING_MAX; n++){
+      if(samples == (1<<n)){
+         adc_averaging = n;
+         return 0;
+      }
+   }
+   fprintf(stderr, "libbeaglebone_pruio: ADC averaging must be 1, 2, 4, 8 or 16 samples.\n");
+   return 1;
+}
 
+int beaglebone_pruio_set_adc_continuous(int sequences){
+   // The PRU reads this option only once when it starts.
+   if(pru_running){
+      return 1;
+   }
+   if(sequences < 0 || sequences > ADC_THRESHOLD_MAX){
+      fprintf(stderr, "libbeaglebone_pruio: ADC fifo threshold out of range.\n");
+      return 1;
+   }
+   adc_threshold = sequences;
    return 0;
 }
 
-static int start_pru0_program(){
-   char path[512] = "";
-   strcat(path, BEAGLEBONE_PRUIO_PREFIX); 
-   strcat(path, "/lib/libbeaglebone_pruio_data0.bin");
-   if(prussdrv_load_datafile(0, path)) return 1;
+int beaglebone_pruio_set_adc_mux(unsigned int ain_mask, const int *select_pins, int select_pin_count, int settle_ns){
+   // The PRU reads this option only once when it starts.
+   if(pru_running){
+      return 1;
+   }
+   if(ain_mask & ~ADC_MUX_AINS_MASK){
+      fprintf(stderr, "libbeaglebone_pruio: ADC mux inputs must be AIN0 to AIN6.\n");
+      return 1;
+   }
+   if(select_pin_count < 0 || select_pin_count > ADC_MUX_MAX_PINS || (ain_mask != 0 && select_pin_count == 0) || settle_ns < 0){
+      fprintf(stderr, "libbeaglebone_pruio: ADC mux needs 1 to 4 select pins.\n");
+      return 1;
+   }
+   if(ain_mask == 0){
+      select_pin_count = 0;
+   }
 
-   strcpy(path, BEAGLEBONE_PRUIO_PREFIX); 
-   strcat(path, "/lib/libbeaglebone_pruio_text0.bin");
-   if(prussdrv_exec_program_at(0, path, BEAGLEBONE_PRUIO_START_ADDR_0)) return 1;
+   // Channels: one per input without a mux, 2^n per input with a mux.
+   int i, count = 0;
+   for(i=0; i<ADC_AINS; ++i){
+      count += (ain_mask & (1<<i)) ? (1<<select_pin_count) : 1;
+   }
+   if(count > BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS){
+      fprintf(stderr, "libbeaglebone_pruio: Too many ADC channels for this mux setup.\n");
+      return 1;
+   }
+   for(i=0; i<select_pin_count; ++i){
+      if(select_pins[i] < 0 || select_pins[i] >= BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS){
+         fprintf(stderr, "libbeaglebone_pruio: Wrong ADC mux select pin.\n");
+         return 1;
+      }
+   }
 
+   adc_mux_ains = ain_mask;
+   adc_mux_pin_count = select_pin_count;
+   for(i=0; i<ADC_MUX_MAX_PINS; ++i){
+      adc_mux_pins[i] = i<select_pin_count ? select_pins[i] : 0;
+   }
+   // The adc clock is 24MHz, 24 cycles per microsecond. Open delay has
+   // 18 bits.
+   unsigned int settle = ((unsigned int)settle_ns * 24 + 999) / 1000;
+   adc_mux_settle = settle > 0x3ffff ? 0x3ffff : settle;
    return 0;
 }
 
-/////////////////////////////////////////////////////////////////////////
-// Ring buffer (see header file for more)
-//
+int beaglebone_pruio_set_matrix(const int *row_pins, int row_count, const int *column_pins, int column_count, int debounce_scans, int diodes){
+   // The PRU reads this option only once when it starts.
+   if(pru_running){
+      return 1;
+   }
+   if(row_count < 0 || row_count > BEAGLEBONE_PRUIO_MAX_MATRIX_ROWS || column_count < 0 || column_count > BEAGLEBONE_PRUIO_MAX_MATRIX_COLUMNS || (row_count == 0) != (column_count == 0)){
+      fprintf(stderr, "libbeaglebone_pruio: Key matrix needs 1 to 8 rows and 1 to 16 columns.\n");
+      return 1;
+   }
+   if(debounce_scans < 0 || debounce_scans > MATRIX_DEBOUNCE_MAX){
+      fprintf(stderr, "libbeaglebone_pruio: Key matrix debounce out of range.\n");
+      return 1;
+   }
+   int i, j;
+   for(i=0; i<row_count+column_count; ++i){
+      int pin = i<row_count ? row_pins[i] : column_pins[i-row_count];
+      int repeated = 0;
+      for(j=0; j<i; ++j){
+         repeated |= pin == (j<row_count ? row_pins[j] : column_pins[j-row_count]);
+      }
+      if(pin < 0 || pin >= BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS || repeated){
+         fprintf(stderr, "libbeaglebone_pruio: Wrong key matrix pin.\n");
+         return 1;
+      }
+   }
 
-static void buffer_init(){
-   // These shared ram positions control which adc and gpio channels
-   // we want to receive data from, see comments in definitions.h
-   beaglebone_pruio_shared_ram[GPIO0_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[GPIO1_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[GPIO2_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[GPIO3_CONFIG] = 0;
-
-   // These positions hold the options/parameters for each of the 14
-   // adc channels
-   beaglebone_pruio_shared_ram[ADC0_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC1_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC2_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC3_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC4_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC5_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC6_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC7_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC8_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC9_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC10_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC11_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC12_CONFIG] = 0;
-   beaglebone_pruio_shared_ram[ADC13_CONFIG] = 0;
-
-
-   beaglebone_pruio_buffer_size = RING_BUFFER_SIZE;
-   beaglebone_pruio_buffer_start = &(beaglebone_pruio_shared_ram[RING_BUFFER_START]); // value inited to 0 in pru
-   beaglebone_pruio_buffer_end = &(beaglebone_pruio_shared_ram[RING_BUFFER_END]); // value inited to 0 in pru
+   matrix_row_count = row_count;
+   for(i=0; i<row_count; ++i){
+      matrix_rows[i] = row_pins[i];
+   }
+   matrix_column_count = column_count;
+   for(i=0; i<column_count; ++i){
+      matrix_columns[i] = column_pins[i];
+   }
+   matrix_options = (debounce_scans << MATRIX_DEBOUNCE_SHIFT) | (diodes ? MATRIX_DIODES : 0);
+   return 0;
 }
 
-/////////////////////////////////////////////////////////////////////
-// "Public" functions.
-//
-
-int beaglebone_pruio_start(){
-   if(load_device_tree_overlays()){
-      fprintf(stderr, "libbeaglebone_pruio: Could not load device tree overlays.\n");
-      return 1;
+int beaglebone_pruio_get_adc_channel_count(){
+   int i, count = 0;
+   for(i=0; i<ADC_AINS; ++i){
+      count += (adc_mux_ains & (1<<i)) ? (1<<adc_mux_pin_count) : 1;
    }
+   return count;
+}
 
-   if(map_device_registers()){
-      fprintf(stderr, "libbeaglebone_pruio: Could not map device's registers to memory.\n");
+int beaglebone_pruio_set_scan_rate(int samples_per_second){
+   if(samples_per_second <= 0){
       return 1;
    }
 
-   if(init_pru_system()){
-      fprintf(stderr, "libbeaglebone_pruio: Could not init PRU system.\n");
+   // Each adc channel gets a new value every 8 frames, see comments in 
+   // definitions.h. The product doesn't fit in 32 bits for large rates.
+   unsigned int period = 1000000000 / ((unsigned long long)samples_per_second * 8);
+   if(period < FRAME_PERIOD_MIN || period > FRAME_PERIOD_MAX){
+      fprintf(stderr, "libbeaglebone_pruio: Scan rate out of range.\n");
       return 1;
    }
 
-   buffer_init();
+   // Sent to the PRU when it starts.
+   if(!pru_running){
+      frame_period = period;
+      return 0;
+   }
 
-   if(start_pru0_program()){
-      fprintf(stderr, "libbeaglebone_pruio: Could not load PRU0 program.\n");
+   if(send_frame_period(period)){
       return 1;
    }
+   frame_period = period;
+   return 0;
+}
 
-   if(init_gpio()){
-      fprintf(stderr, "libbeaglebone_pruio: Could not init GPIO.\n");
-      return 1;
+int beaglebone_pruio_get_scan_rate(){
+   return 1000000000 / (frame_period * 8);
+}
+
+static void get_lane_stats(beaglebone_pruio_lane_stats *stats, unsigned int dropped, unsigned int high_watermark, unsigned int size){
+   // Values are in buffer positions, convert to messages.
+   unsigned int shift = beaglebone_pruio_message_size - 1;
+   stats->dropped = beaglebone_pruio_shared_ram[dropped];
+   stats->high_watermark = beaglebone_pruio_shared_ram[high_watermark] >> shift;
+   stats->size = size >> shift;
+}
+
+void beaglebone_pruio_get_buffer_stats(beaglebone_pruio_buffer_stats *stats){
+   get_lane_stats(&stats->gpio, GPIO_RING_BUFFER_DROPPED, GPIO_RING_BUFFER_HIGH_WATERMARK, GPIO_RING_BUFFER_SIZE);
+   get_lane_stats(&stats->adc, ADC_RING_BUFFER_DROPPED, ADC_RING_BUFFER_HIGH_WATERMARK, ADC_RING_BUFFER_SIZE);
+}
+
+static void get_phase_timing(beaglebone_pruio_phase_timing *timing, unsigned int phase){
+   // See comments for timing stats in definitions.h
+   volatile unsigned int *stats = &(beaglebone_pruio_shared_ram[TIMING_STATS + 3*phase]);
+   timing->min = stats[0];
+   timing->average = stats[1];
+   timing->max = stats[2];
+   if(timing->min == 0xFFFFFFFF){ // No frames measured yet.
+      timing->min = 0;
    }
+}
 
-   return 0;
+void beaglebone_pruio_get_timing(beaglebone_pruio_timing *timing){
+   get_phase_timing(&timing->buffer, TIMING_PHASE_BUFFER);
+   get_phase_timing(&timing->adc, TIMING_PHASE_ADC);
+   get_phase_timing(&timing->gpio, TIMING_PHASE_GPIO);
+   get_phase_timing(&timing->state, TIMING_PHASE_STATE);
+   get_phase_timing(&timing->commands, TIMING_PHASE_COMMANDS);
+   get_phase_timing(&timing->frame, TIMING_PHASE_FRAME);
+   timing->frame_cycles = frame_period / 5;
+   timing->overruns = beaglebone_pruio_shared_ram[TIMING_OVERRUNS];
+}
+
+int beaglebone_pruio_reset_timing(){
+   return send_command(COMMAND_RESET_TIMING, 0, 0);
+}
+
+int beaglebone_pruio_get_snapshot(beaglebone_pruio_snapshot *snapshot){
+   // See comments for the state table in definitions.h
+   volatile unsigned int *sequence = &(beaglebone_pruio_shared_ram[STATE_SEQUENCE]);
+   int attempt, i;
+   for(attempt=0; attempt<100; ++attempt){
+      unsigned int before = __atomic_load_n(sequence, __ATOMIC_ACQUIRE);
+      if(before & 1){
+         continue; // PRU is writing
+      }
+
+      snapshot->timestamp = beaglebone_pruio_shared_ram[STATE_TIMESTAMP];
+      for(i=0; i<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; ++i){
+         snapshot->adc_values[i] = beaglebone_pruio_shared_ram[STATE_ADC0+i];
+      }
+      for(i=0; i<4; ++i){
+         // Gpio values in messages are inverted pin levels, do the same 
+         // here. Only input pins are meaningful.
+         snapshot->gpio_values[i] = ~beaglebone_pruio_shared_ram[STATE_GPIO0+i] & input_pins[i];
+      }
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if(*sequence == before){
+         return 0;
+      }
+   }
+   return 1;
 }
 
 int beaglebone_pruio_init_adc_pin(int channel_number, int bits){
@@ -530,93 +660,526 @@ int beaglebone_pruio_init_adc_pin_with_ranges(int channel_number, int ranges){
    return init_adc_channel((unsigned char)channel_number, BEAGLEBONE_PRUIO_ADC_MODE_RANGES, ranges, 0, 0);
 }
 
-int beaglebone_pruio_init_gpio_pin(int gpio_number, beaglebone_pruio_gpio_mode mode){
-   // Check if pin already in use.
+int beaglebone_pruio_init_adc_pin_with_deadband(int channel_number, int bits, int deadband){
+   if(deadband < 0 || deadband > 255){
+      return 1;
+   }
+   return init_adc_channel((unsigned char)channel_number, BEAGLEBONE_PRUIO_ADC_MODE_DEADBAND, bits, deadband, 0);
+}
+
+int beaglebone_pruio_init_adc_pin_with_oversampling(int channel_number, int bits){
+   // Only channels without a mux are read every frame.
+   int i, first = 0, direct = 0;
+   for(i=0; i<ADC_AINS; ++i){
+      if(adc_mux_ains & (1<<i)){
+         first += 1<<adc_mux_pin_count;
+      }
+      else if(channel_number == first++){
+         direct = 1;
+      }
+   }
+   if(!direct || bits < 13 || bits > 16){
+      fprintf(stderr, "libbeaglebone_pruio: Oversampling is for 13 to 16 bits on ADC channels without a mux.\n");
+      return 1;
+   }
+   return init_adc_channel((unsigned char)channel_number, BEAGLEBONE_PRUIO_ADC_MODE_OVERSAMPLING, bits, 0, 0);
+}
+
+int beaglebone_pruio_set_adc_filter(int channel_number, int smoothing, int median){
+   if(smoothing < 0 || smoothing > ADC_FILTER_SMOOTHING_MASK){
+      return 1;
+   }
+   unsigned char filter = smoothing;
+   if(median){
+      filter |= ADC_FILTER_MEDIAN;
+   }
+   return set_adc_channel_filter((unsigned char)channel_number, filter);
+}
+
+int beaglebone_pruio_deinit_adc_pin(int channel_number){
+   return deinit_adc_channel((unsigned char)channel_number);
+}
+
+static int find_gpio_pin(int gpio_number){
    int i;
    for(i=0; i<used_pins_count; ++i){
-      gpio_pin pin = used_pins[i];
-      if(pin.gpio_number==gpio_number && pin.mode==mode){
-         return 0;
-      }
-      else if(pin.gpio_number==gpio_number && pin.mode!=mode){
-         return 1;
+      if(used_pins[i].gpio_number==gpio_number){
+         return i;
       }
    }
+   return -1;
+}
+
+static int set_gpio_direction(int gpio_number, unsigned int direction){
+   // While PRU0 runs it is the only writer of the output enable 
+   // registers (it scans key matrix rows with them), see comments for
+   // the set gpio direction command in definitions.h.
+   if(pru_running){
+      return send_command(COMMAND_SET_GPIO_DIRECTION, gpio_number, direction);
+   }
+
+   // Output enable bit cleared is an output, set is an input.
+   int gpio_module = gpio_number >> 5;
+   unsigned int bit = 1 << (gpio_number % 32);
+   volatile unsigned int* reg=NULL;
+   switch(gpio_module){
+      case 0: reg = gpio0_output_enable; break;
+      case 1: reg = gpio1_output_enable; break;
+      case 2: reg = gpio2_output_enable; break;
+      case 3: reg = gpio3_output_enable; break;
+   }
+   if(direction == GPIO_DIRECTION_OUTPUT){
+      *reg &= ~bit;
+   }
+   else{
+      *reg |= bit;
+   }
+   return 0;
+}
 
+static int setup_gpio_pin(int gpio_number, beaglebone_pruio_gpio_mode mode, int reserved){
    // Save new pin info;
    gpio_pin new_pin;
    new_pin.gpio_number = gpio_number;
    new_pin.mode = mode;
+   new_pin.reserved = reserved;
    used_pins[used_pins_count] = new_pin;
    used_pins_count++;
 
-   // Set the pinmux of the pin by writing to the appropriate config file
-   char path[256] = "";
-   if(get_gpio_config_file(gpio_number, path)){
+   // Set the pinmux of the pin
+   if(beaglebone_pruio_backend_set_pinmux(gpio_number, mode==BEAGLEBONE_PRUIO_GPIO_MODE_OUTPUT ? "output" : "input")){
       return 1;
    }
-   FILE *f = fopen(path, "w");
-   if(f==NULL){
+   return set_gpio_direction(gpio_number, mode == BEAGLEBONE_PRUIO_GPIO_MODE_OUTPUT ? GPIO_DIRECTION_OUTPUT : GPIO_DIRECTION_INPUT);
+}
+
+static void release_gpio_pin(int i){
+   if(used_pins[i].mode == BEAGLEBONE_PRUIO_GPIO_MODE_OUTPUT){
+      // Stop driving the pin.
+      set_gpio_direction(used_pins[i].gpio_number, GPIO_DIRECTION_INPUT);
+   }
+   used_pins_count--;
+   used_pins[i] = used_pins[used_pins_count];
+}
+
+// Pins used by encoders and other channels made of several pins. They
+// don't send messages of their own and can't be inited as plain pins.
+static int reserve_gpio_pin(int gpio_number, beaglebone_pruio_gpio_mode mode){
+   if(gpio_number < 0 || gpio_number >= BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS || find_gpio_pin(gpio_number) != -1){
       return 1;
    }
-   int gpio_module = gpio_number >> 5;
-   int gpio_bit = gpio_number % 32;
-   if(mode == BEAGLEBONE_PRUIO_GPIO_MODE_OUTPUT){
-      fprintf(f, "%s", "output"); 
-      // Clear the output enable bit in the gpio config register to actually enable output.
-      switch(gpio_module){
-         case 0: *gpio0_output_enable &= ~(1<<gpio_bit); break;
-         case 1: *gpio1_output_enable &= ~(1<<gpio_bit); break;
-         case 2: *gpio2_output_enable &= ~(1<<gpio_bit); break;
-         case 3: *gpio3_output_enable &= ~(1<<gpio_bit); break;
-      }
+   return setup_gpio_pin(gpio_number, mode, 1);
+}
+
+static void unreserve_gpio_pin(int gpio_number){
+   int i = find_gpio_pin(gpio_number);
+   if(i != -1 && used_pins[i].reserved){
+      release_gpio_pin(i);
    }
-   else{
-      fprintf(f, "%s", "input"); 
-      // Set the output enable bit in the gpio config register to disable output.
-      switch(gpio_module){
-         case 0: *gpio0_output_enable |= (1<<gpio_bit); break;
-         case 1: *gpio1_output_enable |= (1<<gpio_bit); break;
-         case 2: *gpio2_output_enable |= (1<<gpio_bit); break;
-         case 3: *gpio3_output_enable |= (1<<gpio_bit); break;
+}
+
+int beaglebone_pruio_init_gpio_pin(int gpio_number, beaglebone_pruio_gpio_mode mode){
+   // Check if pin already in use.
+   int i = find_gpio_pin(gpio_number);
+   if(i != -1){
+      gpio_pin pin = used_pins[i];
+      if(pin.mode==mode && !pin.reserved){
+         return 0;
       }
+      else{
+         return 1;
+      }
+   }
 
+   if(setup_gpio_pin(gpio_number, mode, 0)){
+      return 1;
+   }
+   if(mode == BEAGLEBONE_PRUIO_GPIO_MODE_INPUT){
       /** 
        * Tell the PRU unit that we are interested in input from this pin.
        * See comments in definitions.h
        */
-      beaglebone_pruio_shared_ram[gpio_module+GPIO0_CONFIG] |= (1<<gpio_bit);
+      if(send_command(COMMAND_ADD_GPIO_INPUT, gpio_number, 0)){
+         return 1;
+      }
+      input_pins[gpio_number >> 5] |= (1<<(gpio_number % 32));
    }
  
-   fclose(f);
    return 0;
 }
 
+int beaglebone_pruio_deinit_gpio_pin(int gpio_number){
+   int i = find_gpio_pin(gpio_number);
+   if(i == -1 || used_pins[i].reserved){
+      return 1;
+   }
+
+   if(used_pins[i].mode == BEAGLEBONE_PRUIO_GPIO_MODE_INPUT){
+      // Tell the PRU unit to stop sending messages for this pin.
+      if(send_command(COMMAND_REMOVE_GPIO_INPUT, gpio_number, 0)){
+         return 1;
+      }
+      input_pins[gpio_number >> 5] &= ~(1<<(gpio_number % 32));
+   }
+   release_gpio_pin(i);
+   return 0;
+}
+
+int beaglebone_pruio_set_gpio_debounce(int gpio_number, int microseconds){
+   if(gpio_number < 0 || gpio_number >= BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS || !(input_pins[gpio_number >> 5] & (1 << (gpio_number % 32)))){
+      fprintf(stderr, "libbeaglebone_pruio: GPIO debounce is only for input pins.\n");
+      return 1;
+   }
+   if(microseconds < 0 || microseconds > GPIO_DEBOUNCE_MAX/1000){
+      fprintf(stderr, "libbeaglebone_pruio: GPIO debounce time out of range.\n");
+      return 1;
+   }
+   // See comments for the command in definitions.h
+   return send_command(COMMAND_SET_GPIO_DEBOUNCE, gpio_number, (unsigned int)microseconds * 1000);
+}
+
+int beaglebone_pruio_set_gpio_hardware_debounce(int gpio_number, int microseconds){
+   if(gpio_number < 0 || gpio_number >= BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS || !(input_pins[gpio_number >> 5] & (1 << (gpio_number % 32)))){
+      fprintf(stderr, "libbeaglebone_pruio: GPIO debounce is only for input pins.\n");
+      return 1;
+   }
+   if(microseconds < 0 || microseconds > 31*256){
+      fprintf(stderr, "libbeaglebone_pruio: GPIO hardware debounce time out of range.\n");
+      return 1;
+   }
+   // The module debounces for (n + 1) * 31 microseconds. See comments 
+   // for the command in definitions.h
+   unsigned int parameter = 0;
+   if(microseconds > 0){
+      unsigned int n = (microseconds + 30) / 31;
+      parameter = GPIO_HARDWARE_DEBOUNCE_ENABLE | (n - 1);
+   }
+   return send_command(COMMAND_SET_GPIO_HARDWARE_DEBOUNCE, gpio_number, parameter);
+}
+
+static int find_pwm_slot(int gpio_number);
+
 void beaglebone_pruio_set_pin_value(int gpio_number, int value){
+   // PRU0 drives pwm outputs and matrix rows.
+   int i;
+   for(i=0; i<matrix_row_count; ++i){
+      if(matrix_rows[i] == gpio_number){
+         fprintf(stderr, "libbeaglebone_pruio: Pin is a key matrix row.\n");
+         return;
+      }
+   }
+   if(find_pwm_slot(gpio_number) >= 0){
+      fprintf(stderr, "libbeaglebone_pruio: Pin is a pwm output.\n");
+      return;
+   }
+
+   // Set and clear data out registers only change this pin, a read, 
+   // modify, write of data out could undo edges PRU0 writes meanwhile.
    int gpio_module = gpio_number >> 5;
    int gpio_bit = gpio_number % 32;
    volatile unsigned int* reg=NULL;
-   switch(gpio_module){
-      case 0: reg = gpio0_data_out; break;
-      case 1: reg = gpio1_data_out; break;
-      case 2: reg = gpio2_data_out; break;
-      case 3: reg = gpio3_data_out; break;
-   }
-
    if(value==1){
-      *reg |= (1<<gpio_bit);
+      switch(gpio_module){
+         case 0: reg = gpio0_set_data_out; break;
+         case 1: reg = gpio1_set_data_out; break;
+         case 2: reg = gpio2_set_data_out; break;
+         case 3: reg = gpio3_set_data_out; break;
+      }
    }
    else{
-      *reg &= ~(1<<gpio_bit);
+      switch(gpio_module){
+         case 0: reg = gpio0_clear_data_out; break;
+         case 1: reg = gpio1_clear_data_out; break;
+         case 2: reg = gpio2_clear_data_out; break;
+         case 3: reg = gpio3_clear_data_out; break;
+      }
    }
+   *reg = 1<<gpio_bit;
 }
 
-int beaglebone_pruio_stop(){
-   // TODO: send terminate message to PRU
+/////////////////////////////////////////////////////////////////////
+// ENCODERS
+
+typedef struct encoder{
+   int gpio_number_a;
+   int gpio_number_b;
+} encoder;
+static encoder used_encoders[BEAGLEBONE_PRUIO_MAX_ENCODERS];
+static int used_encoders_count = 0;
+
+int beaglebone_pruio_init_encoder(int gpio_number_a, int gpio_number_b, int steps_per_count, int acceleration){
+   unsigned int steps_shift;
+   switch(steps_per_count){
+      case 1: steps_shift = 0; break;
+      case 2: steps_shift = 1; break;
+      case 4: steps_shift = 2; break;
+      default:
+         fprintf(stderr, "libbeaglebone_pruio: Encoder steps per count must be 1, 2 or 4.\n");
+         return 1;
+   }
+   if(acceleration < 0 || acceleration > 15){
+      fprintf(stderr, "libbeaglebone_pruio: Encoder acceleration out of range.\n");
+      return 1;
+   }
+   if(used_encoders_count >= BEAGLEBONE_PRUIO_MAX_ENCODERS){
+      fprintf(stderr, "libbeaglebone_pruio: Too many encoders.\n");
+      return 1;
+   }
+   if(gpio_number_a == gpio_number_b || reserve_gpio_pin(gpio_number_a, BEAGLEBONE_PRUIO_GPIO_MODE_INPUT)){
+      return 1;
+   }
+   if(reserve_gpio_pin(gpio_number_b, BEAGLEBONE_PRUIO_GPIO_MODE_INPUT)){
+      unreserve_gpio_pin(gpio_number_a);
+      return 1;
+   }
+
+   // See comments for the command in definitions.h
+   unsigned int parameter = ENCODER_ENABLE | gpio_number_b | (steps_shift << ENCODER_STEPS_SHIFT) | (acceleration << ENCODER_ACCELERATION_SHIFT);
+   if(send_command(COMMAND_SET_ENCODER, gpio_number_a, parameter)){
+      unreserve_gpio_pin(gpio_number_a);
+      unreserve_gpio_pin(gpio_number_b);
+      return 1;
+   }
+
+   used_encoders[used_encoders_count].gpio_number_a = gpio_number_a;
+   used_encoders[used_encoders_count].gpio_number_b = gpio_number_b;
+   used_encoders_count++;
+   return 0;
+}
+
+int beaglebone_pruio_deinit_encoder(int gpio_number_a){
+   int i;
+   for(i=0; i<used_encoders_count; ++i){
+      if(used_encoders[i].gpio_number_a == gpio_number_a){
+         if(send_command(COMMAND_SET_ENCODER, gpio_number_a, 0)){
+            return 1;
+         }
+         unreserve_gpio_pin(gpio_number_a);
+         unreserve_gpio_pin(used_encoders[i].gpio_number_b);
+         used_encoders_count--;
+         used_encoders[i] = used_encoders[used_encoders_count];
+         return 0;
+      }
+   }
+   return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// VELOCITY KEYS
+
+typedef struct velocity_key{
+   int gpio_number_first;
+   int gpio_number_second;
+} velocity_key;
+static velocity_key used_velocity_keys[BEAGLEBONE_PRUIO_MAX_VELOCITY_KEYS];
+static int used_velocity_keys_count = 0;
+
+int beaglebone_pruio_init_velocity_key(int gpio_number_first, int gpio_number_second, int fastest_us){
+   // See comments for the command in definitions.h, the time is in 
+   // 1024ns units. Range is checked before converting so the 
+   // multiplication can't overflow.
+   if(fastest_us <= 0 || fastest_us > 0xFFFF * 1024 / 1000){
+      fprintf(stderr, "libbeaglebone_pruio: Velocity key fastest time out of range.\n");
+      return 1;
+   }
+   unsigned int fastest = ((unsigned int)fastest_us * 1000 + 1023) / 1024;
+   if(used_velocity_keys_count >= BEAGLEBONE_PRUIO_MAX_VELOCITY_KEYS){
+      fprintf(stderr, "libbeaglebone_pruio: Too many velocity keys.\n");
+      return 1;
+   }
+   if(gpio_number_first == gpio_number_second || reserve_gpio_pin(gpio_number_first, BEAGLEBONE_PRUIO_GPIO_MODE_INPUT)){
+      return 1;
+   }
+   if(reserve_gpio_pin(gpio_number_second, BEAGLEBONE_PRUIO_GPIO_MODE_INPUT)){
+      unreserve_gpio_pin(gpio_number_first);
+      return 1;
+   }
+
+   unsigned int parameter = VELOCITY_KEY_ENABLE | gpio_number_second | (fastest << VELOCITY_KEY_FASTEST_SHIFT);
+   if(send_command(COMMAND_SET_VELOCITY_KEY, gpio_number_first, parameter)){
+      unreserve_gpio_pin(gpio_number_first);
+      unreserve_gpio_pin(gpio_number_second);
+      return 1;
+   }
+
+   used_velocity_keys[used_velocity_keys_count].gpio_number_first = gpio_number_first;
+   used_velocity_keys[used_velocity_keys_count].gpio_number_second = gpio_number_second;
+   used_velocity_keys_count++;
+   return 0;
+}
+
+int beaglebone_pruio_deinit_velocity_key(int gpio_number_first){
+   int i;
+   for(i=0; i<used_velocity_keys_count; ++i){
+      if(used_velocity_keys[i].gpio_number_first == gpio_number_first){
+         if(send_command(COMMAND_SET_VELOCITY_KEY, gpio_number_first, 0)){
+            return 1;
+         }
+         unreserve_gpio_pin(gpio_number_first);
+         unreserve_gpio_pin(used_velocity_keys[i].gpio_number_second);
+         used_velocity_keys_count--;
+         used_velocity_keys[i] = used_velocity_keys[used_velocity_keys_count];
+         return 0;
+      }
+   }
+   return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// PWM OUTPUTS
+
+// Pin of each pwm slot, see comments in definitions.h
+static int pwm_pins[BEAGLEBONE_PRUIO_MAX_PWM_OUTPUTS];
+static unsigned int used_pwm_slots = 0;
+
+static int find_pwm_slot(int gpio_number){
+   int i;
+   for(i=0; i<BEAGLEBONE_PRUIO_MAX_PWM_OUTPUTS; ++i){
+      if((used_pwm_slots & (1<<i)) && pwm_pins[i] == gpio_number){
+         return i;
+      }
+   }
+   return -1;
+}
 
-   prussdrv_pru_disable(0);
-   prussdrv_exit();
+int beaglebone_pruio_init_pwm_pin(int gpio_number, int period_ns){
+   if(period_ns < PWM_PERIOD_MIN || period_ns > PWM_PERIOD_MAX){
+      fprintf(stderr, "libbeaglebone_pruio: PWM period out of range.\n");
+      return 1;
+   }
+   int slot = 0;
+   while(slot<BEAGLEBONE_PRUIO_MAX_PWM_OUTPUTS && (used_pwm_slots & (1<<slot))){
+      ++slot;
+   }
+   if(slot == BEAGLEBONE_PRUIO_MAX_PWM_OUTPUTS){
+      fprintf(stderr, "libbeaglebone_pruio: Too many PWM outputs.\n");
+      return 1;
+   }
+   if(reserve_gpio_pin(gpio_number, BEAGLEBONE_PRUIO_GPIO_MODE_OUTPUT)){
+      return 1;
+   }
 
+   // The PRU takes period and duty from shared ram when each period 
+   // starts. Starts with the pin low.
+   beaglebone_pruio_shared_ram[PWM_OUTPUTS + 2*slot] = period_ns;
+   beaglebone_pruio_shared_ram[PWM_OUTPUTS + 2*slot + 1] = 0;
+   if(send_command(COMMAND_SET_PWM_OUTPUT, gpio_number, PWM_OUTPUT_ENABLE | slot)){
+      unreserve_gpio_pin(gpio_number);
+      return 1;
+   }
+
+   pwm_pins[slot] = gpio_number;
+   used_pwm_slots |= 1<<slot;
    return 0;
 }
 
+int beaglebone_pruio_set_pwm_duty(int gpio_number, int duty_ns){
+   int slot = find_pwm_slot(gpio_number);
+   if(slot == -1){
+      fprintf(stderr, "libbeaglebone_pruio: Not a PWM output.\n");
+      return 1;
+   }
+   if(duty_ns < 0){
+      fprintf(stderr, "libbeaglebone_pruio: PWM duty out of range.\n");
+      return 1;
+   }
+   // No command needed, applied when the next period starts.
+   beaglebone_pruio_shared_ram[PWM_OUTPUTS + 2*slot + 1] = duty_ns;
+   return 0;
+}
+
+int beaglebone_pruio_deinit_pwm_pin(int gpio_number){
+   int slot = find_pwm_slot(gpio_number);
+   if(slot == -1){
+      return 1;
+   }
+   if(send_command(COMMAND_SET_PWM_OUTPUT, gpio_number, slot)){
+      return 1;
+   }
+   unreserve_gpio_pin(gpio_number);
+   used_pwm_slots &= ~(1<<slot);
+   return 0;
+}
+
+int beaglebone_pruio_wait(int timeout){
+   // An event left over from messages that were already read wakes us
+   // up once with an empty buffer. Only one can be pending, so waiting
+   // a second time is enough.
+   int attempt;
+   for(attempt=0; attempt<2; ++attempt){
+      if(beaglebone_pruio_messages_are_available()){
+         return 1;
+      }
+
+      struct pollfd fds;
+      fds.fd = event_fd;
+      fds.events = POLLIN;
+      fds.revents = 0;
+      int result = poll(&fds, 1, timeout);
+      if(result < 0){
+         return -1;
+      }
+      if(result == 0){
+         return beaglebone_pruio_messages_are_available();
+      }
+
+      // Acknowledge the event and re-enable the interrupt.
+      if(beaglebone_pruio_backend_clear_event(event_fd)){
+         return -1;
+      }
+   }
+
+   return beaglebone_pruio_messages_are_available();
+}
+
+int beaglebone_pruio_get_event_fd(){
+   return event_fd;
+}
+
+int beaglebone_pruio_stop(){
+   if(!pru_running){
+      return 0;
+   }
+
+   // Ask PRU0 to leave its main loop and wait for it to halt.
+   int result = 0;
+   int attempt;
+   volatile unsigned int *state = &(beaglebone_pruio_shared_ram[PRU_STATE]);
+   if(send_command(COMMAND_STOP, 0, 0) == 0){
+      for(attempt=0; attempt<100 && *state!=PRU_STATE_HALTED; ++attempt){
+         usleep(1000);
+      }
+   }
+   if(*state != PRU_STATE_HALTED){
+      fprintf(stderr, "libbeaglebone_pruio: PRU0 did not stop, disabling it anyway.\n");
+      result = 1;
+   }
+
+   beaglebone_pruio_backend_stop_pru0();
+   pru_running = 0;
+
+   // Output pins stop being driven, including the ones of pwm outputs
+   // and key matrix rows. PRU0 starts with no channels next time.
+   while(used_pins_count > 0){
+      release_gpio_pin(used_pins_count - 1);
+   }
+   used_adc_channels_count = 0;
+   used_encoders_count = 0;
+   used_velocity_keys_count = 0;
+   used_pwm_slots = 0;
+
+   return result;
+}
+
+int beaglebone_pruio_close(){
+   int result = beaglebone_pruio_stop();
+
+   if(pru_system_ready){
+      beaglebone_pruio_backend_close();
+      event_fd = -1;
+      pru_system_ready = 0;
+   }
+
+   return result;
+}
+
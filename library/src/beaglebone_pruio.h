@@ -21,15 +21,26 @@
 
 #include <string.h>
 #include <stdint.h>
+#include "beaglebone_pruio_pins.h"
+
+typedef enum{  
+   BEAGLEBONE_PRUIO_MESSAGE_GPIO = 0,
+   BEAGLEBONE_PRUIO_MESSAGE_ADC = 1,
+   BEAGLEBONE_PRUIO_MESSAGE_ENCODER = 2,
+   BEAGLEBONE_PRUIO_MESSAGE_MATRIX = 3,
+   BEAGLEBONE_PRUIO_MESSAGE_VELOCITY_KEY = 4
+} beaglebone_pruio_message_type;
 
 /**
  * A structure for easy reading of incoming messages.
  */
 typedef struct beaglebone_pruio_message{
-   int is_gpio; // 1 if gpio, 0 if adc
-   int value;
+   int is_gpio; // 1 if gpio, 0 if adc or other type
+   int value; // counts turned for encoders, can be negative
    int adc_channel;
-   int gpio_number;
+   int gpio_number; // also first pin of encoders and velocity keys, key of matrices
+   unsigned int timestamp; // nanoseconds, only if timestamps are enabled
+   beaglebone_pruio_message_type type;
 } beaglebone_pruio_message;
 
 typedef enum{  
@@ -41,28 +52,297 @@ typedef enum{
    BEAGLEBONE_PRUIO_ADC_MODE_OFF = 0,
    BEAGLEBONE_PRUIO_ADC_MODE_NORMAL = 1,
    BEAGLEBONE_PRUIO_ADC_MODE_RANGES = 2,
+   BEAGLEBONE_PRUIO_ADC_MODE_DEADBAND = 3,
+   BEAGLEBONE_PRUIO_ADC_MODE_OVERSAMPLING = 4,
 } beaglebone_pruio_adc_mode;
 
+typedef enum{  
+   BEAGLEBONE_PRUIO_OVERFLOW_DROP_NEWEST = 0,
+   BEAGLEBONE_PRUIO_OVERFLOW_DROP_OLDEST = 1,
+   BEAGLEBONE_PRUIO_OVERFLOW_COALESCE = 2
+} beaglebone_pruio_overflow_policy;
+
+/**
+ * Message buffer statistics, see beaglebone_pruio_get_buffer_stats().
+ */
+typedef struct beaglebone_pruio_lane_stats{
+   unsigned int dropped; // messages lost because the buffer was full
+   unsigned int high_watermark; // max messages in the buffer at once
+   unsigned int size; // buffer capacity, in messages
+} beaglebone_pruio_lane_stats;
+
+typedef struct beaglebone_pruio_buffer_stats{
+   beaglebone_pruio_lane_stats gpio;
+   beaglebone_pruio_lane_stats adc;
+} beaglebone_pruio_buffer_stats;
+
+/**
+ * Time used by the PRU loop, see beaglebone_pruio_get_timing(). Times 
+ * are in PRU cycles (5ns).
+ */
+typedef struct beaglebone_pruio_phase_timing{
+   unsigned int min;
+   unsigned int average; // recent frames weigh more
+   unsigned int max;
+} beaglebone_pruio_phase_timing;
+
+typedef struct beaglebone_pruio_timing{
+   beaglebone_pruio_phase_timing buffer; // writing buffered messages
+   beaglebone_pruio_phase_timing adc;
+   beaglebone_pruio_phase_timing gpio;
+   beaglebone_pruio_phase_timing state; // publishing the state table
+   beaglebone_pruio_phase_timing commands; // reading config changes
+   beaglebone_pruio_phase_timing frame; // all of the above
+   unsigned int frame_cycles; // cycles available in each frame
+   unsigned int overruns; // frames that took longer than frame_cycles
+} beaglebone_pruio_timing;
+
+/**
+ * Current value of all inputs, see beaglebone_pruio_get_snapshot().
+ */
+typedef struct beaglebone_pruio_snapshot{
+   unsigned int timestamp; // nanoseconds, same clock as message timestamps
+   int adc_values[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
+   unsigned int gpio_values[4]; // one bit per pin for each gpio module
+} beaglebone_pruio_snapshot;
+
 /**
  * Initializes PRU, GPIO and ADC hardware and starts sampling ADC channels.
+ * After beaglebone_pruio_stop(), starts the PRU again without loading
+ * device tree overlays or the PRU program.
  */
 int beaglebone_pruio_start();
 
 /**
- * Stops PRU and ADC hardware, no more samples are aquired.
+ * Enables or disables timestamps in messages. Timestamps are in
+ * nanoseconds and wrap around every 2^32 ns (~4.3 seconds), use 
+ * unsigned arithmetic to calculate time differences. Must be called
+ * before beaglebone_pruio_start(). Timestamps are off by default.
+ */
+int beaglebone_pruio_set_timestamps(int enabled);
+
+/**
+ * Chooses what happens when the PRU produces messages faster than they
+ * are read and the buffer fills up:
+ *
+ * BEAGLEBONE_PRUIO_OVERFLOW_DROP_NEWEST: new messages are lost (default).
+ * BEAGLEBONE_PRUIO_OVERFLOW_DROP_OLDEST: oldest unread messages are lost.
+ * BEAGLEBONE_PRUIO_OVERFLOW_COALESCE: when ADC messages don't fit, only 
+ *    the latest value of each ADC channel is kept and sent as soon as 
+ *    there is room. GPIO messages are dropped (newest) as usual.
+ *
+ * GPIO and ADC messages use separate buffers, a full ADC buffer never
+ * causes GPIO messages to be dropped.
+ *
+ * Must be called before beaglebone_pruio_start().
+ */
+int beaglebone_pruio_set_overflow_policy(beaglebone_pruio_overflow_policy policy);
+
+/**
+ * Makes the ADC hardware average 1 (no average), 2, 4, 8 or 16 samples
+ * for every value it converts. With more than 1 sample, values of ADC 
+ * channels without a mux are not averaged over 8 frames by the PRU anymore,
+ * they get a new value 8 times as often as the scan rate (see 
+ * beaglebone_pruio_set_scan_rate()). Averaging makes conversions 
+ * longer. Must be called before beaglebone_pruio_start(). 1 by default.
+ */
+int beaglebone_pruio_set_adc_averaging(int samples);
+
+/**
+ * Lets the ADC convert the channels in use over and over by itself, 
+ * instead of once per frame when the PRU tells it to. The PRU reads the
+ * ADC only after every channel was converted sequences times (1 to 8),
+ * and uses the latest values. So values come as fast as the ADC can 
+ * convert them, and the PRU spends less time on the ADC. 0 turns 
+ * continuous mode off (default). Must be called before 
+ * beaglebone_pruio_start().
+ */
+int beaglebone_pruio_set_adc_continuous(int sequences);
+
+/**
+ * Describes the analog multiplexers connected to the ADC inputs. 
+ * ain_mask has one bit for each input (AIN0 to AIN6) that has a mux. 
+ * All muxes share the same select pins (1 to 4 gpio numbers, least 
+ * significant first), so each has 2^select_pin_count inputs and they 
+ * are all read at once. settle_ns is how long to wait after the select
+ * pins change before sampling. ADC channels are numbered from AIN0 up:
+ * one for an input without a mux, one for each mux input on an input 
+ * with a mux (see beaglebone_pruio_get_adc_channel_count()). Channels 
+ * behind a mux get a value every 2^select_pin_count frames. Default is
+ * one 8 input mux on AIN6 selected by P8_27, P8_28 and P8_29 (channels
+ * 6 to 13). ain_mask 0 means no muxes (channels 0 to 6). Must be called
+ * before beaglebone_pruio_start().
+ */
+int beaglebone_pruio_set_adc_mux(unsigned int ain_mask, const int *select_pins, int select_pin_count, int settle_ns);
+
+/**
+ * Sets up a key matrix scanned by the PRU, up to 8 rows and 16 columns
+ * of gpio pins. One row is read per frame, so a full scan takes 
+ * row_count frames. Columns need pull ups, a pressed key pulls its 
+ * column low when its row is selected. A key only changes after its 
+ * row has read the same for debounce_scans more scans (0 to 15). If 
+ * diodes is 0, rows that could be showing a ghost key (three keys 
+ * pressed on the corners of a rectangle) are not updated until that 
+ * clears. Messages have type BEAGLEBONE_PRUIO_MESSAGE_MATRIX, value 1 
+ * for a press and 0 for a release, gpio_number is the key: row * 16 + 
+ * column (see BEAGLEBONE_PRUIO_MATRIX_ROW() and 
+ * BEAGLEBONE_PRUIO_MATRIX_COLUMN()). row_count 0 means no matrix, the
+ * default. Must be called before beaglebone_pruio_start().
+ */
+int beaglebone_pruio_set_matrix(const int *row_pins, int row_count, const int *column_pins, int column_count, int debounce_scans, int diodes);
+#define BEAGLEBONE_PRUIO_MATRIX_ROW(key) ((key) >> 4)
+#define BEAGLEBONE_PRUIO_MATRIX_COLUMN(key) ((key) & 0xF)
+
+/**
+ * Returns the number of ADC channels with the current mux setup.
+ */
+int beaglebone_pruio_get_adc_channel_count();
+
+/**
+ * Sets how many values per second are read from each ADC channel 
+ * (1500 by default, 13 to 12500). GPIO inputs are read 8 times as often.
+ * Can be called before beaglebone_pruio_start() or while running. 
+ * Returns 1 if the rate is out of range. Whether the PRU can do its 
+ * work that fast with the pins and channels in use is not checked, see
+ * the overruns in beaglebone_pruio_get_timing().
+ */
+int beaglebone_pruio_set_scan_rate(int samples_per_second);
+
+/**
+ * Returns the number of values per second read from each ADC channel.
+ */
+int beaglebone_pruio_get_scan_rate();
+
+/**
+ * Gets the number of dropped messages and the maximum number of 
+ * messages that were waiting in the buffer at once since the PRU 
+ * started.
+ */
+void beaglebone_pruio_get_buffer_stats(beaglebone_pruio_buffer_stats *stats);
+
+/**
+ * Gets the time the PRU has spent in each phase of its loop since it 
+ * started or since beaglebone_pruio_reset_timing(), and how many times
+ * the loop did not fit in a frame. Use it to find out how many pins,
+ * channels and which scan rate the PRU can handle.
+ */
+void beaglebone_pruio_get_timing(beaglebone_pruio_timing *timing);
+
+/**
+ * Starts measuring timing stats again.
+ */
+int beaglebone_pruio_reset_timing();
+
+/**
+ * Stops PRU and ADC hardware, no more samples are aquired. Waits for the
+ * PRU to finish its current cycle. All pins and channels must be inited 
+ * again after the next beaglebone_pruio_start(). The PRU system is kept
+ * open, so restarting is quick.
  */
 int beaglebone_pruio_stop();
 
+/**
+ * Stops the PRU if needed and releases the PRU system. Call when done
+ * with the library.
+ */
+int beaglebone_pruio_close();
+
 /**
  * Configures how a GPIO channel is used
  */
 int beaglebone_pruio_init_gpio_pin(int gpio_number, beaglebone_pruio_gpio_mode mode);  
 
+/**
+ * Stops using a GPIO channel. No more messages are sent for input pins,
+ * output pins are set back to input (high impedance).
+ */
+int beaglebone_pruio_deinit_gpio_pin(int gpio_number);
+
+/**
+ * Debounces an input pin on the PRU. A new value is only sent after 
+ * the pin has read the same for the given time (0 to 1000000 
+ * microseconds, 0 turns it off), so contact bounce of buttons and 
+ * switches does not send a burst of messages. Values come that much 
+ * later. The pin must be inited as input first.
+ */
+int beaglebone_pruio_set_gpio_debounce(int gpio_number, int microseconds);
+
+/**
+ * Turns on the debounce logic of the GPIO hardware for an input pin, 
+ * which filters out pulses shorter than the given time (31 to 7936 
+ * microseconds, in steps of 31, 0 turns it off). The time is set for 
+ * the whole GPIO module (GPIO0 to GPIO3, gpio_number / 32), all 
+ * debounced pins in it share the last time set. The pin must be inited
+ * as input first.
+ */
+int beaglebone_pruio_set_gpio_hardware_debounce(int gpio_number, int microseconds);
+
+/**
+ * Starts decoding a quadrature rotary encoder on two input pins on the
+ * PRU. Messages have type BEAGLEBONE_PRUIO_MESSAGE_ENCODER, gpio_number
+ * is gpio_number_a and value is the number of counts turned since the
+ * last message (positive when A leads B). steps_per_count is how many 
+ * edges make one count: 1, 2 or 4 (one full cycle, usually a detent).
+ * With acceleration (1 to 15, 0 is off), counts are multiplied by up 
+ * to 1 + acceleration when the encoder is turned fast. Up to 
+ * BEAGLEBONE_PRUIO_MAX_ENCODERS.
+ */
+int beaglebone_pruio_init_encoder(int gpio_number_a, int gpio_number_b, int steps_per_count, int acceleration);
+
+/**
+ * Stops decoding an encoder, gpio_number_a as in
+ * beaglebone_pruio_init_encoder().
+ */
+int beaglebone_pruio_deinit_encoder(int gpio_number_a);
+
+/**
+ * Starts reading a key with two contacts that close one after the 
+ * other, like the keys of velocity sensitive keyboards. Closed contacts
+ * read low. When the second contact closes there is a message of type
+ * BEAGLEBONE_PRUIO_MESSAGE_VELOCITY_KEY, gpio_number is 
+ * gpio_number_first and value is the velocity, 1 to 127, from the time
+ * between both contacts: 127 if it is fastest_us microseconds or 
+ * less, 127 * fastest_us / time otherwise. When the first contact 
+ * opens again there is another message with value 0 (note off). The 
+ * PRU times the contacts to about a microsecond. Up to 
+ * BEAGLEBONE_PRUIO_MAX_VELOCITY_KEYS, other gpio pins keep working as
+ * usual.
+ */
+int beaglebone_pruio_init_velocity_key(int gpio_number_first, int gpio_number_second, int fastest_us);
+
+/**
+ * Stops reading a velocity key, gpio_number_first as in
+ * beaglebone_pruio_init_velocity_key().
+ */
+int beaglebone_pruio_deinit_velocity_key(int gpio_number_first);
+
 /**
  * Sets the value of an output pin (0 or 1)
  */
 void beaglebone_pruio_set_pin_value(int gpio_number, int value);
 
+/**
+ * Makes a gpio pin a pwm output generated by the PRU. Each period 
+ * (10000 ns to 1 s) the pin goes high for the duty time, 0 (always 
+ * low) at first. Edges are timed by the PRU, the ARM code doesn't need
+ * to do anything. Up to BEAGLEBONE_PRUIO_MAX_PWM_OUTPUTS.
+ */
+int beaglebone_pruio_init_pwm_pin(int gpio_number, int period_ns);
+
+/**
+ * Sets the time a pwm output is high in each period, in nanoseconds. 
+ * Taken when the next period starts. A duty as long as the period or
+ * longer leaves the pin high.
+ */
+int beaglebone_pruio_set_pwm_duty(int gpio_number, int duty_ns);
+
+/**
+ * Stops a pwm output. The pin is set back to input (high impedance), 
+ * as in beaglebone_pruio_deinit_gpio_pin(), add a pull down resistor 
+ * if what it drives must not see it floating.
+ */
+int beaglebone_pruio_deinit_pwm_pin(int gpio_number);
+
 /**
  * Starts reading from an ADC pin.
  */
@@ -75,6 +355,42 @@ int beaglebone_pruio_init_adc_pin(int channel_number, int bits);
  */
 int beaglebone_pruio_init_adc_pin_with_ranges(int channel_number, int ranges); 
 
+/**
+ * Starts reading from an ADC pin. A new value is only sent when the 
+ * input moves more than deadband (0 to 255) away from where it was when 
+ * the last value was sent, in steps of the full 12 bit resolution. 
+ * Keeps a resting potentiometer from sending a stream of values that 
+ * flip between two neighbours.
+ */
+int beaglebone_pruio_init_adc_pin_with_deadband(int channel_number, int bits, int deadband); 
+
+/**
+ * Starts reading from an ADC pin with more resolution than the ADC 
+ * has: 13 to 16 bits. Each value is made from 4 samples for 13 bits, 
+ * 16 for 14, 64 for 15 and 256 for 16, so values come that many times
+ * slower. Only for channels without a mux, which are read every 
+ * frame (8 times the scan rate). The input needs a little noise for the extra 
+ * bits to mean something, a perfectly steady input gives the same 
+ * value as 12 bits.
+ */
+int beaglebone_pruio_init_adc_pin_with_oversampling(int channel_number, int bits); 
+
+/**
+ * Filters the values of an ADC pin on the PRU, after the pin was 
+ * inited. Smoothing is 0 (off) to 7, a low pass filter that moves 
+ * 1/2^smoothing of the way towards each new sample: higher is smoother
+ * but slower to follow the input. If median is not 0, each sample is 
+ * first replaced by the median of it and the previous two, which 
+ * removes single sample spikes. Channels behind a mux get a sample 
+ * every 8 frames, so the same smoothing is slower on them.
+ */
+int beaglebone_pruio_set_adc_filter(int channel_number, int smoothing, int median);
+
+/**
+ * Stops reading from an ADC pin.
+ */
+int beaglebone_pruio_deinit_adc_pin(int channel_number);
+
 /**
  * Returns 1 if there is data available from the PRU
  */
@@ -85,6 +401,46 @@ static inline int beaglebone_pruio_messages_are_available();
  */
 static inline void beaglebone_pruio_read_message(beaglebone_pruio_message *message);
 
+/**
+ * Reads up to max available messages from the PRU into the messages
+ * array in one go. Returns the number of messages read. Cheaper than
+ * calling beaglebone_pruio_read_message() in a loop when many messages
+ * are pending.
+ *
+ * GPIO messages are always returned before ADC messages, regardless of
+ * the order they were produced in. Use timestamps if order matters.
+ */
+static inline int beaglebone_pruio_read_messages(beaglebone_pruio_message *messages, int max);
+
+/**
+ * Blocks until there are messages from the PRU or timeout milliseconds
+ * pass. A timeout of -1 waits forever, 0 returns immediately. Returns 1
+ * if messages are available, 0 on timeout and -1 on error.
+ */
+int beaglebone_pruio_wait(int timeout);
+
+/**
+ * Returns a file descriptor that becomes readable when the PRU writes
+ * to an empty message buffer, to be used with poll, select or epoll.
+ * When it is readable, call beaglebone_pruio_wait(0) to acknowledge 
+ * the event and then read the messages.
+ */
+int beaglebone_pruio_get_event_fd();
+
+/**
+ * Copies the current value of every ADC channel and GPIO input pin 
+ * into snapshot, without reading messages. Values are the same as
+ * the ones in messages. Use beaglebone_pruio_snapshot_gpio_value() to
+ * get the value of a GPIO pin. Returns 0 on success, 1 if the PRU kept
+ * updating the values and a consistent copy could not be made.
+ */
+int beaglebone_pruio_get_snapshot(beaglebone_pruio_snapshot *snapshot);
+
+/**
+ * Returns the value of a GPIO input pin from a snapshot.
+ */
+static inline int beaglebone_pruio_snapshot_gpio_value(beaglebone_pruio_snapshot *snapshot, int gpio_number);
+
 /**
  * Loads a DTO
  */
@@ -139,47 +495,178 @@ void beaglebone_midi_send_messages(beaglebone_midi_message* messages, int count)
 ///////////////////////////////////////////////////////////////////////////////
 
 
-// Communication with PRU is done througn a ring buffer in the
-// PRU shared memory area.
-// shared_ram[0] to shared_ram[1023] is the buffer data.
-// shared_ram[1024] is the start (read) pointer.
-// shared_ram[1025] is the end (write) pointer.
+// Communication with PRU is done through two ring buffers (lanes) in 
+// the PRU shared memory area, one for GPIO messages and one for ADC 
+// messages, so that ADC messages can't delay GPIO ones. The GPIO lane
+// is always read first. See definitions.h for addresses.
+//
+// Messages are 32 bit unsigned ints. If timestamps are enabled, each
+// message is followed by its timestamp, also a 32 bit unsigned int.
 //
-// Messages are 32 bit unsigned ints.
+// In drop oldest overflow mode the PRU counts the messages it 
+// overwrote (skipped) and we acknowledge them (skipped_ack), the 
+// actual start of the buffer is start + (skipped - skipped_ack) * 
+// message size.
 // 
 // Read these:
 // * http://en.wikipedia.org/wiki/Circular_buffer#Mirroring
 // * https://groups.google.com/forum/#!category-topic/beagleboard/F9JI8_vQ-mE
 
+typedef struct beaglebone_pruio_ring{
+   volatile unsigned int *data;
+   unsigned int size;
+   volatile unsigned int *start;
+   volatile unsigned int *end;
+   volatile unsigned int *skipped;
+   volatile unsigned int *skipped_ack;
+} beaglebone_pruio_ring;
+
 volatile unsigned int *beaglebone_pruio_shared_ram;
-unsigned int beaglebone_pruio_buffer_size;
-volatile unsigned int *beaglebone_pruio_buffer_start;
-volatile unsigned int *beaglebone_pruio_buffer_end;
+unsigned int beaglebone_pruio_message_size; // 1, or 2 with timestamps
+beaglebone_pruio_ring beaglebone_pruio_gpio_ring;
+beaglebone_pruio_ring beaglebone_pruio_adc_ring;
 
-static inline __attribute__ ((always_inline)) int beaglebone_pruio_messages_are_available(){
-   return (*beaglebone_pruio_buffer_start != *beaglebone_pruio_buffer_end);
+static inline __attribute__ ((always_inline)) unsigned int beaglebone_pruio_ring_start(beaglebone_pruio_ring* ring, unsigned int skipped){
+   return *ring->start + (skipped - *ring->skipped_ack)*beaglebone_pruio_message_size;
 }
 
-static inline __attribute__ ((always_inline)) void beaglebone_pruio_read_message(beaglebone_pruio_message* message){
-   unsigned int raw_message = beaglebone_pruio_shared_ram[*beaglebone_pruio_buffer_start & (beaglebone_pruio_buffer_size-1)];
+static inline __attribute__ ((always_inline)) int beaglebone_pruio_ring_is_empty(beaglebone_pruio_ring* ring){
+   unsigned int start = beaglebone_pruio_ring_start(ring, *ring->skipped);
+   return ((start & (2*ring->size - 1)) == *ring->end);
+}
+
+static inline __attribute__ ((always_inline)) int beaglebone_pruio_messages_are_available(){
+   return !beaglebone_pruio_ring_is_empty(&beaglebone_pruio_gpio_ring) || 
+          !beaglebone_pruio_ring_is_empty(&beaglebone_pruio_adc_ring);
+}
 
-   message->is_gpio = (raw_message&(1<<31))==0;
+static inline __attribute__ ((always_inline)) void beaglebone_pruio_decode_message(unsigned int raw_message, beaglebone_pruio_message* message){
+   message->is_gpio = (raw_message&(3<<30))==0;
    if(message->is_gpio){
+      message->type = BEAGLEBONE_PRUIO_MESSAGE_GPIO;
       message->value = (raw_message&(1<<8))==0;
       message->gpio_number = raw_message & 0xFF;
    }
+   else if(raw_message&(1<<31)){
+      message->type = BEAGLEBONE_PRUIO_MESSAGE_ADC;
+      message->value = raw_message & 0xFFFF; 
+      message->adc_channel = (raw_message >> 16) & 0x3F;
+   }
    else{
-      message->value = (raw_message >> 4) & 0xFFF; 
-      message->adc_channel = raw_message & 0xF;
+      message->type = (beaglebone_pruio_message_type)((raw_message >> 24) & 0x3F);
+      message->value = (int16_t)((raw_message >> 8) & 0xFFFF); 
+      message->gpio_number = raw_message & 0xFF;
+   }
+}
+
+static inline __attribute__ ((always_inline)) void beaglebone_pruio_read_message(beaglebone_pruio_message* message){
+   beaglebone_pruio_ring* ring = &beaglebone_pruio_gpio_ring;
+   if(beaglebone_pruio_ring_is_empty(ring)){
+      ring = &beaglebone_pruio_adc_ring;
    }
 
-   // Don't write buffer start before reading message (mem barrier)
-   // http://stackoverflow.com/questions/982129/what-does-sync-synchronize-do
-   // https://en.wikipedia.org/wiki/Memory_ordering#Compiler_memory_barrier
-   __sync_synchronize();
+   // In drop oldest mode the PRU counts a message in skipped before it
+   // overwrites it. If skipped changed while we copied the message, it
+   // may be torn: read the new oldest one instead.
+   unsigned int skipped, start, position, raw_message, timestamp;
+   do{
+      skipped = *ring->skipped;
+      start = beaglebone_pruio_ring_start(ring, skipped);
+      position = start & (ring->size-1);
+      raw_message = ring->data[position];
+      timestamp = (beaglebone_pruio_message_size == 2) ? ring->data[position+1] : 0;
+
+      // Don't check skipped or write buffer start before reading 
+      // message (mem barrier)
+      // http://stackoverflow.com/questions/982129/what-does-sync-synchronize-do
+      // https://en.wikipedia.org/wiki/Memory_ordering#Compiler_memory_barrier
+      __sync_synchronize();
+   } while(*ring->skipped != skipped);
+
+   beaglebone_pruio_decode_message(raw_message, message);
+   message->timestamp = timestamp;
+
+   // Acknowledge skipped messages before moving the start pointer 
+   // past them, the PRU would think there's free space otherwise.
+   *ring->skipped_ack = skipped;
 
    // Increment buffer start, wrap around 2*size
-   *beaglebone_pruio_buffer_start = (*beaglebone_pruio_buffer_start+1) & (2*beaglebone_pruio_buffer_size - 1);
+   *ring->start = (start+beaglebone_pruio_message_size) & (2*ring->size - 1);
+}
+
+static inline __attribute__ ((always_inline)) int beaglebone_pruio_ring_read(beaglebone_pruio_ring* ring, beaglebone_pruio_message* messages, int max){
+   // Read both pointers only once. Acquire on the end pointer so that
+   // the message reads below are not done before it.
+   unsigned int message_size = beaglebone_pruio_message_size;
+   unsigned int skipped = *ring->skipped;
+   unsigned int start = beaglebone_pruio_ring_start(ring, skipped);
+   unsigned int end = __atomic_load_n(ring->end, __ATOMIC_ACQUIRE);
+
+   // message_size is 1 or 2, shift instead of dividing (no hw divide on the A8).
+   // The PRU may have overwritten more messages after we read skipped,
+   // never read more than a full buffer.
+   unsigned int available = ((end - start) & (2*ring->size - 1)) >> (message_size - 1);
+   unsigned int capacity = ring->size >> (message_size - 1);
+   if(available > capacity){
+      available = capacity;
+      start = end - ring->size;
+   }
+   unsigned int count = available < (unsigned int)max ? available : (unsigned int)max;
+   if(count == 0){
+      return 0;
+   }
+
+   // Messages are at most in two contiguous spans: from start to the 
+   // end of the data area and from the beginning of the data area on.
+   volatile unsigned int *raw = &(ring->data[start & (ring->size-1)]);
+   volatile unsigned int *raw_end = &(ring->data[ring->size]);
+   unsigned int i;
+   for(i=0; i<count; i++){
+      beaglebone_pruio_decode_message(raw[0], &messages[i]);
+      messages[i].timestamp = (message_size == 2) ? raw[1] : 0;
+      raw += message_size;
+      if(raw == raw_end){
+         raw = ring->data;
+      }
+   }
+
+   // In drop oldest mode the PRU counts messages in skipped before it
+   // overwrites them, oldest first. The first ones copied may have been
+   // overwritten while we read them (torn or newer messages out of 
+   // order), throw them away. The start moves past everything we read
+   // and everything the PRU dropped.
+   unsigned int overwritten = __atomic_load_n(ring->skipped, __ATOMIC_ACQUIRE) - skipped;
+   unsigned int consumed = count;
+   if(overwritten > 0){
+      skipped += overwritten;
+      if(overwritten >= count){
+         consumed = overwritten;
+         count = 0;
+      }
+      else{
+         count -= overwritten;
+         memmove(messages, messages + overwritten, count*sizeof(beaglebone_pruio_message));
+         start += overwritten*message_size;
+         consumed = count;
+      }
+   }
+
+   // Publish the new start pointer once, after all messages were read.
+   // Skipped messages are acknowledged first, see read_message above.
+   __atomic_store_n(ring->skipped_ack, skipped, __ATOMIC_RELEASE);
+   __atomic_store_n(ring->start, (start+consumed*message_size) & (2*ring->size - 1), __ATOMIC_RELEASE);
+
+   return (int)count;
+}
+
+static inline __attribute__ ((always_inline)) int beaglebone_pruio_read_messages(beaglebone_pruio_message* messages, int max){
+   // GPIO messages first.
+   int count = beaglebone_pruio_ring_read(&beaglebone_pruio_gpio_ring, messages, max);
+   return count + beaglebone_pruio_ring_read(&beaglebone_pruio_adc_ring, messages+count, max-count);
+}
+
+static inline __attribute__ ((always_inline)) int beaglebone_pruio_snapshot_gpio_value(beaglebone_pruio_snapshot *snapshot, int gpio_number){
+   return (snapshot->gpio_values[gpio_number >> 5] >> (gpio_number % 32)) & 1;
 }
 
 #endif // BEAGLEBONE_PRUIO_H
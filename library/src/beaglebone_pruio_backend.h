@@ -0,0 +1,65 @@
+/* Beaglebone Pru IO 
+ * 
+ * Copyright (C) 2015 Rafael Vega <rvega@elsoftwarehamuerto.org> 
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BEAGLEBONE_PRUIO_BACKEND_H
+#define BEAGLEBONE_PRUIO_BACKEND_H
+
+/**
+ * Everything the library needs from the hardware and the operating 
+ * system. beaglebone_pruio_hardware.c implements it with prussdrv, 
+ * /dev/mem and sysfs. beaglebone_pruio_simulator.c runs the PRU0 
+ * program in a thread against simulated registers, so the library can
+ * be used on any Linux machine. Link with one of them.
+ *
+ * All functions return 0 on success and 1 on error.
+ */
+
+/**
+ * Loads device tree overlays and maps PRU shared ram and the registers
+ * of the 4 gpio modules. event_fd becomes readable when PRU0 raises 
+ * ARM_INTERRUPT_EVENT.
+ */
+int beaglebone_pruio_backend_open(volatile unsigned int **shared_ram, volatile void *gpio_modules[4], int *event_fd);
+
+/**
+ * Loads (first time only) and starts the PRU0 program.
+ */
+int beaglebone_pruio_backend_start_pru0();
+
+/**
+ * Disables PRU0. Called after the PRU0 program halted or did not 
+ * answer the stop command.
+ */
+void beaglebone_pruio_backend_stop_pru0();
+
+/**
+ * Releases everything beaglebone_pruio_backend_open() got.
+ */
+void beaglebone_pruio_backend_close();
+
+/**
+ * Acknowledges an event on event_fd so the next one can be received.
+ */
+int beaglebone_pruio_backend_clear_event(int event_fd);
+
+/**
+ * Sets the pinmux of a gpio pin, mode is "input" or "output".
+ */
+int beaglebone_pruio_backend_set_pinmux(int gpio_number, const char *mode);
+
+#endif //BEAGLEBONE_PRUIO_BACKEND_H
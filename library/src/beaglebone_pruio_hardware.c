@@ -0,0 +1,470 @@
+/* Beaglebone Pru IO 
+ * 
+ * Copyright (C) 2015 Rafael Vega <rvega@elsoftwarehamuerto.org> 
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <prussdrv.h>
+#include <pruss_intc_mapping.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "beaglebone_pruio.h"
+#include "beaglebone_pruio_backend.h"
+#include "definitions.h"
+#include "beaglebone_pruio_pins.h"
+
+/**
+ * Backend for the real hardware: prussdrv, /dev/mem and sysfs. See
+ * beaglebone_pruio_backend.h
+ */
+
+#ifndef BEAGLEBONE_PRUIO_START_ADDR_0
+   #error "BEAGLEBONE_PRUIO_START_ADDR_0 must be defined."
+#endif
+
+#ifndef BEAGLEBONE_PRUIO_PREFIX
+   #error "BEAGLEBONE_PRUIO_PREFIX must be defined."
+#endif
+
+
+/////////////////////////////////////////////////////////////////////
+// MEMORY MAP
+
+static int map_device_registers(volatile void *gpio_modules[4]){
+   // Get pointers to hardware registers. See memory map in manual for addresses.
+   
+   int memdev = open("/dev/mem", O_RDWR | O_SYNC);
+   
+   // Get pointer to gpio0 registers (start at address 0x44e07000, length 0x1000 (4KB)).
+   volatile void* gpio0 = mmap(0, 0x1000, PROT_READ|PROT_WRITE, MAP_SHARED, memdev, GPIO0);
+   if(gpio0 == MAP_FAILED){ return 1; }
+   gpio_modules[0] = gpio0;
+
+   // same for gpio1, 2 and 3.
+   volatile void* gpio1 = mmap(0, 0x1000, PROT_READ|PROT_WRITE, MAP_SHARED, memdev, GPIO1);
+   if(gpio1 == MAP_FAILED){
+      return 1;
+   }
+   gpio_modules[1] = gpio1;
+
+   volatile void* gpio2 = mmap(0, 0x1000, PROT_READ|PROT_WRITE, MAP_SHARED, memdev, GPIO2);
+   if(gpio2 == MAP_FAILED){
+      return 1;
+   }
+   gpio_modules[2] = gpio2;
+
+   volatile void* gpio3 = mmap(0, 0x1000, PROT_READ|PROT_WRITE, MAP_SHARED, memdev, GPIO3);
+   if(gpio3 == MAP_FAILED){
+      return 1;
+   }
+   gpio_modules[3] = gpio3;
+
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// PINMUX
+
+static int get_gpio_pin_name(int gpio_number, char* pin_name){
+   switch(gpio_number){
+      case P8_07: 
+         strcpy(pin_name, "P8_07");
+         break;
+      case P8_08: 
+         strcpy(pin_name, "P8_08");
+         break;
+      case P8_09: 
+         strcpy(pin_name, "P8_09");
+         break;
+      case P8_10: 
+         strcpy(pin_name, "P8_10");
+         break;
+      case P8_11: 
+         strcpy(pin_name, "P8_11");
+         break;
+      case P8_12: 
+         strcpy(pin_name, "P8_12");
+         break;
+      case P8_13: 
+         strcpy(pin_name, "P8_13");
+         break;
+      case P8_14: 
+         strcpy(pin_name, "P8_14");
+         break;
+      case P8_15: 
+         strcpy(pin_name, "P8_15");
+         break;
+      case P8_16: 
+         strcpy(pin_name, "P8_16");
+         break;
+      case P8_17: 
+         strcpy(pin_name, "P8_17");
+         break;
+      case P8_18: 
+         strcpy(pin_name, "P8_18");
+         break;
+      case P8_19: 
+         strcpy(pin_name, "P8_19");
+         break;
+      case P8_26: 
+         strcpy(pin_name, "P8_26");
+         break;
+      case P8_27: 
+         strcpy(pin_name, "P8_27");
+         break;
+      case P8_28: 
+         strcpy(pin_name, "P8_28");
+         break;
+      case P8_29: 
+         strcpy(pin_name, "P8_29");
+         break;
+      case P8_30: 
+         strcpy(pin_name, "P8_30");
+         break;
+      case P8_31: 
+         strcpy(pin_name, "P8_31");
+         break;
+      case P8_32: 
+         strcpy(pin_name, "P8_32");
+         break;
+      case P8_33: 
+         strcpy(pin_name, "P8_33");
+         break;
+      case P8_34: 
+         strcpy(pin_name, "P8_34");
+         break;
+      case P8_35: 
+         strcpy(pin_name, "P8_35");
+         break;
+      case P8_36: 
+         strcpy(pin_name, "P8_36");
+         break;
+      case P8_37: 
+         strcpy(pin_name, "P8_37");
+         break;
+      case P8_38: 
+         strcpy(pin_name, "P8_38");
+         break;
+      case P8_39: 
+         strcpy(pin_name, "P8_39");
+         break;
+      case P8_40: 
+         strcpy(pin_name, "P8_40");
+         break;
+      case P8_41: 
+         strcpy(pin_name, "P8_41");
+         break;
+      case P8_42: 
+         strcpy(pin_name, "P8_42");
+         break;
+      case P8_43: 
+         strcpy(pin_name, "P8_43");
+         break;
+      case P8_44: 
+         strcpy(pin_name, "P8_44");
+         break;
+      case P8_45: 
+         strcpy(pin_name, "P8_45");
+         break;
+      case P8_46:
+         strcpy(pin_name, "P8_46");
+         break;
+      /* case P9_11:  */
+      /*    strcpy(pin_name, "P9_11"); */
+      /*    break; */
+      case P9_12: 
+         strcpy(pin_name, "P9_12");
+         break;
+      /* case P9_13:  */
+      /*    strcpy(pin_name, "P9_13"); */
+      /*    break; */
+      case P9_14: 
+         strcpy(pin_name, "P9_14");
+         break;
+      case P9_15: 
+         strcpy(pin_name, "P9_15");
+         break;
+      case P9_16: 
+         strcpy(pin_name, "P9_16");
+         break;
+      /* case P9_17:  */
+      /*    strcpy(pin_name, "P9_17"); */
+      /*    break; */
+      /* case P9_18:  */
+      /*    strcpy(pin_name, "P9_18"); */
+      /*    break; */
+      case P9_21: 
+         strcpy(pin_name, "P9_21");
+         break;
+      case P9_22: 
+         strcpy(pin_name, "P9_22");
+         break;
+      case P9_23: 
+         strcpy(pin_name, "P9_23");
+         break;
+      case P9_24: 
+         strcpy(pin_name, "P9_24");
+         break;
+      case P9_26: 
+         strcpy(pin_name, "P9_26");
+         break;
+      case P9_27: 
+         strcpy(pin_name, "P9_27");
+         break;
+      case P9_30: 
+         strcpy(pin_name, "P9_30");
+         break;
+      case P9_41A: 
+         strcpy(pin_name, "P9_41A");
+         break;
+      case P9_42A: 
+         strcpy(pin_name, "P9_42A");
+         break;
+      default: 
+         return 1;
+         break;
+   }
+   return 0;
+}
+
+static int get_gpio_config_file(int gpio_number, char* path){
+   char pin_name[256] = "";
+   if(get_gpio_pin_name(gpio_number, pin_name)){
+      return 1; 
+   }
+
+   char tmp[256] = "/sys/devices/platform/ocp/ocp:";
+   strcat(tmp, pin_name);
+   strcat(tmp, "_mux/state");
+   strcpy(path, tmp);
+   return 0;
+
+   // look for a path that looks like ocp.* in /sys/devices/
+   /* DIR *dir = opendir("/sys/devices/"); */
+   /* if(dir==NULL){ */
+   /*    return 1; */
+   /* } */
+   /* struct dirent* dir_info; */
+   /* while(dir){ */
+   /*    dir_info = readdir(dir); */
+   /*    if(dir_info==NULL){ */
+   /*       closedir(dir); */
+   /*       return 1; */
+   /*    } */
+   /*    // Substring "ocp." */
+   /*    if(strstr(dir_info->d_name, "ocp.")!=NULL){ */
+   /*       strcat(tmp, "/sys/devices/"); */
+   /*       strcat(tmp, dir_info->d_name); */
+   /*       strcat(tmp, "/"); */
+   /*  */
+   /*       DIR *dir2 = opendir(tmp); */
+   /*       if(dir2==NULL){ */
+   /*          return 1; */
+   /*       } */
+   /*       while(dir2){ */
+   /*          dir_info = readdir(dir2); */
+   /*          if(dir_info==NULL){ */
+   /*             closedir(dir2); */
+   /*             closedir(dir); */
+   /*             return 1; */
+   /*          } */
+   /*          // Substring pin name */
+   /*          if(strstr(dir_info->d_name, pin_name)!=NULL){ */
+   /*             strcat(tmp, dir_info->d_name); */
+   /*             strcat(tmp, "/state"); */
+   /*             break; // while dir2 */
+   /*          } */
+   /*       } */
+   /*       closedir(dir2); */
+   /*       break; // while dir1 */
+   /*    } */
+   /* } */
+   /* closedir(dir); */
+   /* strcpy(path, tmp); */
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// PRU Initialization
+//
+
+int beaglebone_pruio_load_device_tree_overlay(char* dto){
+   // Check if the device tree overlay is loaded, load if needed.
+   int device_tree_overlay_loaded = 0; 
+   FILE* f;
+   f = fopen("/sys/devices/platform/bone_capemgr/slots","rt");
+   if(f==NULL){
+      return 1;
+   }
+   char line[256];
+   while(fgets(line, 256, f) != NULL){
+      if(strstr(line, dto) != NULL){
+         device_tree_overlay_loaded = 1; 
+      }
+   }
+   fclose(f);
+
+   if(!device_tree_overlay_loaded){
+      f = fopen("/sys/devices/platform/bone_capemgr/slots","w");
+      if(f==NULL){
+         return 1;
+      }
+      fprintf(f, "%s", dto);
+      fclose(f);
+   }
+
+   usleep(100000);
+
+   return 0;
+}
+
+static int load_device_tree_overlays(){
+   if(beaglebone_pruio_load_device_tree_overlay("PRUIO-DTO")){
+      return 1;
+   }
+   return 0;
+}
+
+static int init_pru_system(volatile unsigned int **shared_ram, int *event_fd){
+   tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
+   if(prussdrv_init()) return 1;
+   if(prussdrv_open(PRU_EVTOUT_0)) return 1;
+   if(prussdrv_pruintc_init(&pruss_intc_initdata)) return 1;
+
+   // PRU0 raises PRU_EVTOUT_0 when it writes to an empty ring buffer.
+   *event_fd = prussdrv_pru_event_fd(PRU_EVTOUT_0);
+   if(*event_fd < 0) return 1;
+
+   // Get pointer to shared ram
+   void* p;
+   if(prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, &p)) return 1;
+   *shared_ram = (volatile unsigned int*)p;
+
+   return 0;
+}
+
+// Set once the program is in PRU0's instruction ram. Stopping PRU0 
+// keeps it, so starting again is quick.
+static int pru0_program_loaded = 0;
+
+// Copy of PRU0's data ram image (PRUDMEM in AM3359_PRU.cmd is 8KB).
+static unsigned int pru0_data[0x2000/4];
+static int pru0_data_length = 0;
+
+static int load_pru0_data(){
+   if(pru0_data_length == 0){
+      char path[512] = "";
+      strcat(path, BEAGLEBONE_PRUIO_PREFIX); 
+      strcat(path, "/lib/libbeaglebone_pruio_data0.bin");
+      FILE* f = fopen(path, "rb");
+      if(f==NULL) return 1;
+      pru0_data_length = fread(pru0_data, 1, sizeof(pru0_data), f);
+      fclose(f);
+      if(pru0_data_length <= 0){
+         pru0_data_length = 0;
+         return 1;
+      }
+   }
+
+   // PRU0 globals are initialized when the image is loaded (linked 
+   // with -cr), not when the program starts, so write it every time.
+   if(prussdrv_pru_write_memory(PRUSS0_PRU0_DATARAM, 0, pru0_data, pru0_data_length) < 0) return 1;
+
+   return 0;
+}
+
+static int start_pru0_program(){
+   if(load_pru0_data()) return 1;
+
+   if(pru0_program_loaded){
+      // Instructions are still in PRU0's instruction ram.
+      if(prussdrv_pru_enable_at(0, BEAGLEBONE_PRUIO_START_ADDR_0)) return 1;
+      return 0;
+   }
+
+   char path[512] = "";
+   strcpy(path, BEAGLEBONE_PRUIO_PREFIX); 
+   strcat(path, "/lib/libbeaglebone_pruio_text0.bin");
+   if(prussdrv_exec_program_at(0, path, BEAGLEBONE_PRUIO_START_ADDR_0)) return 1;
+   pru0_program_loaded = 1;
+
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Backend functions
+//
+
+int beaglebone_pruio_backend_open(volatile unsigned int **shared_ram, volatile void *gpio_modules[4], int *event_fd){
+   if(load_device_tree_overlays()){
+      fprintf(stderr, "libbeaglebone_pruio: Could not load device tree overlays.\n");
+      return 1;
+   }
+
+   if(map_device_registers(gpio_modules)){
+      fprintf(stderr, "libbeaglebone_pruio: Could not map device's registers to memory.\n");
+      return 1;
+   }
+
+   if(init_pru_system(shared_ram, event_fd)){
+      fprintf(stderr, "libbeaglebone_pruio: Could not init PRU system.\n");
+      return 1;
+   }
+
+   return 0;
+}
+
+int beaglebone_pruio_backend_start_pru0(){
+   return start_pru0_program();
+}
+
+void beaglebone_pruio_backend_stop_pru0(){
+   prussdrv_pru_disable(0);
+}
+
+void beaglebone_pruio_backend_close(){
+   prussdrv_exit();
+   pru0_program_loaded = 0;
+}
+
+int beaglebone_pruio_backend_clear_event(int event_fd){
+   // Acknowledge the event and re-enable the interrupt.
+   unsigned int event_count;
+   if(read(event_fd, &event_count, sizeof(event_count)) != sizeof(event_count)){
+      return 1;
+   }
+   prussdrv_pru_clear_event(PRU_EVTOUT_0, ARM_INTERRUPT_EVENT);
+   return 0;
+}
+
+int beaglebone_pruio_backend_set_pinmux(int gpio_number, const char *mode){
+   // Set the pinmux of the pin by writing to the appropriate config file
+   char path[256] = "";
+   if(get_gpio_config_file(gpio_number, path)){
+      return 1;
+   }
+   FILE *f = fopen(path, "w");
+   if(f==NULL){
+      return 1;
+   }
+   fprintf(f, "%s", mode); 
+   fclose(f);
+   return 0;
+}
@@ -21,8 +21,13 @@
 
 #include <string.h>
 
-#define BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS 14
+#define BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS 64
 #define BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS 118
+#define BEAGLEBONE_PRUIO_MAX_ENCODERS 32
+#define BEAGLEBONE_PRUIO_MAX_MATRIX_ROWS 8
+#define BEAGLEBONE_PRUIO_MAX_MATRIX_COLUMNS 16
+#define BEAGLEBONE_PRUIO_MAX_VELOCITY_KEYS 32
+#define BEAGLEBONE_PRUIO_MAX_PWM_OUTPUTS 16
 
 // These defines map the beagle bone's pin names to the AM335X's 
 // gpio numbers. GPIO numbers can be used like:
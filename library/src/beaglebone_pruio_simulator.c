@@ -0,0 +1,670 @@
+/* Beaglebone Pru IO 
+ * 
+ * Copyright (C) 2015 Rafael Vega <rvega@elsoftwarehamuerto.org> 
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "beaglebone_pruio.h"
+#include "beaglebone_pruio_backend.h"
+#include "beaglebone_pruio_simulator.h"
+#include "definitions.h"
+#include "beaglebone_pruio_pins.h"
+#include "pru0_simulator.h"
+
+/**
+ * Backend that runs the PRU0 program (pru0_main.c built for the host) 
+ * in a thread. Its register accesses land in the simulated registers 
+ * below: shared ram, IEP timer, cycle counter, gpio modules and adc. 
+ * Inputs follow the waveforms set with the functions in 
+ * beaglebone_pruio_simulator.h. See beaglebone_pruio_backend.h
+ */
+
+/////////////////////////////////////////////////////////////////////
+// TIME
+//
+
+// Simulation time is in nanoseconds since beaglebone_pruio_backend_open()
+static struct timespec time_zero;
+
+static uint64_t current_time(){
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (uint64_t)(t.tv_sec - time_zero.tv_sec)*1000000000 + t.tv_nsec - time_zero.tv_nsec;
+}
+
+static void sleep_until(uint64_t time){
+   struct timespec t;
+   t.tv_sec = time_zero.tv_sec + time/1000000000;
+   t.tv_nsec = time_zero.tv_nsec + time%1000000000;
+   if(t.tv_nsec >= 1000000000){
+      t.tv_sec++;
+      t.tv_nsec -= 1000000000;
+   }
+   clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+}
+
+/////////////////////////////////////////////////////////////////////
+// WAVEFORMS
+//
+
+typedef struct waveform{
+   beaglebone_pruio_waveform type;
+   float frequency;
+   int low;
+   int high;
+} waveform;
+
+static waveform adc_waveforms[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
+static waveform gpio_waveforms[4*32];
+
+// One bit per pin with a waveform other than constant 0, so reading a 
+// gpio module does not calculate 32 waveforms.
+static unsigned int gpio_waveforms_used[4];
+
+static pthread_mutex_t waveforms_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int waveform_value(waveform *w, uint64_t time){
+   // Position in the current period, 0 to 1
+   double phase = 0;
+   if(w->frequency > 0){
+      phase = fmod(time * 1e-9 * w->frequency, 1.0);
+   }
+
+   switch(w->type){
+      case BEAGLEBONE_PRUIO_WAVEFORM_SQUARE:
+         return phase < 0.5 ? w->high : w->low;
+      case BEAGLEBONE_PRUIO_WAVEFORM_SINE:
+         return w->low + (int)((w->high - w->low) * (0.5 - 0.5*cos(2*M_PI*phase)) + 0.5);
+      case BEAGLEBONE_PRUIO_WAVEFORM_RAMP:
+         return w->low + (int)((w->high - w->low + 1) * phase);
+      case BEAGLEBONE_PRUIO_WAVEFORM_NOISE:
+         return w->low + rand() % (w->high - w->low + 1);
+      default:
+         return w->high;
+   }
+}
+
+static int set_waveform(waveform *w, beaglebone_pruio_waveform type, float frequency, int low, int high){
+   if(type < BEAGLEBONE_PRUIO_WAVEFORM_CONSTANT || type > BEAGLEBONE_PRUIO_WAVEFORM_NOISE){
+      return 1;
+   }
+   if(frequency < 0 || low > high){
+      return 1;
+   }
+
+   pthread_mutex_lock(&waveforms_mutex);
+   w->type = type;
+   w->frequency = frequency;
+   w->low = low;
+   w->high = high;
+   pthread_mutex_unlock(&waveforms_mutex);
+   return 0;
+}
+
+int beaglebone_pruio_simulator_set_adc_waveform(int channel_number, beaglebone_pruio_waveform waveform, float frequency, int low, int high){
+   if(channel_number < 0 || channel_number >= BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS){
+      return 1;
+   }
+   if(low < 0 || high > 0xfff){
+      return 1;
+   }
+   return set_waveform(&adc_waveforms[channel_number], waveform, frequency, low, high);
+}
+
+int beaglebone_pruio_simulator_set_gpio_waveform(int gpio_number, beaglebone_pruio_waveform waveform, float frequency, int low, int high){
+   if(gpio_number < 0 || gpio_number >= 4*32){
+      return 1;
+   }
+   if(low < 0 || high > 1){
+      return 1;
+   }
+   if(set_waveform(&gpio_waveforms[gpio_number], waveform, frequency, low, high)){
+      return 1;
+   }
+
+   pthread_mutex_lock(&waveforms_mutex);
+   if(high == 0){
+      gpio_waveforms_used[gpio_number>>5] &= ~(1<<(gpio_number%32));
+   }
+   else{
+      gpio_waveforms_used[gpio_number>>5] |= (1<<(gpio_number%32));
+   }
+   pthread_mutex_unlock(&waveforms_mutex);
+   return 0;
+}
+
+static int get_waveform_type(char *name, beaglebone_pruio_waveform *type){
+   if(strcmp(name, "constant") == 0){
+      *type = BEAGLEBONE_PRUIO_WAVEFORM_CONSTANT;
+   }
+   else if(strcmp(name, "square") == 0){
+      *type = BEAGLEBONE_PRUIO_WAVEFORM_SQUARE;
+   }
+   else if(strcmp(name, "sine") == 0){
+      *type = BEAGLEBONE_PRUIO_WAVEFORM_SINE;
+   }
+   else if(strcmp(name, "ramp") == 0){
+      *type = BEAGLEBONE_PRUIO_WAVEFORM_RAMP;
+   }
+   else if(strcmp(name, "noise") == 0){
+      *type = BEAGLEBONE_PRUIO_WAVEFORM_NOISE;
+   }
+   else{
+      return 1;
+   }
+   return 0;
+}
+
+int beaglebone_pruio_simulator_load_script(const char *path){
+   FILE* f = fopen(path, "rt");
+   if(f==NULL){
+      fprintf(stderr, "libbeaglebone_pruio: Could not open simulator script %s.\n", path);
+      return 1;
+   }
+
+   char line[256], kind[16], target[16], type_name[16];
+   float frequency;
+   int low, high, line_number = 0, error = 0;
+   beaglebone_pruio_waveform type;
+   while(!error && fgets(line, 256, f) != NULL){
+      line_number++;
+
+      // Skip comments and empty lines
+      if(line[0] == '#' || sscanf(line, "%15s", kind) != 1){
+         continue;
+      }
+
+      if(sscanf(line, "%15s %15s %15s %f %d %d", kind, target, type_name, &frequency, &low, &high) != 6){
+         error = 1;
+      }
+      else if(get_waveform_type(type_name, &type)){
+         error = 1;
+      }
+      else if(strcmp(kind, "adc") == 0){
+         error = beaglebone_pruio_simulator_set_adc_waveform(atoi(target), type, frequency, low, high);
+      }
+      else if(strcmp(kind, "gpio") == 0){
+         int gpio_number = target[0]=='P' ? beaglebone_pruio_get_gpio_number(target) : atoi(target);
+         error = beaglebone_pruio_simulator_set_gpio_waveform(gpio_number, type, frequency, low, high);
+      }
+      else{
+         error = 1;
+      }
+   }
+   fclose(f);
+
+   if(error){
+      fprintf(stderr, "libbeaglebone_pruio: Error in simulator script %s, line %i.\n", path, line_number);
+   }
+   return error;
+}
+
+/////////////////////////////////////////////////////////////////////
+// REGISTERS
+//
+
+typedef struct register_block{
+   unsigned long address;
+   unsigned int size; // bytes
+   volatile unsigned int *data;
+} register_block;
+
+static volatile unsigned int shared_ram_registers[0x3000/4];
+static volatile unsigned int icss_cfg_registers[0x100/4];
+static volatile unsigned int pru0_ctrl_registers[0x100/4];
+static volatile unsigned int iep_registers[0x100/4];
+static volatile unsigned int cm_registers[0x800/4]; // CM_PER and CM_WKUP
+static volatile unsigned int gpio_registers[4][0x1000/4];
+static volatile unsigned int adc_registers[0x300/4];
+
+static register_block register_blocks[] = {
+   {PRU_SHARED_RAM, sizeof(shared_ram_registers), shared_ram_registers},
+   {PRU_ICSS_CFG, sizeof(icss_cfg_registers), icss_cfg_registers},
+   {PRU0_CTRL, sizeof(pru0_ctrl_registers), pru0_ctrl_registers},
+   {IEP, sizeof(iep_registers), iep_registers},
+   {CM_PER, sizeof(cm_registers), cm_registers},
+   {GPIO0, sizeof(gpio_registers[0]), gpio_registers[0]},
+   {GPIO1, sizeof(gpio_registers[1]), gpio_registers[1]},
+   {GPIO2, sizeof(gpio_registers[2]), gpio_registers[2]},
+   {GPIO3, sizeof(gpio_registers[3]), gpio_registers[3]},
+   {ADC_TSC, sizeof(adc_registers), adc_registers}
+};
+#define REGISTER_BLOCKS (sizeof(register_blocks)/sizeof(register_block))
+
+#define REGISTER(block, offset) (block[(offset)/4])
+
+volatile unsigned int beaglebone_pruio_simulator_r31 = 0;
+
+// Registers calculated when read (counters, fifo, gpio input) or 
+// cleared by writing 1 are accessed through this word. Writes to it are
+// ignored, except for write 1 to clear registers: reads return the
+// status with W1C_UNTOUCHED in the upper bits, if those bits are gone 
+// at the next access the program wrote the bits to clear.
+static volatile unsigned int scratch;
+static unsigned int *w1c_status = NULL;
+#define W1C_UNTOUCHED 0x5A5A0000
+
+static unsigned int iep_compare_status;
+static int iep_running;
+static uint64_t iep_counter_start;
+
+static int cycle_counter_running;
+static uint64_t cycle_counter_start;
+
+static unsigned int adc_irq_status;
+#define ADC_FIFO_SIZE 64
+static unsigned int adc_fifo[ADC_FIFO_SIZE];
+static unsigned int adc_fifo_start;
+static unsigned int adc_fifo_count;
+static int adc_continuous_running;
+static uint64_t adc_next_sequence;
+
+static unsigned long last_address;
+static unsigned int accesses_since_status; // of the iep compare status
+static volatile int pru0_stopping = 0;
+static int event_fd = -1;
+
+static unsigned int adc_input(unsigned int ain, uint64_t time){
+   // Same channel numbering as PRU0, see comments about the adc mux in 
+   // definitions.h. Muxed inputs read the level of the select lines.
+   int channel_number = 0, value;
+   unsigned int i, gpio_number;
+   unsigned int mux = shared_ram_registers[ADC_MUX];
+   unsigned int ains = mux & ADC_MUX_AINS_MASK;
+   unsigned int pins = (mux & ADC_MUX_PINS_MASK) >> ADC_MUX_PINS_SHIFT;
+   if(ain >= ADC_AINS){
+      return 0;
+   }
+   if(pins > ADC_MUX_MAX_PINS || pins == 0){
+      ains = 0;
+   }
+   for(i=0; i<ain; i++){
+      channel_number += (ains & (1<<i)) ? (1<<pins) : 1;
+   }
+   if(ains & (1<<ain)){
+      unsigned int ctl = 0;
+      for(i=0; i<pins; i++){
+         gpio_number = (shared_ram_registers[ADC_MUX_SELECT] >> (8*i)) & 0x7F;
+         if(REGISTER(gpio_registers[gpio_number>>5], GPIO_DATAOUT) & (1<<(gpio_number%32))){
+            ctl |= 1<<i;
+         }
+      }
+      channel_number += ctl;
+   }
+   if(channel_number >= BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS){
+      return 0;
+   }
+
+   pthread_mutex_lock(&waveforms_mutex);
+   value = waveform_value(&adc_waveforms[channel_number], time);
+   pthread_mutex_unlock(&waveforms_mutex);
+   if(value < 0) value = 0;
+   if(value > 0xfff) value = 0xfff;
+   return value;
+}
+
+static unsigned int gpio_input(int module_number, uint64_t time){
+   // Waveforms are in message values, 1 is a low pin (button to ground
+   // pressed). Pins without one stay high.
+   unsigned int levels = 0xFFFFFFFF;
+   int pin;
+   pthread_mutex_lock(&waveforms_mutex);
+   unsigned int used = gpio_waveforms_used[module_number];
+   for(pin=0; used; pin++, used>>=1){
+      if((used & 1) && waveform_value(&gpio_waveforms[module_number*32 + pin], time)){
+         levels &= ~(1<<pin);
+      }
+   }
+   pthread_mutex_unlock(&waveforms_mutex);
+
+   // Pins configured as outputs read back what is written to them
+   unsigned int output_enable = REGISTER(gpio_registers[module_number], GPIO_OE);
+   return (levels & output_enable) | (REGISTER(gpio_registers[module_number], GPIO_DATAOUT) & ~output_enable);
+}
+
+static int adc_sequence_is_continuous(unsigned int steps){
+   int step;
+   for(step=1; step<=16; step++){
+      // Mode bits 1-0: 1 or 3 are continuous.
+      if((steps & (1<<step)) && (REGISTER(adc_registers, ADC_TSC_STEPCONFIG1 + 8*(step-1)) & 1)){
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static uint64_t adc_sequence_duration(unsigned int steps){
+   // Adc clock is 24MHz / clock divider. Each sample takes the open 
+   // delay plus averaged samples * (14 + sample delay) clocks.
+   uint64_t clocks = 0;
+   int step;
+   for(step=1; step<=16; step++){
+      if((steps & (1<<step)) == 0){
+         continue;
+      }
+      unsigned int config = REGISTER(adc_registers, ADC_TSC_STEPCONFIG1 + 8*(step-1));
+      unsigned int delay = REGISTER(adc_registers, ADC_TSC_STEPDELAY1 + 8*(step-1));
+      unsigned int averaged = 1 << ((config >> 2) & 0x7);
+      clocks += (delay & 0x3ffff) + averaged * (14 + (delay >> 24));
+   }
+   uint64_t duration = clocks * (REGISTER(adc_registers, ADC_TSC_CLKDIV) + 1) * 1000 / 24;
+   return duration > 0 ? duration : 1;
+}
+
+static void adc_convert(unsigned int steps, uint64_t time){
+   unsigned int control = REGISTER(adc_registers, ADC_TSC_CTRL);
+   int step;
+   for(step=1; step<=16; step++){
+      if((steps & (1<<step)) == 0){
+         continue;
+      }
+      if(adc_fifo_count == ADC_FIFO_SIZE){
+         adc_irq_status |= (1<<3); // fifo0 overrun
+         continue;
+      }
+      unsigned int config = REGISTER(adc_registers, ADC_TSC_STEPCONFIG1 + 8*(step-1));
+      unsigned int data = adc_input((config>>19) & 0xf, time);
+      if(control & (1<<1)){
+         data |= (step-1)<<16; // step id tag
+      }
+      adc_fifo[(adc_fifo_start + adc_fifo_count) % ADC_FIFO_SIZE] = data;
+      adc_fifo_count++;
+   }
+   adc_irq_status |= (1<<1); // end of sequence
+   if(adc_fifo_count > REGISTER(adc_registers, ADC_TSC_FIFO0THRESHOLD)){
+      adc_irq_status |= (1<<2); // fifo0 threshold
+   }
+}
+
+// Applies what the PRU0 program wrote since its last register access.
+static void update_hardware(uint64_t time){
+   // Write 1 to clear
+   if(w1c_status != NULL){
+      if((scratch & 0xFFFF0000) != W1C_UNTOUCHED){
+         *w1c_status &= ~scratch;
+      }
+      w1c_status = NULL;
+   }
+
+   // Gpio set and clear data out registers, the write is applied at the
+   // next access.
+   unsigned int module;
+   for(module=0; module<4; module++){
+      // The ARM side writes these too, swap so none of its writes is lost.
+      unsigned int set = __atomic_exchange_n(&REGISTER(gpio_registers[module], GPIO_SETDATAOUT), 0, __ATOMIC_ACQ_REL);
+      unsigned int clear = __atomic_exchange_n(&REGISTER(gpio_registers[module], GPIO_CLEARDATAOUT), 0, __ATOMIC_ACQ_REL);
+      if(set || clear){
+         REGISTER(gpio_registers[module], GPIO_DATAOUT) = (REGISTER(gpio_registers[module], GPIO_DATAOUT) | set) & ~clear;
+      }
+   }
+
+   // Interrupt to ARM
+   if(beaglebone_pruio_simulator_r31 & (1<<5)){
+      beaglebone_pruio_simulator_r31 = 0;
+      uint64_t one = 1;
+      if(write(event_fd, &one, sizeof(one)) != sizeof(one)){
+         // Counter is full, ARM is already signaled
+      }
+   }
+
+   // IEP timer counts nanoseconds. Only compare 0 is simulated.
+   if(REGISTER(iep_registers, IEP_TMR_GLB_CFG) & 1){
+      if(!iep_running){
+         iep_running = 1;
+         iep_counter_start = time;
+      }
+      unsigned int compare_config = REGISTER(iep_registers, IEP_TMR_CMP_CFG);
+      unsigned int compare = REGISTER(iep_registers, IEP_TMR_CMP0);
+      if((compare_config & (1<<1)) && compare > 0 && time - iep_counter_start >= compare){
+         iep_compare_status |= 1;
+         // Counter goes back to 0 on compare 0 event
+         if(compare_config & 1){
+            iep_counter_start += (time - iep_counter_start) / compare * compare;
+         }
+      }
+   }
+   else{
+      iep_running = 0;
+   }
+
+   // Cycle counter, PRU runs at 200MHz
+   if(REGISTER(pru0_ctrl_registers, PRU_CTRL_CONTROL) & (1<<3)){
+      if(!cycle_counter_running){
+         cycle_counter_running = 1;
+         cycle_counter_start = time;
+      }
+   }
+   else{
+      cycle_counter_running = 0;
+   }
+
+   // ADC converts one shot steps right away. Continuous steps are 
+   // converted again every time a sequence would take on the hardware.
+   unsigned int steps = REGISTER(adc_registers, ADC_TSC_STEPENABLE) & 0x1fffe;
+   unsigned int control = REGISTER(adc_registers, ADC_TSC_CTRL);
+   if((control & 1) && steps){
+      if(!adc_sequence_is_continuous(steps)){
+         adc_convert(steps, time);
+         REGISTER(adc_registers, ADC_TSC_STEPENABLE) &= ~steps;
+         adc_continuous_running = 0;
+      }
+      else{
+         uint64_t duration = adc_sequence_duration(steps);
+         if(!adc_continuous_running){
+            adc_continuous_running = 1;
+            adc_next_sequence = time + duration;
+         }
+         // Program was away for long, the fifo is overrun anyway.
+         if(time > adc_next_sequence + ADC_FIFO_SIZE*duration){
+            adc_next_sequence = time - ADC_FIFO_SIZE*duration;
+         }
+         while(adc_next_sequence <= time){
+            adc_convert(steps, adc_next_sequence);
+            adc_next_sequence += duration;
+         }
+      }
+   }
+   else{
+      adc_continuous_running = 0;
+   }
+}
+
+volatile unsigned int* beaglebone_pruio_simulator_register(unsigned long address){
+   // beaglebone_pruio_backend_stop_pru0() ends the PRU0 thread here.
+   if(pru0_stopping){
+      pthread_exit(NULL);
+   }
+
+   uint64_t time = current_time();
+   update_hardware(time);
+
+   int polling = (address == last_address);
+   last_address = address;
+   accesses_since_status++;
+
+   switch(address){
+      case IEP + IEP_TMR_CNT:
+         scratch = iep_running ? (unsigned int)(time - iep_counter_start) : 0;
+         return &scratch;
+
+      case IEP + IEP_TMR_CMP_STS:
+         // Program waits for the next frame, don't keep a host cpu busy.
+         // A wait loop that does some work between reads (pwm outputs,
+         // velocity keys) sleeps in short steps instead.
+         if(iep_running && !(iep_compare_status & 1) && (polling || accesses_since_status <= 16)){
+            uint64_t compare = iep_counter_start + REGISTER(iep_registers, IEP_TMR_CMP0);
+            sleep_until((polling || time + 5000 > compare) ? compare : time + 5000);
+            update_hardware(current_time());
+         }
+         accesses_since_status = 0;
+         scratch = W1C_UNTOUCHED | iep_compare_status;
+         w1c_status = &iep_compare_status;
+         return &scratch;
+
+      case PRU0_CTRL + PRU_CTRL_CYCLE:
+         scratch = cycle_counter_running ? (unsigned int)((time - cycle_counter_start) / 5) : 0;
+         return &scratch;
+
+      case ADC_TSC + ADC_TSC_IRQSTATUS:
+         scratch = W1C_UNTOUCHED | adc_irq_status;
+         w1c_status = &adc_irq_status;
+         return &scratch;
+
+      case ADC_TSC + ADC_TSC_FIFO0COUNT:
+         scratch = adc_fifo_count;
+         return &scratch;
+
+      case ADC_TSC + ADC_TSC_FIFO0DATA:
+         scratch = 0;
+         if(adc_fifo_count > 0){
+            scratch = adc_fifo[adc_fifo_start];
+            adc_fifo_start = (adc_fifo_start + 1) % ADC_FIFO_SIZE;
+            adc_fifo_count--;
+         }
+         return &scratch;
+
+      case GPIO0 + GPIO_DATAIN:
+         scratch = gpio_input(0, time);
+         return &scratch;
+      case GPIO1 + GPIO_DATAIN:
+         scratch = gpio_input(1, time);
+         return &scratch;
+      case GPIO2 + GPIO_DATAIN:
+         scratch = gpio_input(2, time);
+         return &scratch;
+      case GPIO3 + GPIO_DATAIN:
+         scratch = gpio_input(3, time);
+         return &scratch;
+   }
+
+   unsigned int i;
+   for(i=0; i<REGISTER_BLOCKS; i++){
+      register_block *block = &register_blocks[i];
+      if(address >= block->address && address < block->address + block->size){
+         return &(block->data[(address - block->address)/4]);
+      }
+   }
+
+   fprintf(stderr, "libbeaglebone_pruio: PRU0 program accessed unknown address 0x%lx in simulator.\n", address);
+   abort();
+}
+
+/////////////////////////////////////////////////////////////////////
+// Backend functions
+//
+
+static pthread_t pru0_thread;
+static int pru0_thread_started = 0;
+
+static void* run_pru0_program(void* param){
+   beaglebone_pruio_simulator_pru0_main(0, NULL);
+   return NULL;
+}
+
+int beaglebone_pruio_load_device_tree_overlay(char* dto){
+   // Nothing to load in the simulator.
+   return 0;
+}
+
+int beaglebone_pruio_backend_open(volatile unsigned int **shared_ram, volatile void *gpio_modules[4], int *event_fd_out){
+   clock_gettime(CLOCK_MONOTONIC, &time_zero);
+
+   event_fd = eventfd(0, EFD_NONBLOCK);
+   if(event_fd < 0){
+      fprintf(stderr, "libbeaglebone_pruio: Could not create simulator event file descriptor.\n");
+      return 1;
+   }
+   *event_fd_out = event_fd;
+
+   *shared_ram = shared_ram_registers;
+   int i;
+   for(i=0; i<4; i++){
+      gpio_modules[i] = gpio_registers[i];
+      // All pins are inputs after reset
+      REGISTER(gpio_registers[i], GPIO_OE) = 0xFFFFFFFF;
+   }
+
+   char *script = getenv("BEAGLEBONE_PRUIO_SIMULATOR_SCRIPT");
+   if(script != NULL && beaglebone_pruio_simulator_load_script(script)){
+      close(event_fd);
+      event_fd = -1;
+      return 1;
+   }
+
+   return 0;
+}
+
+int beaglebone_pruio_backend_start_pru0(){
+   // What the PRU0 program does not initialize itself starts from 
+   // reset values.
+   w1c_status = NULL;
+   last_address = 0;
+   accesses_since_status = 0;
+   beaglebone_pruio_simulator_r31 = 0;
+   iep_compare_status = 0;
+   iep_running = 0;
+   cycle_counter_running = 0;
+   adc_irq_status = 0;
+   adc_continuous_running = 0;
+   adc_fifo_start = 0;
+   adc_fifo_count = 0;
+
+   pru0_stopping = 0;
+   if(pthread_create(&pru0_thread, NULL, &run_pru0_program, NULL)){
+      fprintf(stderr, "libbeaglebone_pruio: Could not start simulator PRU0 thread.\n");
+      return 1;
+   }
+   pru0_thread_started = 1;
+   return 0;
+}
+
+void beaglebone_pruio_backend_stop_pru0(){
+   if(!pru0_thread_started){
+      return;
+   }
+   pru0_stopping = 1;
+   pthread_join(pru0_thread, NULL);
+   pru0_thread_started = 0;
+}
+
+void beaglebone_pruio_backend_close(){
+   beaglebone_pruio_backend_stop_pru0();
+   if(event_fd >= 0){
+      close(event_fd);
+      event_fd = -1;
+   }
+}
+
+int beaglebone_pruio_backend_clear_event(int event_fd){
+   uint64_t count;
+   if(read(event_fd, &count, sizeof(count)) != sizeof(count)){
+      return 1;
+   }
+   return 0;
+}
+
+int beaglebone_pruio_backend_set_pinmux(int gpio_number, const char *mode){
+   // No pinmux in the simulator, any gpio number works.
+   return 0;
+}
@@ -0,0 +1,64 @@
+/* Beaglebone Pru IO 
+ * 
+ * Copyright (C) 2015 Rafael Vega <rvega@elsoftwarehamuerto.org> 
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BEAGLEBONE_PRUIO_SIMULATOR_H
+#define BEAGLEBONE_PRUIO_SIMULATOR_H
+
+/**
+ * Only available when linking with libbeaglebone_pruio_simulator, which
+ * runs the PRU0 program in a thread on any Linux machine. Inputs follow
+ * the waveforms set here instead of real signals. Everything else works
+ * as with libbeaglebone_pruio.
+ */
+
+typedef enum{  
+   BEAGLEBONE_PRUIO_WAVEFORM_CONSTANT = 0,
+   BEAGLEBONE_PRUIO_WAVEFORM_SQUARE = 1,
+   BEAGLEBONE_PRUIO_WAVEFORM_SINE = 2,
+   BEAGLEBONE_PRUIO_WAVEFORM_RAMP = 3,
+   BEAGLEBONE_PRUIO_WAVEFORM_NOISE = 4
+} beaglebone_pruio_waveform;
+
+/**
+ * Sets the signal seen by an adc channel (0 to 
+ * BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS - 1, numbered as with the current 
+ * mux setup). Values go from low to high (0 to 4095), frequency is in
+ * Hz. Constant waveforms stay at high. Channels start as constant 0.
+ */
+int beaglebone_pruio_simulator_set_adc_waveform(int channel_number, beaglebone_pruio_waveform waveform, float frequency, int low, int high);
+
+/**
+ * Same as above for a gpio pin, low and high are 0 or 1 as in messages 
+ * (1 is a low pin, like a pressed button to ground). Pins start as 
+ * constant 0.
+ */
+int beaglebone_pruio_simulator_set_gpio_waveform(int gpio_number, beaglebone_pruio_waveform waveform, float frequency, int low, int high);
+
+/**
+ * Sets waveforms from a text file, one per line:
+ *
+ *    adc <channel number> <waveform> <frequency> <low> <high>
+ *    gpio <pin name or gpio number> <waveform> <frequency> <low> <high>
+ *
+ * waveform is constant, square, sine, ramp or noise. Lines starting with
+ * # are ignored. beaglebone_pruio_start() loads the file named by the 
+ * BEAGLEBONE_PRUIO_SIMULATOR_SCRIPT environment variable, if any.
+ */
+int beaglebone_pruio_simulator_load_script(const char *path);
+
+#endif //BEAGLEBONE_PRUIO_SIMULATOR_H
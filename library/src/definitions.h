@@ -27,11 +27,21 @@
 //
 
 /**
- * Messages from PRU0 to ARM processor are passed through througn a 
- * ring buffer in the PRU shared memory area.
+ * Messages from PRU0 to ARM processor are passed through two ring 
+ * buffers (lanes) in the PRU shared memory area. ADC messages go to
+ * the ADC lane and GPIO messages to the GPIO lane, so a lot of ADC
+ * activity can't delay or push out GPIO messages. ARM code reads the
+ * GPIO lane first.
+ *
+ * ADC lane:
  * shared_ram[0] to shared_ram[1023] is the buffer data.
  * shared_ram[1024] is the start (read) pointer.
  * shared_ram[1025] is the end (write) pointer.
+ *
+ * GPIO lane:
+ * shared_ram[1280] to shared_ram[1535] is the buffer data.
+ * shared_ram[1049] is the start (read) pointer.
+ * shared_ram[1050] is the end (write) pointer.
  * 
  * Messages are 32 bit unsigned integers:
  * 
@@ -49,47 +59,337 @@
  * 
  * 
  * An ADC Message:
- * 1XXX XXXX XXXX XXXX VVVV VVVV VVVV NNNN
- * |             |             |       |
- * |             |             |       |-- 3-0: ADC Channel
- * |             |             |
- * |             |             |-- 4-15: Value
- * |             |         
- * |             |-- 30-16: Unused
+ * 1XXX XXXX XXNN NNNN VVVV VVVV VVVV VVVV
+ * |          |     |          |
+ * |          |     |          |-- 15-0: Value (up to 16 bits)
+ * |          |     |
+ * |          |     |-- 21-16: ADC Channel
+ * |          |         
+ * |          |-- 30-22: Unused
  * |
  * |-- 31: Always 1, indicates this is an adc message
  * 
+ * 
+ * 
+ * An event message, from channels made of several gpio pins, goes to 
+ * the GPIO lane:
+ * 01TT TTTT VVVV VVVV VVVV VVVV NNNN NNNN
+ * | |       |                   |
+ * | |       |                   |-- 7-0: Number (GPIO number of the
+ * | |       |                            first pin of the channel, row * 16
+ * | |       |                            + column for matrix keys)
+ * | |       |
+ * | |       |-- 23-8: Value (16 bits, signed for encoders, 1 for a 
+ * | |       |         pressed matrix key and 0 for a released one, 
+ * | |       |         velocity 1 to 127 or 0 for note off for 
+ * | |       |         velocity keys)
+ * | |
+ * | |-- 29-24: Event type, 2 for encoders (see set encoder command), 3
+ * |            for matrix keys (see key matrix below), 4 for velocity 
+ * |            keys (see set velocity key command)
+ * |
+ * |-- 31-30: Always 01, indicates this is an event message
+ * 
+ * If timestamps are enabled (see MESSAGE_OPTIONS below), each message
+ * takes two consecutive positions in the buffer. The first one is the
+ * message as described above, the second one is the time at which
+ * the message was generated, in nanoseconds. The timestamp comes from
+ * the IEP timer and wraps around every 2^32 ns (~4.3 seconds).
+ * 
  * Read these to understand the ring buffer:
  *  > http://en.wikipedia.org/wiki/Circular_buffer#Use_a_Fill_Count
  *  > https://groups.google.com/forum/#!category-topic/beagleboard/F9JI8_vQ-mE
  */
+#define ADC_MESSAGE(channel_number, value) (((unsigned int)1<<31) | ((channel_number)<<ADC_MESSAGE_CHANNEL_SHIFT) | (value))
+#define ADC_MESSAGE_VALUE_MASK 0xFFFF
+#define ADC_MESSAGE_CHANNEL_SHIFT 16
+#define ADC_MESSAGE_CHANNEL_MASK 0x3F
+
+#define EVENT_MESSAGE(type, value, number) (((unsigned int)1<<30) | ((type)<<24) | (((value) & 0xFFFF)<<8) | (number))
+#define EVENT_ENCODER 2
+#define EVENT_MATRIX 3
+#define EVENT_VELOCITY_KEY 4
 
-#define RING_BUFFER_SIZE 1024
-#define RING_BUFFER_START 1024
-#define RING_BUFFER_END 1025
+#define ADC_RING_BUFFER_DATA 0
+#define ADC_RING_BUFFER_SIZE 1024
+#define ADC_RING_BUFFER_START 1024
+#define ADC_RING_BUFFER_END 1025
 
-/*
- * Each one of the 32 bits in shared_ram[1026] represent the 32 pins for
- * the GPIO0 module. If a bit is set, it means that we need
- * input for that GPIO channel. Same mechanism is used for GPIO1, 2 and 3
- * using the following shared ram positions:
+#define GPIO_RING_BUFFER_DATA 1280
+#define GPIO_RING_BUFFER_SIZE 256
+#define GPIO_RING_BUFFER_START 1049
+#define GPIO_RING_BUFFER_END 1050
+
+/**
+ * When PRU0 writes a message into an empty ring buffer (any lane) it raises 
+ * system event 19 (PRU0_ARM_INTERRUPT in prussdrv's default interrupt 
+ * mapping, which ends up in host interrupt PRU_EVTOUT_0). ARM code can
+ * then sleep on the uio file descriptor instead of polling the buffer.
+ * Events are raised by writing to register R31: bit 5 set plus the 
+ * event number minus 16.
+ */
+#define ARM_INTERRUPT_EVENT 19
+#define ARM_INTERRUPT_R31 ((1<<5) | (ARM_INTERRUPT_EVENT - 16))
+
+/**
+ * Configuration changes are sent from the ARM processor to PRU0 through
+ * a command ring buffer, so the PRU only does configuration work when 
+ * there is something to do. The ARM code is the only writer of the end
+ * pointer and the data, PRU0 is the only writer of the start pointer. 
+ *
+ * shared_ram[1536] to shared_ram[1599] is the buffer data.
+ * shared_ram[1026] is the start (read) pointer.
+ * shared_ram[1027] is the end (write) pointer.
+ *
+ * Both pointers are set to 0 by the ARM code before the PRU program is
+ * started. Each command takes two positions in the buffer:
+ *
+ * CCCC CCCC XXXX XXXX XXXX XXXX NNNN NNNN
+ * |             |                  |
+ * |             |                  |-- 7-0: GPIO number or ADC channel
+ * |             |
+ * |             |-- 23-8: Unused
+ * |
+ * |-- 31-24: Command
  *
- * shared_ram[1026] -> GPIO0
- * shared_ram[1027] -> GPIO1
- * shared_ram[1028] -> GPIO2
- * shared_ram[1029] -> GPIO3
+ * followed by a 32 bit parameter.
  *
+ * Command 1: Add GPIO input. Start sending messages for a gpio pin.
+ * Command 2: Remove GPIO input. Stop sending messages for a gpio pin.
+ * Command 3: Set ADC channel. Parameter is the channel configuration
+ *            (see below). Used to add or remove a channel and to change
+ *            its mode or parameters.
+ * Command 4: Stop. PRU0 leaves its main loop and halts.
+ * Command 5: Set frame period. Parameter is the new length of one 
+ *            iteration of PRU0's main loop, in nanoseconds. Ignored if
+ *            out of limits. A loop that takes longer than the period
+ *            is not refused, it is counted in the overruns timing stat.
+ * Command 6: Reset timing stats (see below).
+ * Command 7: Set GPIO debounce. Software debounce for an input pin: a
+ *            new level is only passed when the pin has read the same
+ *            for the time in the parameter, in nanoseconds. 0 turns it
+ *            off. Bounces shorter than that never send a message, a 
+ *            press or release is sent that much later.
+ * Command 8: Set GPIO hardware debounce. Bit 8 of the parameter enables
+ *            the debounce logic of the gpio module for the pin (0 
+ *            disables it), bits 7-0 are the debouncing time of the 
+ *            module, (n + 1) * 31 microseconds. The time is shared by
+ *            all the pins of the module.
+ * Command 9: Set encoder. A quadrature rotary encoder on two gpio 
+ *            pins, the number is pin A. PRU0 decodes the pins every 
+ *            frame and sends an event message with the counts turned
+ *            since the last message (positive when A leads B). The 
+ *            parameter:
+ *            Bit 31: Enable, 0 removes the encoder.
+ *            Bits 15-12: Acceleration, 0 is off. Counts are multiplied
+ *               by up to 1 + n when they come less than 2^25 ns 
+ *               (~34 ms) apart, the faster the more.
+ *            Bits 9-8: 2^n quarter steps (edges) per count, 0 to 2.
+ *            Bits 7-0: GPIO number of pin B.
+ * Command 10: Set velocity key. A key with two contacts on gpio pins 
+ *            that close one after the other when it is pressed, the
+ *            number is the first contact. Closed contacts read low. 
+ *            When the second one closes, PRU0 sends an event message
+ *            with a velocity (1 to 127) from the time between both, 
+ *            127 * fastest time / time. When the first one opens 
+ *            again it sends velocity 0 (note off). Contacts are also 
+ *            read while PRU0 waits for the next frame, times are 
+ *            accurate to about a microsecond. The parameter:
+ *            Bit 31: Enable, 0 removes the key.
+ *            Bits 23-8: Fastest time, velocity 127, in 1024ns units.
+ *            Bits 7-0: GPIO number of the second contact.
+ * Command 11: Set PWM output. A gpio output pin, the number, driven by 
+ *            PRU0 with the period and duty of a pwm slot (see below).
+ *            Each period starts with the pin high (unless the duty is
+ *            0) and it goes low when the duty time has passed. Edges 
+ *            are made while PRU0 waits for the next frame and between
+ *            the phases of the frame. The pin is left low when the 
+ *            slot is disabled or used for another pin. The parameter:
+ *            Bit 31: Enable, 0 stops the pwm of the slot.
+ *            Bits 4-0: Slot, 0 to 15.
+ * Command 12: Set GPIO direction. Parameter 1 makes the pin an output,
+ *            0 an input. PRU0 is the only writer of the gpio output 
+ *            enable registers while it runs, so the ARM code sends 
+ *            direction changes as commands instead of writing them. 
+ *            Ignored for key matrix rows.
+ *
+ * shared_ram[1028] is the state of PRU0, so the ARM code knows when a 
+ * stop command was honored. Set to 0 (stopped) by the ARM code before
+ * starting the PRU program, 1 (running) by PRU0 when it starts its main 
+ * loop and 2 (halted) right before it halts.
+ *
+ * shared_ram[1029] is the frame period in use, in nanoseconds, written
+ * by PRU0 when it starts and when it accepts a set frame period command.
+ * Every frame, all gpio inputs and adc channels without a mux are read
+ * once, and one of the channels behind each mux (see below). So each 
+ * channel behind an 8 input mux gets one value every 8 frames. In 
+ * continuous adc mode (see below) the adc channels are read when the 
+ * fifo threshold is reached instead.
+ *
+ * shared_ram[1030] holds options for the adc. It is written by the ARM
+ * code before the PRU program is started and read only once by the PRU
+ * at startup.
+ *
+ * Bits 2-0: Hardware averaging. The adc converts 2^n samples and 
+ *        averages them for each value, n is 0 (no average) to 4 (16 
+ *        samples). If not 0, channels without a mux are not averaged over 8
+ *        frames by PRU0 anymore, their values are used as they come.
+ *
+ * Bit 3: Continuous mode. The adc converts the enabled steps over and
+ *        over by itself, instead of once every frame when PRU0 starts
+ *        it. PRU0 reads the fifo only when it reaches the threshold and
+ *        uses the latest sample of each step. The mux is moved to the 
+ *        next channel after each read.
+ *
+ * Bits 11-8: Fifo threshold for continuous mode, in sequences: how many
+ *        times each enabled step is converted before PRU0 reads the 
+ *        fifo (1 to 8).
+ *
+ * shared_ram[1031] to shared_ram[1033] describe the analog muxes. 
+ * Written by the ARM code before the PRU program is started and read
+ * only once by the PRU at startup. All muxes share the same select 
+ * lines (gpio outputs), so they all switch to the same input at once
+ * and are read in parallel, one adc step per analog input.
+ *
+ * shared_ram[1031]:
+ * Bits 6-0: Analog inputs (AIN0 to AIN6) that have a mux, one bit each.
+ * Bits 10-8: Number of select lines, 0 to 4. Each mux has 2^n inputs.
+ *
+ * shared_ram[1032] holds the gpio numbers of the select lines, one per 
+ * byte, least significant bit of the mux input first.
+ *
+ * shared_ram[1033] is the time to wait for the mux output to settle 
+ * before sampling an input with a mux, in adc clock cycles (24 MHz), 
+ * used as the adc open delay for those steps.
+ *
+ * ADC channels are numbered from AIN0 up, one channel for an input 
+ * without a mux and 2^n channels for an input with a mux. The default 
+ * is the same as the original board: one 8 input mux on AIN6, selected
+ * by P8_27, P8_28 and P8_29, channels 0 to 5 are AIN0 to AIN5 and 6 to
+ * 13 are the mux inputs.
+ *
+ * shared_ram[1034] to shared_ram[1040] describe a key matrix. Written
+ * by the ARM code before the PRU program is started and read only once
+ * by the PRU at startup. PRU0 selects one row per frame and reads the 
+ * columns of that row on the next frame, so a full scan takes as many 
+ * frames as there are rows and a row has most of a frame to settle. 
+ * The selected row is driven low, the others are left floating (output
+ * disabled), columns need pull ups and read low for a pressed key. The
+ * output enable bits of the rows are rewritten every frame and set 
+ * (all rows inputs) when PRU0 halts. A key changes when its row has 
+ * read the same for the debounce scans. Without diodes, three keys 
+ * pressed on the corners of a rectangle make the fourth look pressed:
+ * a row with two or more keys pressed that shares a column with 
+ * another row is not updated until that clears. Keys send event 
+ * messages.
+ *
+ * shared_ram[1034]:
+ * Bits 3-0: Number of rows, 0 (no matrix) to 8.
+ * Bits 12-8: Number of columns, 0 to 16.
+ * Bits 19-16: Debounce scans, 0 to 15.
+ * Bit 24: Diodes. Every key has a diode, no ghost keys.
+ *
+ * shared_ram[1035] and shared_ram[1036] hold the gpio numbers of the 
+ * rows, shared_ram[1037] to shared_ram[1040] the gpio numbers of the 
+ * columns, one per byte, row or column 0 first.
+ *
+ * shared_ram[1041] to shared_ram[1043] are unused.
+ *
+ * shared_ram[1664] to shared_ram[1695] are the pwm slots, written by 
+ * the ARM code at any time. Two words per slot: period and duty (time
+ * high), both in nanoseconds. PRU0 takes both when a new period 
+ * starts, write the slot before enabling it with the set pwm output 
+ * command. Periods shorter than 10 microseconds are taken as 10.
  */
-#define GPIO0_CONFIG 1026
-#define GPIO1_CONFIG 1027
-#define GPIO2_CONFIG 1028
-#define GPIO3_CONFIG 1029
+#define COMMAND_BUFFER_DATA 1536
+#define COMMAND_BUFFER_SIZE 64
+#define COMMAND_BUFFER_START 1026
+#define COMMAND_BUFFER_END 1027
+
+#define COMMAND_ADD_GPIO_INPUT 1
+#define COMMAND_REMOVE_GPIO_INPUT 2
+#define COMMAND_SET_ADC_CHANNEL 3
+#define COMMAND_STOP 4
+#define COMMAND_SET_FRAME_PERIOD 5
+#define COMMAND_RESET_TIMING 6
+#define COMMAND_SET_GPIO_DEBOUNCE 7
+#define COMMAND_SET_GPIO_HARDWARE_DEBOUNCE 8
+
+#define GPIO_DEBOUNCE_MAX 1000000000
+#define GPIO_HARDWARE_DEBOUNCE_ENABLE (1<<8)
+#define GPIO_HARDWARE_DEBOUNCE_TIME_MASK 0xFF
+
+#define COMMAND_SET_ENCODER 9
+#define ENCODER_ENABLE ((unsigned int)1<<31)
+#define ENCODER_PIN_B_MASK 0xFF
+#define ENCODER_STEPS_SHIFT 8
+#define ENCODER_STEPS_MASK (0x3<<8)
+#define ENCODER_ACCELERATION_SHIFT 12
+#define ENCODER_ACCELERATION_MASK (0xF<<12)
+#define ENCODER_ACCELERATION_TIME_SHIFT 25
+#define ENCODER_ACCELERATION_TIME (1<<25)
+
+#define COMMAND_SET_VELOCITY_KEY 10
+#define VELOCITY_KEY_ENABLE ((unsigned int)1<<31)
+#define VELOCITY_KEY_PIN_B_MASK 0xFF
+#define VELOCITY_KEY_FASTEST_SHIFT 8
+#define VELOCITY_KEY_FASTEST_MASK (0xFFFF<<8)
+
+#define COMMAND_SET_PWM_OUTPUT 11
+#define PWM_OUTPUT_ENABLE ((unsigned int)1<<31)
+#define PWM_OUTPUT_SLOT_MASK 0x1F
+
+#define COMMAND_SET_GPIO_DIRECTION 12
+#define GPIO_DIRECTION_INPUT 0
+#define GPIO_DIRECTION_OUTPUT 1
+
+#define PRU_STATE 1028
+#define PRU_STATE_STOPPED 0
+#define PRU_STATE_RUNNING 1
+#define PRU_STATE_HALTED 2
+
+#define FRAME_PERIOD 1029
+#define FRAME_PERIOD_DEFAULT 83333
+#define FRAME_PERIOD_MIN 10000
+#define FRAME_PERIOD_MAX 10000000
+
+#define ADC_OPTIONS 1030
+#define ADC_OPTIONS_AVERAGING_MASK 0x7
+#define ADC_OPTIONS_CONTINUOUS (1<<3)
+#define ADC_OPTIONS_THRESHOLD_SHIFT 8
+#define ADC_OPTIONS_THRESHOLD_MASK (0xf<<8)
+#define ADC_AVERAGING_MAX 4
+#define ADC_THRESHOLD_MAX 8
+
+#define ADC_MUX 1031
+#define ADC_MUX_AINS_MASK 0x7f
+#define ADC_MUX_PINS_SHIFT 8
+#define ADC_MUX_PINS_MASK (0x7<<8)
+#define ADC_MUX_SELECT 1032
+#define ADC_MUX_SETTLE 1033
+#define ADC_MUX_MAX_PINS 4
+#define ADC_AINS 7
+
+#define MATRIX 1034
+#define MATRIX_ROWS_MASK 0xf
+#define MATRIX_COLUMNS_SHIFT 8
+#define MATRIX_COLUMNS_MASK (0x1f<<8)
+#define MATRIX_DEBOUNCE_SHIFT 16
+#define MATRIX_DEBOUNCE_MASK (0xf<<16)
+#define MATRIX_DIODES (1<<24)
+#define MATRIX_ROW_PINS 1035
+#define MATRIX_COLUMN_PINS 1037
+#define MATRIX_DEBOUNCE_MAX 15
+
+#define PWM_OUTPUTS 1664
+#define PWM_PERIOD_MIN 10000
+#define PWM_PERIOD_MAX 1000000000
 
 /**
- * shared_ram[1030] to shared_ram[1043] are options for each adc channel
- * Each configuration number is a 32 bit unsigned integer:
+ * ADC channel configuration, the parameter of the set adc channel 
+ * command. A 32 bit unsigned integer:
  * 
- * MMMM XXXX RRRR RRRR QQQQ QQQQ PPPP PPPP
+ * MMMM FFFF RRRR RRRR QQQQ QQQQ PPPP PPPP
  * |     |       |         |         |
  * |     |       |         |         |-- 7-0: Parameter 1
  * |     |       |         |
@@ -97,7 +397,7 @@
  * |     |       |         
  * |     |       |-- 16-23: Parameter 3
  * |     |
- * |     |-- 24-27: Unused
+ * |     |-- 24-27: Filter (see below)
  * |
  * |-- 31-28: Mode.
  * 
@@ -112,22 +412,135 @@
  *         options with a potentiometer. Parameter 1 is the number of
  *         ranges.
  *
+ * Mode 3: Deadband mode. Like normal mode, but a new value is only
+ *         passed when the input moves more than parameter 2 steps of
+ *         the 12 bit adc value away from the input the last value was
+ *         sent for. Stops an input sitting between two values from 
+ *         sending a message every time it is read. Parameter 1 is the
+ *         number of bits for the value.
+ *
+ * Mode 4: Oversampling mode. 4^n samples are added up and the sum is
+ *         shifted right n bits, which gives a value with n more bits
+ *         than the adc has (needs some noise in the input to work). 
+ *         Parameter 1 is the number of bits for the value, 12 + n, 
+ *         13 to 16. Meant for channels without a mux, which are 
+ *         sampled every frame.
+ *
+ * Filter, applied to the 12 bit adc samples of the channel before the
+ * mode does its work:
+ *
+ * Bits 26-24: Smoothing. 0 is off, n is a one pole low pass filter 
+ *        that moves 1/2^n of the way to each new sample. Higher is 
+ *        smoother and slower.
+ *
+ * Bit 27: Median of 3. Each sample is replaced by the median of it and
+ *        the two before, removes single sample spikes. Done before
+ *        smoothing.
+ */
+#define ADC_FILTER_SMOOTHING_MASK 0x7
+#define ADC_FILTER_MEDIAN (1<<3)
+
+/**
+ * Current state of all inputs, written by PRU0 once per frame, so ARM 
+ * code can get the value of any input without reading every message.
+ *
+ * shared_ram[1055] is a sequence counter. PRU0 increments it before 
+ * and after writing the table, so it is odd while the table is being 
+ * written. Readers copy the table and check that the counter was even
+ * and did not change while copying (a seqlock).
+ * shared_ram[1056] is the time the table was written at (see timestamps
+ * in the ring buffer section).
+ * shared_ram[1057] to shared_ram[1060] are the levels of input pins of
+ * GPIO0 to GPIO3, one bit per pin, as read from GPIO_DATAIN.
+ * shared_ram[1061] onwards, one word per adc channel, is the last value
+ * of each channel, as sent in the adc messages.
+ */
+#define STATE_SEQUENCE 1055
+#define STATE_TIMESTAMP 1056
+#define STATE_GPIO0 1057
+#define STATE_ADC0 1061
+
+/**
+ * shared_ram[1044] holds options for the messages sent from PRU0 to 
+ * the ARM processor. It is written by the ARM code before the PRU 
+ * program is started and read only once by the PRU at startup.
+ *
+ * Bit 0: Timestamps. If set, every message is followed by a timestamp
+ *        in the ring buffer.
+ *
+ * Bits 2-1: What to do when a ring buffer is full:
+ *        0: Drop newest. New messages are discarded.
+ *        1: Drop oldest. The oldest unread message is overwritten.
+ *        2: Coalesce. Only the latest value of each ADC channel is 
+ *           kept and sent when there is room again. GPIO messages are
+ *           dropped as in mode 0, edges can't be coalesced.
  */
+#define MESSAGE_OPTIONS 1044
+#define MESSAGE_OPTIONS_TIMESTAMPS (1<<0)
+#define MESSAGE_OPTIONS_OVERFLOW_SHIFT 1
+#define MESSAGE_OPTIONS_OVERFLOW_MASK (0x3<<1)
 
-#define ADC0_CONFIG 1030
-#define ADC1_CONFIG 1031
-#define ADC2_CONFIG 1032
-#define ADC3_CONFIG 1033
-#define ADC4_CONFIG 1034
-#define ADC5_CONFIG 1035
-#define ADC6_CONFIG 1036
-#define ADC7_CONFIG 1037
-#define ADC8_CONFIG 1038
-#define ADC9_CONFIG 1039
-#define ADC10_CONFIG 1040
-#define ADC11_CONFIG 1041
-#define ADC12_CONFIG 1042
-#define ADC13_CONFIG 1043
+#define OVERFLOW_DROP_NEWEST 0
+#define OVERFLOW_DROP_OLDEST 1
+#define OVERFLOW_COALESCE 2
+
+/**
+ * Ring buffer statistics, written by PRU0. For the ADC lane:
+ *
+ * shared_ram[1045] is the number of messages dropped because the 
+ * buffer was full, since the PRU started.
+ * shared_ram[1046] is the maximum number of positions in the buffer 
+ * that were in use at the same time (high watermark).
+ *
+ * In drop oldest mode, the PRU can't move the start (read) pointer 
+ * because the ARM code owns it. Instead:
+ *
+ * shared_ram[1047] is incremented by the PRU every time it overwrites
+ * the oldest message.
+ * shared_ram[1048] is written by the ARM code: the value of [1047] it
+ * has already accounted for by advancing the start pointer.
+ *
+ * Both sides consider the actual start of the buffer to be
+ * start + ([1047] - [1048]) * message size.
+ *
+ * shared_ram[1051] to shared_ram[1054] are the same for the GPIO lane.
+ */
+#define ADC_RING_BUFFER_DROPPED 1045
+#define ADC_RING_BUFFER_HIGH_WATERMARK 1046
+#define ADC_RING_BUFFER_SKIPPED 1047
+#define ADC_RING_BUFFER_SKIPPED_ACK 1048
+
+#define GPIO_RING_BUFFER_DROPPED 1051
+#define GPIO_RING_BUFFER_HIGH_WATERMARK 1052
+#define GPIO_RING_BUFFER_SKIPPED 1053
+#define GPIO_RING_BUFFER_SKIPPED_ACK 1054
+
+/**
+ * Timing stats, written by PRU0, to know how much of each frame is 
+ * used. Times are measured with the PRU0 cycle counter, in PRU cycles
+ * (5ns). For each phase of the main loop there are three words:
+ * minimum, average and maximum time. The average is a running average
+ * that gives more weight to recent frames (1/16 for the last one).
+ *
+ * shared_ram[1128] to shared_ram[1130]: Writing buffered messages.
+ * shared_ram[1131] to shared_ram[1133]: ADC sampling and processing.
+ * shared_ram[1134] to shared_ram[1136]: GPIO processing.
+ * shared_ram[1137] to shared_ram[1139]: Publishing the state table.
+ * shared_ram[1140] to shared_ram[1142]: Reading commands.
+ * shared_ram[1143] to shared_ram[1145]: Whole frame.
+ *
+ * shared_ram[1146] is the number of overruns: frames where the loop 
+ * took longer than the frame period.
+ */
+#define TIMING_STATS 1128
+#define TIMING_PHASE_BUFFER 0
+#define TIMING_PHASE_ADC 1
+#define TIMING_PHASE_GPIO 2
+#define TIMING_PHASE_STATE 3
+#define TIMING_PHASE_COMMANDS 4
+#define TIMING_PHASE_FRAME 5
+#define TIMING_PHASES 6
+#define TIMING_OVERRUNS 1146
 
 
 /////////////////////////////////////////////////////////////////////
@@ -138,6 +551,14 @@
 #define PRU_ICSS_CFG 0x26000
 #define PRU_ICSS_CFG_SYSCFG 0x04
 
+// PRU Shared RAM, 12KB
+#define PRU_SHARED_RAM 0x10000
+
+// PRU0 Control Registers
+#define PRU0_CTRL 0x22000
+#define PRU_CTRL_CONTROL 0x00
+#define PRU_CTRL_CYCLE 0x0C
+
 // IEP Module Registers
 #define IEP 0x2e000
 #define IEP_TMR_GLB_CFG 0x00
@@ -176,6 +597,7 @@
 #define ADC_TSC 0x44e0d000
 #define ADC_TSC_IRQSTATUS 0x28
 #define ADC_TSC_IRQENABLE_SET 0x2c
+#define ADC_TSC_IRQENABLE_CLR 0x30
 #define ADC_TSC_CTRL 0x40
 #define ADC_TSC_ADCRANGE 0x48
 #define ADC_TSC_CLKDIV 0x4c
@@ -213,6 +635,7 @@
 #define ADC_TSC_STEPCONFIG16 0xdc
 #define ADC_TSC_STEPDELAY16 0xe0
 #define ADC_TSC_FIFO0COUNT 0xe4
+#define ADC_TSC_FIFO0THRESHOLD 0xe8
 #define ADC_TSC_FIFO1COUNT 0xf0
 #define ADC_TSC_FIFO0DATA 0x100
 #define ADC_TSC_FIFO1DATA 0x200
@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
 #include "definitions.h"
 #include "beaglebone_pruio_pins.h"
 
@@ -23,14 +24,26 @@
 // UTIL
 //
 
-#define HWREG(x) (*((volatile unsigned int *)(x)))
+#ifdef BEAGLEBONE_PRUIO_SIMULATOR
+   // Built for the host, see beaglebone_pruio_simulator.c
+   #include "pru0_simulator.h"
+#else
+   #define HWREG(x) (*((volatile unsigned int *)(x)))
+#endif
 
 /////////////////////////////////////////////////////////////////////
 // DECLARATIONS
 //
 
 volatile unsigned int* shared_ram;
+#ifndef BEAGLEBONE_PRUIO_SIMULATOR
 volatile register unsigned int __R31;
+#endif
+
+// Called while waiting for the timer, see pwm outputs and velocity 
+// keys below.
+inline void update_pwm_outputs(unsigned int now);
+inline void poll_velocity_keys(unsigned int now);
 
 
 /////////////////////////////////////////////////////////////////////
@@ -39,25 +52,209 @@ volatile register unsigned int __R31;
 
 // Read the comments in definitions.h
 
-unsigned int buffer_size;
-volatile unsigned int *buffer_start;
-volatile unsigned int *buffer_end;
+typedef struct ring_buffer{
+   volatile unsigned int *data;
+   unsigned int size;
+   volatile unsigned int *start;
+   volatile unsigned int *end;
+   volatile unsigned int *dropped;
+   volatile unsigned int *high_watermark;
+   volatile unsigned int *skipped;
+   volatile unsigned int *skipped_ack;
+} ring_buffer;
+
+ring_buffer adc_buffer;
+ring_buffer gpio_buffer;
+unsigned int message_size;
+unsigned int overflow_policy;
+
+// Nanoseconds elapsed up to the start of the current frame. Added to
+// the IEP counter to timestamp messages. See wait_for_timer().
+unsigned int time_base;
+
+// Coalesce policy: latest adc message for each channel that could not
+// be written because the buffer was full.
+unsigned int pending_adc_messages[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
+unsigned int pending_adc_timestamps[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
+unsigned char pending_adc[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
+unsigned int pending_adc_count;
+
+void init_ring_buffer(ring_buffer *buffer, unsigned int data, unsigned int size, unsigned int start, unsigned int end, unsigned int stats){
+   // stats is the position of the dropped counter, the high watermark,
+   // skipped and skipped ack follow it.
+   buffer->data = &(shared_ram[data]);
+   buffer->size = size;
+   buffer->start = &(shared_ram[start]);
+   buffer->end = &(shared_ram[end]);
+   buffer->dropped = &(shared_ram[stats]);
+   buffer->high_watermark = &(shared_ram[stats+1]);
+   buffer->skipped = &(shared_ram[stats+2]);
+   buffer->skipped_ack = &(shared_ram[stats+3]);
+   *buffer->start = 0;
+   *buffer->end = 0;
+   *buffer->dropped = 0;
+   *buffer->high_watermark = 0;
+   *buffer->skipped = 0;
+   *buffer->skipped_ack = 0;
+}
 
 void init_buffer(){
-   buffer_size = RING_BUFFER_SIZE; 
-   buffer_start = &(shared_ram[RING_BUFFER_START]);
-   buffer_end = &(shared_ram[RING_BUFFER_END]);
-   *buffer_start = 0;
-   *buffer_end = 0;
+   init_ring_buffer(&adc_buffer, ADC_RING_BUFFER_DATA, ADC_RING_BUFFER_SIZE, ADC_RING_BUFFER_START, ADC_RING_BUFFER_END, ADC_RING_BUFFER_DROPPED);
+   init_ring_buffer(&gpio_buffer, GPIO_RING_BUFFER_DATA, GPIO_RING_BUFFER_SIZE, GPIO_RING_BUFFER_START, GPIO_RING_BUFFER_END, GPIO_RING_BUFFER_DROPPED);
+
+   // Message and timestamp take two positions in the buffer.
+   unsigned int options = shared_ram[MESSAGE_OPTIONS];
+   if(options & MESSAGE_OPTIONS_TIMESTAMPS){
+      message_size = 2;
+   }
+   else{
+      message_size = 1;
+   }
+   overflow_policy = (options & MESSAGE_OPTIONS_OVERFLOW_MASK) >> MESSAGE_OPTIONS_OVERFLOW_SHIFT;
+   unsigned int i;
+   for(i=0; i<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; i++){
+      pending_adc[i] = 0;
+   }
+   pending_adc_count = 0;
+   time_base = 0;
 }
 
-inline void buffer_write(unsigned int *message){
-   // Note that if buffer is full, messages will be dropped
-   unsigned int is_full = (*buffer_end == (*buffer_start^buffer_size)); // ^ is orex
-   if(!is_full){
-      shared_ram[*buffer_end & (buffer_size-1)] = *message;
-      // Increment buffer end, wrap around 2*size
-      *buffer_end = (*buffer_end+1) & (2*buffer_size - 1);
+inline unsigned int current_time(){
+   return time_base + HWREG(IEP + IEP_TMR_CNT);
+}
+
+inline unsigned int buffer_used(ring_buffer *buffer){
+   // Messages skipped in drop oldest mode that the ARM code has not 
+   // acknowledged yet count as already read.
+   unsigned int start = *buffer->start + (*buffer->skipped - *buffer->skipped_ack)*message_size;
+   return (*buffer->end - start) & (2*buffer->size - 1);
+}
+
+inline void buffer_put(ring_buffer *buffer, unsigned int message, unsigned int timestamp, unsigned int used){
+   unsigned int position = *buffer->end & (buffer->size-1);
+   buffer->data[position] = message;
+   if(message_size == 2){
+      buffer->data[position+1] = timestamp;
+   }
+   // Increment buffer end, wrap around 2*size
+   *buffer->end = (*buffer->end+message_size) & (2*buffer->size - 1);
+
+   used += message_size;
+   if(used > *buffer->high_watermark){
+      *buffer->high_watermark = used;
+   }
+
+   // Wake up ARM code waiting for messages. Only needed when the 
+   // buffer was empty, otherwise ARM is still busy reading.
+   if(used == message_size){
+      __R31 = ARM_INTERRUPT_R31;
+   }
+}
+
+inline void buffer_write_with_timestamp(ring_buffer *buffer, unsigned int *message, unsigned int timestamp){
+   unsigned int used = buffer_used(buffer);
+   if(used >= buffer->size){
+      *buffer->dropped += 1;
+      if(overflow_policy != OVERFLOW_DROP_OLDEST){
+         return;
+      }
+      // Oldest message is overwritten, tell ARM to skip it.
+      *buffer->skipped += 1;
+      used -= message_size;
+   }
+   buffer_put(buffer, *message, timestamp, used);
+}
+
+inline void buffer_write_gpio(unsigned int *message){
+   buffer_write_with_timestamp(&gpio_buffer, message, current_time());
+}
+
+/////////////////////////////////////////////////////////////////////
+// STATE TABLE
+//
+
+// Read the comments in definitions.h
+
+unsigned int state_adc[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
+unsigned int state_gpio[4];
+unsigned int state_changed;
+
+void init_state(){
+   int i;
+   for(i=0; i<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; i++){
+      state_adc[i] = 0;
+      shared_ram[STATE_ADC0+i] = 0;
+   }
+   for(i=0; i<4; i++){
+      state_gpio[i] = 0;
+      shared_ram[STATE_GPIO0+i] = 0;
+   }
+   shared_ram[STATE_TIMESTAMP] = 0;
+   shared_ram[STATE_SEQUENCE] = 0;
+   state_changed = 0;
+}
+
+inline void publish_state(){
+   // Copy the state to shared ram in one short burst, only if something
+   // changed during this frame. Sequence is odd while writing.
+   if(!state_changed){
+      return;
+   }
+   int i;
+   shared_ram[STATE_SEQUENCE] += 1;
+   shared_ram[STATE_TIMESTAMP] = current_time();
+   for(i=0; i<4; i++){
+      shared_ram[STATE_GPIO0+i] = state_gpio[i];
+   }
+   for(i=0; i<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; i++){
+      shared_ram[STATE_ADC0+i] = state_adc[i];
+   }
+   shared_ram[STATE_SEQUENCE] += 1;
+   state_changed = 0;
+}
+
+inline void buffer_write_adc(unsigned int channel_number, unsigned int *message){
+   // Every adc message carries the latest value for its channel.
+   state_adc[channel_number] = *message & ADC_MESSAGE_VALUE_MASK;
+   state_changed = 1;
+
+   if(overflow_policy == OVERFLOW_COALESCE){
+      // No room, remember only the latest value for this channel.
+      if(buffer_used(&adc_buffer) >= adc_buffer.size){
+         if(pending_adc[channel_number]){
+            *adc_buffer.dropped += 1;
+         }
+         else{
+            pending_adc[channel_number] = 1;
+            pending_adc_count++;
+         }
+         pending_adc_messages[channel_number] = *message;
+         pending_adc_timestamps[channel_number] = current_time();
+         return;
+      }
+
+      // A newer value replaces the pending one.
+      if(pending_adc[channel_number]){
+         *adc_buffer.dropped += 1;
+         pending_adc[channel_number] = 0;
+         pending_adc_count--;
+      }
+   }
+   buffer_write_with_timestamp(&adc_buffer, message, current_time());
+}
+
+inline void buffer_flush_pending(){
+   // Coalesce policy: send pending adc values when there's room again
+   unsigned int channel_number;
+   for(channel_number=0; pending_adc_count!=0 && channel_number<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; ++channel_number){
+      if(buffer_used(&adc_buffer) >= adc_buffer.size){
+         return;
+      }
+      if(pending_adc[channel_number]){
+         buffer_write_with_timestamp(&adc_buffer, &(pending_adc_messages[channel_number]), pending_adc_timestamps[channel_number]);
+         pending_adc[channel_number] = 0;
+         pending_adc_count--;
+      }
    }
 }
 
@@ -66,8 +263,6 @@ inline void buffer_write(unsigned int *message){
 //
 
 void init_gpio(){
-   // TODO: * measure if hardware debounce mechanism adds latency.
-   
    // See BeagleboneBlackP9HeaderTable.pdf from derekmolloy.ie
    // Way easier to read than TI's manual
 
@@ -75,91 +270,34 @@ void init_gpio(){
    HWREG(GPIO0 + GPIO_CTRL) = 0x00;
    // Enable clock for GPIO0 module. 
    HWREG(CM_WKUP + CM_WKUP_GPIO0_CLKCTRL) = (0x02) | (1<<18);
-   // Set debounce time for GPIO0 module
-   // time = (DEBOUNCINGTIME + 1) * 31uSec
-   HWREG(GPIO0 + GPIO_DEBOUNCINGTIME) = 255;
+   // Hardware debounce is off until the ARM code turns it on for a 
+   // pin, see the set gpio hardware debounce command in definitions.h
+   HWREG(GPIO0 + GPIO_DEBOUNCENABLE) = 0;
 
    // Enable GPIO1 Module.
    HWREG(GPIO1 + GPIO_CTRL) = 0x00;
    // Enable clock for GPIO1 module. 
    HWREG(CM_PER + CM_PER_GPIO1_CLKCTRL) = (0x02) | (1<<18);
-   // Set debounce time for GPIO1 module
-   // time = (DEBOUNCINGTIME + 1) * 31uSec
-   /* HWREG(GPIO1 + GPIO_DEBOUNCINGTIME) = 255; */
+   // Hardware debounce off.
+   HWREG(GPIO1 + GPIO_DEBOUNCENABLE) = 0;
    
    // Enable GPIO2 Module.
    HWREG(GPIO2 + GPIO_CTRL) = 0x00;
    // Enable clock for GPIO2 module. 
    HWREG(CM_PER + CM_PER_GPIO2_CLKCTRL) = (0x02) | (1<<18);
-   // Set debounce time for GPIO2 module
-   // time = (DEBOUNCINGTIME + 1) * 31uSec
-   /* HWREG(GPIO2 + GPIO_DEBOUNCINGTIME) = 255; */
+   // Hardware debounce off.
+   HWREG(GPIO2 + GPIO_DEBOUNCENABLE) = 0;
    
    // Enable GPIO3 Module.
    HWREG(GPIO3 + GPIO_CTRL) = 0x00;
    // Enable clock for GPIO3 module. 
    HWREG(CM_PER + CM_PER_GPIO3_CLKCTRL) = (0x02) | (1<<18);
-   // Set debounce time for GPIO3 module
-   // time = (DEBOUNCINGTIME + 1) * 31uSec
-   /* HWREG(GPIO3 + GPIO_DEBOUNCINGTIME) = 255; */
-}
-
-inline void set_mux_control(unsigned int ctl){
-   // 3 bits for mux control: 
-   // [P8_27 GPIO2[22], P8_28 GPIO2[24], P8_29 GPIO2[23]]
-   switch(ctl){
-      case 0:
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<23);
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<24);
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<22);
-         break;
-
-      case 1:
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<23);
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<24);
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<22);
-         break;
-
-      case 2:
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<23);
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<24);
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<22);
-         break;
-
-      case 3:
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<23);
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<24);
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<22);
-         break;
-
-      case 4:
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<23);
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<24);
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<22);
-         break;
-
-      case 5:
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<23);
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<24);
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<22);
-         break;
-
-      case 6:
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<23);
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<24);
-         HWREG(GPIO2 + GPIO_DATAOUT) &= ~(1<<22);
-         break;
-
-      default: //7
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<23);
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<24);
-         HWREG(GPIO2 + GPIO_DATAOUT) |= (1<<22);
-         break;
-   }
+   // Hardware debounce off.
+   HWREG(GPIO3 + GPIO_DEBOUNCENABLE) = 0;
 }
 
 inline char * get_gpio_module_address(int module_number){
-   int r;
+   uintptr_t r;
    switch(module_number) {
       case 0:
          r = GPIO0; 
@@ -170,21 +308,79 @@ inline char * get_gpio_module_address(int module_number){
       case 2:
          r = GPIO2; 
          break;
-      case 3:
+      default:
          r = GPIO3; 
          break;
    }
    return (char *)r;
 }
 
+// Analog mux select lines, see comments about the adc mux in 
+// definitions.h. For each select line, the gpio module and bit, and
+// for each gpio module the bits of all select lines in it.
+unsigned int mux_select_count;
+unsigned int mux_select_module[ADC_MUX_MAX_PINS];
+unsigned int mux_select_bit[ADC_MUX_MAX_PINS];
+unsigned int mux_select_mask[4];
+
+void init_mux(){
+   unsigned int pins = shared_ram[ADC_MUX_SELECT];
+   unsigned int i, gpio_number;
+
+   mux_select_count = (shared_ram[ADC_MUX] & ADC_MUX_PINS_MASK) >> ADC_MUX_PINS_SHIFT;
+   if(mux_select_count > ADC_MUX_MAX_PINS){
+      mux_select_count = ADC_MUX_MAX_PINS;
+   }
+   for(i=0; i<4; i++){
+      mux_select_mask[i] = 0;
+   }
+   for(i=0; i<mux_select_count; i++){
+      gpio_number = (pins >> (8*i)) & 0x7F;
+      mux_select_module[i] = gpio_number >> 5; // integer division by 32
+      mux_select_bit[i] = 1 << (gpio_number % 32);
+      mux_select_mask[mux_select_module[i]] |= mux_select_bit[i];
+   }
+}
+
+inline void set_mux_control(unsigned int ctl){
+   // Bit n of ctl goes to select line n. Pins are set and cleared with
+   // the set and clear registers, two writes per gpio module in use 
+   // instead of a read-modify-write per pin.
+   unsigned int set[4] = {0, 0, 0, 0};
+   unsigned int i, module;
+   for(i=0; i<mux_select_count; i++){
+      if(ctl & (1<<i)){
+         set[mux_select_module[i]] |= mux_select_bit[i];
+      }
+   }
+   for(module=0; module<4; module++){
+      if(mux_select_mask[module]){
+         char *address = get_gpio_module_address(module);
+         HWREG(address + GPIO_SETDATAOUT) = set[module];
+         HWREG(address + GPIO_CLEARDATAOUT) = mux_select_mask[module] & ~set[module];
+      }
+   }
+}
+
 /////////////////////////////////////////////////////////////////////
 // TIMER
 //
+
+// Length of a frame (one iteration of the main loop) in IEP counts.
+// The IEP counter increments 5 every 5ns, so this is in nanoseconds. 
+// A new period requested by the ARM code is applied when the current
+// frame ends.
+unsigned int frame_period;
+unsigned int next_frame_period;
+
 void init_iep_timer(){
-   // We'll count 83.333 micro seconds with compare0 register and 45uSec
-   // with compare1 register.
+   // We'll count 83.333 micro seconds (default frame period) with 
+   // compare0 register and 45uSec with compare1 register.
    // clock is 200MHz, use increment value of 5, 
    // compare values are then 83333 and 45000
+   frame_period = FRAME_PERIOD_DEFAULT;
+   next_frame_period = FRAME_PERIOD_DEFAULT;
+   shared_ram[FRAME_PERIOD] = frame_period;
 
    // 1. Initialize timer to known state
    // 1.1 Disable timer counter
@@ -198,7 +394,7 @@ void init_iep_timer(){
 
 
    // 2. Set compare values 
-   HWREG(IEP + IEP_TMR_CMP0) = 83333; 
+   HWREG(IEP + IEP_TMR_CMP0) = frame_period; 
    // 2.1 Compare register 1 to 45000
    /* HWREG(IEP + IEP_TMR_CMP1) = 45000; // Used when debugging timing */ 
 
@@ -218,13 +414,44 @@ void init_iep_timer(){
 }
 
 inline void wait_for_timer(){
-   // Wait for compare 0 status to go high
+   // Compare event already happened, this frame took too long.
+   if(HWREG(IEP+IEP_TMR_CMP_STS) & 1){
+      shared_ram[TIMING_OVERRUNS] += 1;
+   }
+
+   // Wait for compare 0 status to go high. Pwm outputs are updated and
+   // velocity keys are read over and over in the meantime. The counter
+   // is read before the status, so the time is from before the counter
+   // resets.
+   unsigned int now = current_time();
    while((HWREG(IEP+IEP_TMR_CMP_STS) & 1) == 0){
-      // nothing 
+      update_pwm_outputs(now);
+      poll_velocity_keys(now);
+      now = current_time();
    }
 
    // Clear compare 0 status (write 1)
-   HWREG(IEP+IEP_TMR_CMP_STS) |= 1;
+   HWREG(IEP+IEP_TMR_CMP_STS) = 1;
+
+   // Counter was reset, a new frame starts.
+   time_base += frame_period;
+
+   // Counter is still close to 0, safe to move the compare value.
+   if(next_frame_period != frame_period){
+      frame_period = next_frame_period;
+      HWREG(IEP + IEP_TMR_CMP0) = frame_period; 
+   }
+}
+
+inline void set_frame_period(unsigned int period){
+   // Whether the loop fits in the new period is not checked, it depends
+   // on the channels added later too. Frames that don't fit are counted
+   // as overruns.
+   if(period < FRAME_PERIOD_MIN || period > FRAME_PERIOD_MAX){
+      return;
+   }
+   next_frame_period = period;
+   shared_ram[FRAME_PERIOD] = period;
 }
 
 inline void wait_for_short_timer(){
@@ -234,12 +461,102 @@ inline void wait_for_short_timer(){
    }
 
    // Clear compare 1 status (write 1)
-   HWREG(IEP+IEP_TMR_CMP_STS) |= (1<<1);
+   HWREG(IEP+IEP_TMR_CMP_STS) = (1<<1);
+}
+
+/////////////////////////////////////////////////////////////////////
+// TIMING STATS
+//
+
+// Read the comments in definitions.h
+
+unsigned int phase_start;
+
+// 16 times the running average of each phase
+unsigned int phase_averages[TIMING_PHASES];
+
+void reset_timing(){
+   int i;
+   for(i=0; i<TIMING_PHASES; i++){
+      shared_ram[TIMING_STATS + 3*i] = 0xFFFFFFFF;
+      shared_ram[TIMING_STATS + 3*i + 1] = 0;
+      shared_ram[TIMING_STATS + 3*i + 2] = 0;
+      phase_averages[i] = 0;
+   }
+   shared_ram[TIMING_OVERRUNS] = 0;
+}
+
+inline void start_cycle_counter(){
+   // Cycle counter stops at 0xFFFFFFFF, restart it every frame. It
+   // can only be written while disabled.
+   HWREG(PRU0_CTRL + PRU_CTRL_CONTROL) &= ~(1<<3);
+   HWREG(PRU0_CTRL + PRU_CTRL_CYCLE) = 0;
+   HWREG(PRU0_CTRL + PRU_CTRL_CONTROL) |= (1<<3);
+   phase_start = 0;
+}
+
+inline void update_timing(unsigned int phase, unsigned int cycles){
+   volatile unsigned int *stats = &(shared_ram[TIMING_STATS + 3*phase]);
+   if(cycles < stats[0]){
+      stats[0] = cycles;
+   }
+   if(cycles > stats[2]){
+      stats[2] = cycles;
+   }
+   phase_averages[phase] += cycles - (phase_averages[phase] >> 4);
+   stats[1] = phase_averages[phase] >> 4;
+}
+
+inline void end_phase(unsigned int phase){
+   unsigned int now = HWREG(PRU0_CTRL + PRU_CTRL_CYCLE);
+   update_timing(phase, now - phase_start);
+   phase_start = now;
+}
+
+inline void end_frame(){
+   update_timing(TIMING_PHASE_FRAME, HWREG(PRU0_CTRL + PRU_CTRL_CYCLE));
 }
 
 /////////////////////////////////////////////////////////////////////
 // Analog Digital Conversion
 //
+
+// Step n+1 reads AINn, n is 0 to 6, and tags its samples with n. An 
+// input with a mux is read again for every mux input. Channels are 
+// numbered from AIN0 up: one for an input without a mux, one for each 
+// mux input for an input with a mux. See comments about the adc mux in
+// definitions.h. Only the steps of channels in use are enabled, see
+// update_adc_steps().
+unsigned int adc_step_mask;
+unsigned int adc_step_count;
+
+unsigned int adc_mux_ains; // one bit per input with a mux
+unsigned int adc_mux_size; // inputs per mux
+unsigned int adc_mux_step_mask;
+unsigned int adc_channel_base[ADC_AINS]; // first channel of each input
+unsigned int adc_channel_count;
+
+// Counters for the mux input and for averaging channels without a mux
+// over 8 frames. 
+unsigned int mux_control;
+unsigned int average_counter;
+
+// Mux input that was selected when each sequence still in the fifo was
+// started, oldest first. Samples are usually read a frame after they 
+// were started, when the mux has moved on.
+unsigned int sequence_mux[4];
+unsigned int sequence_start;
+unsigned int sequence_end;
+
+// Read the comments about adc options in definitions.h
+unsigned int adc_averaging;
+unsigned int adc_continuous;
+unsigned int adc_threshold;
+
+#define ADC_IRQ_END_OF_SEQUENCE (1<<1)
+#define ADC_IRQ_FIFO0_THRESHOLD (1<<2)
+#define ADC_IRQ_FIFO0_OVERRUN (1<<3)
+
 inline void wait_for_adc(){
    // Wait for irqstatus[1] to go high
    while((HWREG(ADC_TSC + ADC_TSC_IRQSTATUS) & (1<<1)) == 0){
@@ -247,13 +564,20 @@ inline void wait_for_adc(){
    }
 
    // Clear status (write 1)
-   HWREG(ADC_TSC + ADC_TSC_IRQSTATUS) |= (1<<1);
+   HWREG(ADC_TSC + ADC_TSC_IRQSTATUS) = (1<<1);
 }
 
 inline void adc_start_sampling(){
-   // Enable steps 1 to 7
-   HWREG(ADC_TSC + ADC_TSC_STEPENABLE) = 0xfe;
-   /* HWREG(ADC_TSC + ADC_TSC_STEPENABLE) = 0b111110; // 1 to 5 */
+   // Continuous mode steps stay enabled, see update_adc_steps().
+   if(adc_step_mask && !adc_continuous){
+      HWREG(ADC_TSC + ADC_TSC_STEPENABLE) = adc_step_mask;
+
+      if(sequence_end - sequence_start == 4){
+         sequence_start++; // never read, fifo was cleared
+      }
+      sequence_mux[sequence_end & 3] = mux_control;
+      sequence_end++;
+   }
 }
 
 void init_adc(){
@@ -268,11 +592,54 @@ void init_adc(){
    // We want 48KHz. (Compromising to 50KHz)
    unsigned int clock_divider = 1;
    unsigned int open_delay = 0;
-   unsigned int average = 0;       // can be 0 (no average), 1 (2 samples), 
-                                   // 2 (4 samples),  3 (8 samples) 
-                                   // or 4 (16 samples)
    unsigned int sample_delay = 0;
 
+   // Averaging and mode are set by the ARM code.
+   unsigned int options = shared_ram[ADC_OPTIONS];
+   adc_averaging = options & ADC_OPTIONS_AVERAGING_MASK;
+   if(adc_averaging > ADC_AVERAGING_MAX){
+      adc_averaging = ADC_AVERAGING_MAX;
+   }
+   adc_continuous = ((options & ADC_OPTIONS_CONTINUOUS) != 0);
+   adc_threshold = (options & ADC_OPTIONS_THRESHOLD_MASK) >> ADC_OPTIONS_THRESHOLD_SHIFT;
+   if(adc_threshold < 1){
+      adc_threshold = 1;
+   }
+   if(adc_threshold > ADC_THRESHOLD_MAX){
+      adc_threshold = ADC_THRESHOLD_MAX;
+   }
+
+   // Mux topology is set by the ARM code too.
+   unsigned int ain, count = 0;
+   adc_mux_ains = 0;
+   if(mux_select_count > 0){
+      adc_mux_ains = shared_ram[ADC_MUX] & ADC_MUX_AINS_MASK;
+   }
+   adc_mux_size = 1 << mux_select_count;
+   adc_mux_step_mask = adc_mux_ains << 1;
+   for(ain=0; ain<ADC_AINS; ain++){
+      adc_channel_base[ain] = count;
+      count += (adc_mux_ains & (1<<ain)) ? adc_mux_size : 1;
+   }
+   if(count > BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS){
+      count = BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS;
+   }
+   adc_channel_count = count;
+   mux_control = adc_mux_size - 1;
+   average_counter = 7;
+   sequence_start = 0;
+   sequence_end = 0;
+
+   // Mux outputs need time to settle after the select lines change, 
+   // the adc waits that long (open delay) before sampling them.
+   unsigned int mux_open_delay = shared_ram[ADC_MUX_SETTLE] & 0x3ffff;
+
+   unsigned int average = adc_averaging; // can be 0 (no average), 
+                                         // 1 (2 samples), 2 (4 samples), 
+                                         // 3 (8 samples) or 4 (16 samples)
+   unsigned int mode = adc_continuous;   // 0 (sw one shot) or
+                                         // 1 (sw continuous)
+
    // Set clock divider (set register to desired value minus one). 
    HWREG(ADC_TSC + ADC_TSC_CLKDIV) = clock_divider - 1;
 
@@ -285,66 +652,51 @@ void init_adc(){
    // Unlock step config register.
    HWREG(ADC_TSC + ADC_TSC_CTRL) |= (1 << 2);
 
-   // Set config and delays for step 1: 
-   // Sw mode, one shot mode, fifo0, channel 0.
-   HWREG(ADC_TSC + ADC_TSC_STEPCONFIG1) = 0 | (0<<26) | (0<<19) | (0<<15) | (average<<2) | (0);
-   HWREG(ADC_TSC + ADC_TSC_STEPDELAY1)  = 0 | (sample_delay - 1)<<24 | open_delay;
-
-   // Set config and delays for step 2: 
-   // Sw mode, one shot mode, fifo0, channel 1.
-   HWREG(ADC_TSC + ADC_TSC_STEPCONFIG2) = 0 | (0x0<<26) | (0x01<<19) | (0x01<<15) | (average<<2) | (0x00);
-   HWREG(ADC_TSC + ADC_TSC_STEPDELAY2)  = 0 | (sample_delay - 1)<<24 | open_delay;
-
-   // Set config and delays for step 3: 
-   // Sw mode, one shot mode, fifo0, channel 2.
-   HWREG(ADC_TSC + ADC_TSC_STEPCONFIG3) = 0 | (0x0<<26) | (0x02<<19) | (0x02<<15) | (average<<2) | (0x00);
-   HWREG(ADC_TSC + ADC_TSC_STEPDELAY3)  = 0 | ((sample_delay - 1)<<24) | open_delay;
-
-   // Set config and delays for step 4: 
-   // Sw mode, one shot mode, fifo0, channel 3.
-   HWREG(ADC_TSC + ADC_TSC_STEPCONFIG4) = 0 | (0x0<<26) | (0x03<<19) | (0x03<<15) | (average<<2) | (0x00);
-   HWREG(ADC_TSC + ADC_TSC_STEPDELAY4)  = 0 | ((sample_delay - 1)<<24) | open_delay;
-
-   // Set config and delays for step 5: 
-   // Sw mode, one shot mode, fifo0, channel 4.
-   HWREG(ADC_TSC + ADC_TSC_STEPCONFIG5) = 0 | (0x0<<26) | (0x04<<19) | (0x04<<15) | (average<<2) | (0x00);
-   HWREG(ADC_TSC + ADC_TSC_STEPDELAY5)  = 0 | ((sample_delay - 1)<<24) | open_delay;
-
-   // Set config and delays for step 6: 
-   // Sw mode, one shot mode, fifo0, CHANNEL 6!
-   HWREG(ADC_TSC + ADC_TSC_STEPCONFIG6) = 0 | (0x0<<26) | (0x06<<19) | (0x06<<15) | (average<<2) | (0x00);
-   HWREG(ADC_TSC + ADC_TSC_STEPDELAY6)  = 0 | ((sample_delay - 1)<<24) | open_delay;
-
-   // Set config and delays for step 7: 
-   // Sw mode, one shot mode, fifo0, CHANNEL 5!
-   HWREG(ADC_TSC + ADC_TSC_STEPCONFIG7) = 0 | (0x0<<26) | (0x05<<19) | (0x05<<15) | (average<<2) | (0x00);
-   HWREG(ADC_TSC + ADC_TSC_STEPDELAY7)  = 0 | ((sample_delay - 1)<<24) | open_delay;
+   // Set config and delays for steps 1 to 7: 
+   // Sw mode, one shot or continuous mode, fifo0, channel AIN0 to AIN6.
+   for(ain=0; ain<ADC_AINS; ain++){
+      HWREG(ADC_TSC + ADC_TSC_STEPCONFIG1 + 8*ain) = 0 | (0x0<<26) | (ain<<19) | (ain<<15) | (average<<2) | mode;
+      if(adc_mux_ains & (1<<ain)){
+         HWREG(ADC_TSC + ADC_TSC_STEPDELAY1 + 8*ain) = 0 | ((sample_delay - 1)<<24) | mux_open_delay;
+      }
+      else{
+         HWREG(ADC_TSC + ADC_TSC_STEPDELAY1 + 8*ain) = 0 | ((sample_delay - 1)<<24) | open_delay;
+      }
+   }
 
    // Enable tag channel id. Samples in fifo will have channel id bits ADC_CTRL register
    HWREG(ADC_TSC + ADC_TSC_CTRL) |= (1 << 1);
 
-   // Clear End_of_sequence interrupt
-   HWREG(ADC_TSC + ADC_TSC_IRQSTATUS) |= (1<<1);
+   // Clear End_of_sequence and fifo0 interrupts
+   HWREG(ADC_TSC + ADC_TSC_IRQSTATUS) = ADC_IRQ_END_OF_SEQUENCE | ADC_IRQ_FIFO0_THRESHOLD | ADC_IRQ_FIFO0_OVERRUN;
 
    // Enable End_of_sequence interrupt
-   HWREG(ADC_TSC + ADC_TSC_IRQENABLE_SET) |= (1 << 1);
+   HWREG(ADC_TSC + ADC_TSC_IRQENABLE_SET) |= ADC_IRQ_END_OF_SEQUENCE;
+
+   // Fifo0 threshold interrupt tells when to read in continuous mode. 
+   // Threshold is set in update_adc_steps().
+   if(adc_continuous){
+      HWREG(ADC_TSC + ADC_TSC_IRQENABLE_SET) = ADC_IRQ_FIFO0_THRESHOLD;
+   }
+   else{
+      HWREG(ADC_TSC + ADC_TSC_IRQENABLE_CLR) = ADC_IRQ_FIFO0_THRESHOLD;
+   }
    
    // Lock step config register. ACD_CTRL register
    HWREG(ADC_TSC + ADC_TSC_CTRL) &= ~(1 << 2);
    
    // Clear FIFO0 by reading from it.
-   unsigned int count = HWREG(ADC_TSC + ADC_TSC_FIFO0COUNT);
-   unsigned int data, i;
+   count = HWREG(ADC_TSC + ADC_TSC_FIFO0COUNT);
+   unsigned int i;
    for(i=0; i<count; i++){
-      data = HWREG(ADC_TSC + ADC_TSC_FIFO0DATA);
+      (void)HWREG(ADC_TSC + ADC_TSC_FIFO0DATA);
    }
 
    // Clear FIFO1 by reading from it.
    count = HWREG(ADC_TSC + ADC_TSC_FIFO1COUNT);
    for(i=0; i<count; i++){
-      data = HWREG(ADC_TSC + ADC_TSC_FIFO1DATA);
+      (void)HWREG(ADC_TSC + ADC_TSC_FIFO1DATA);
    }
-   shared_ram[500] = data; // just remove unused value warning;
 
    // Enable ADC Module. ADC_CTRL register
    HWREG(ADC_TSC + ADC_TSC_CTRL) |= 1;
@@ -355,11 +707,22 @@ void init_adc(){
 //
 
 // See comments for adc config in definitions.h
+// Fields are as small as their values allow, there is room for little
+// more than 8KB of variables on the PRU.
 typedef struct adc_channel{
-   int mode; 
+   unsigned char mode; 
    
+   unsigned char direct; // on an input without a mux, read every frame
    unsigned int value; 
-   unsigned int past_values[8]; 
+   unsigned short past_values[8]; 
+   unsigned char past_samples; // real samples in past_values, up to 8
+   unsigned short reference; // 12 bit value the last message came from
+   unsigned int sum; // oversampling mode
+
+   unsigned char filter;
+   unsigned char filter_samples; // samples filtered so far, up to 2
+   unsigned short median_history[2];
+   int smoothed; // 12 bit value with 8 more bits of precision
 
    unsigned char parameter1;
    unsigned char parameter2;
@@ -368,7 +731,8 @@ typedef struct adc_channel{
 
 adc_channel adc_channels[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
 
-unsigned int mux_control;
+// Channel value before the first one is sent.
+#define ADC_NO_VALUE 0xFFFFFFFF
 
 inline void process_adc_value_with_ranges(unsigned int channel_number, unsigned int value){
    adc_channel* channel = &(adc_channels[channel_number]);
@@ -406,8 +770,8 @@ inline void process_adc_value_with_ranges(unsigned int channel_number, unsigned
             right_bound = (current_range+1)*increment + delta;
          }
 
-         message = ((unsigned int)1<<31) | (current_range<<4) | (channel_number);
-         buffer_write(&message);
+         message = ADC_MESSAGE(channel_number, current_range);
+         buffer_write_adc(channel_number, &message);
 
          channel->past_values[2] = left_bound;
          channel->past_values[1] = right_bound;
@@ -417,6 +781,73 @@ inline void process_adc_value_with_ranges(unsigned int channel_number, unsigned
    }
 }
 
+inline void process_adc_value_with_deadband(unsigned int channel_number, unsigned int value){
+   unsigned int i;
+   unsigned int message;
+
+   adc_channel* channel = &(adc_channels[channel_number]);
+
+   unsigned int bits = channel->parameter1;
+   unsigned int deadband = channel->parameter2;
+
+   // Channels without a mux are averaged as in normal mode, but with all
+   // 12 bits, the deadband is compared before truncating. The reference
+   // is only taken from an average of 8 real samples.
+   if(channel->direct && adc_averaging == 0){
+      channel->past_values[average_counter] = value;
+      if(channel->past_samples < 8){
+         channel->past_samples++;
+      }
+      if(average_counter != 7 || channel->past_samples != 8){
+         return;
+      }
+      value = 0;
+      for(i=0; i<8; i++) {
+         value += channel->past_values[i];
+      }
+      value = value >> 3;  // Integer division by 8.
+   }
+
+   // Ignore the input until it moves more than deadband away from the 
+   // value last sent. An input sitting on the boundary between two 
+   // values doesn't flip back and forth.
+   if(channel->value != ADC_NO_VALUE && value + deadband >= channel->reference && value <= channel->reference + deadband){
+      return;
+   }
+   channel->reference = value;
+
+   value = value >> (12 - bits); // Truncate to n bits
+   if(channel->value != value){
+      channel->value = value;
+      message = ADC_MESSAGE(channel_number, value);
+      buffer_write_adc(channel_number, &message);
+   }
+}
+
+inline void process_adc_value_with_oversampling(unsigned int channel_number, unsigned int value){
+   adc_channel* channel = &(adc_channels[channel_number]);
+   unsigned int extra_bits = channel->parameter1 - 12;
+   unsigned int message;
+
+   // Reuse past_values[0] for the number of samples, it is not in use.
+   channel->sum += value;
+   channel->past_values[0]++;
+
+   // 4^n samples for n extra bits.
+   if(channel->past_values[0] < (1 << (2*extra_bits))){
+      return;
+   }
+   value = channel->sum >> extra_bits;
+   channel->sum = 0;
+   channel->past_values[0] = 0;
+
+   if(channel->value != value){
+      channel->value = value;
+      message = ADC_MESSAGE(channel_number, value);
+      buffer_write_adc(channel_number, &message);
+   }
+}
+
 inline void process_adc_value(unsigned int channel_number, unsigned int value){
    unsigned int i, average;
    unsigned int message;
@@ -426,12 +857,16 @@ inline void process_adc_value(unsigned int channel_number, unsigned int value){
    unsigned int bits = channel->parameter1;
    value = value >> (12 - bits); // Truncate to n bits
 
-   // Channels 0 to 5 are sampled 8 times faster than channels 6 to 13.
-   // Calculate 8 times average. mux_control counter is re-used to count 
-   // the 8 samples.
-   if(channel_number < 6){
-      channel->past_values[mux_control] = value;
-      if(mux_control==7){
+   // Channels without a mux are sampled every frame, 8 times or more 
+   // as often as channels behind a mux. Calculate 8 times average. Not
+   // needed if the adc already averages. A channel added between two
+   // averages waits until all 8 samples are its own.
+   if(channel->direct && adc_averaging == 0){
+      channel->past_values[average_counter] = value;
+      if(channel->past_samples < 8){
+         channel->past_samples++;
+      }
+      if(average_counter==7 && channel->past_samples==8){
          average = 0;
          for(i=0; i<8; i++) {
             average += channel->past_values[i];
@@ -442,67 +877,213 @@ inline void process_adc_value(unsigned int channel_number, unsigned int value){
          // in ring buffer section below
          if(channel->value != average){
             channel->value = average;
-            message = ((unsigned int)1<<31) | (average<<4) | (channel_number);
-            buffer_write(&message);
+            message = ADC_MESSAGE(channel_number, average);
+            buffer_write_adc(channel_number, &message);
          }
       }
    }
-   else{ // channels 6 to 13
+   else{ // channels behind a mux, or averaged by the adc
       // Send the value to ARM. See message format in comments 
       // in ring buffer section below
       if(channel->value != value){
          channel->value = value;
-         message = ((unsigned int)1<<31) | (value<<4) | (channel_number);
-         buffer_write(&message);
+         message = ADC_MESSAGE(channel_number, value);
+         buffer_write_adc(channel_number, &message);
       }
    }
 }
 
-// Read available samples from fifo0 in blocks of seven, figure out
-// which channel they belong to (using step id and mux control) and
-// send them to process_adc_value (singular) functions.
-inline void process_adc_values(){
-   unsigned int data, i, step_id, value, channel_number;
-   unsigned int count = HWREG(ADC_TSC + ADC_TSC_FIFO0COUNT);
-   while(count > 6){
-      for(i=0; i<7; i++){
-         data = HWREG(ADC_TSC + ADC_TSC_FIFO0DATA);
-         step_id = (data & (0x000f0000)) >> 16;
-         value = (data & 0xfff);
-         if(step_id==5){ // The step with the mux, channel 6 on adc.
-            if(mux_control == 0)
-               channel_number = 13;
-            else
-               channel_number = 6+mux_control-1;
+// See comments about filters in definitions.h. Everything is integer 
+// math, the PRU has no floating point.
+inline unsigned int filter_adc_value(adc_channel* channel, unsigned int value){
+   unsigned int low, high;
+   unsigned int smoothing = channel->filter & ADC_FILTER_SMOOTHING_MASK;
+
+   if(channel->filter & ADC_FILTER_MEDIAN){
+      low = channel->median_history[0];
+      high = channel->median_history[1];
+      channel->median_history[0] = high;
+      channel->median_history[1] = value;
+
+      // Median of 3 is the new sample clamped between the other two.
+      if(channel->filter_samples == 2){
+         if(low > high){
+            unsigned int tmp = low;
+            low = high;
+            high = tmp;
          }
-         else if(step_id==6){ // Last step is actually channel 5
-            channel_number = 5;
+         if(value < low){
+            value = low;
          }
-         else{ // Other channels
-            channel_number = step_id;
+         else if(value > high){
+            value = high;
          }
+      }
+   }
 
-         int mode = adc_channels[channel_number].mode;
-         if(mode == 1){
-            process_adc_value(channel_number, value);
-         }
-         else if(mode == 2){
-            process_adc_value_with_ranges(channel_number, value);
-         }
+   if(smoothing){
+      if(channel->filter_samples == 0){
+         channel->smoothed = value << 8;
+      }
+      else{
+         channel->smoothed += ((int)(value << 8) - channel->smoothed) >> smoothing;
+      }
+      value = (channel->smoothed + 128) >> 8; // Round back to 12 bits
+   }
+
+   if(channel->filter_samples < 2){
+      channel->filter_samples++;
+   }
+   return value;
+}
+
+// Figure out which channel a sample belongs to (using step id, which
+// is the adc input, and the mux input selected when it was taken) and 
+// send it to process_adc_value (singular) functions.
+inline void process_adc_sample(unsigned int step_id, unsigned int value, unsigned int mux){
+   if(step_id >= ADC_AINS){
+      return;
+   }
+   unsigned int channel_number = adc_channel_base[step_id];
+   if(adc_mux_ains & (1 << step_id)){
+      channel_number += mux;
+   }
+   if(channel_number >= adc_channel_count){
+      return;
+   }
+
+   adc_channel* channel = &(adc_channels[channel_number]);
+   int mode = channel->mode;
+   if(mode != 0 && channel->filter != 0){
+      value = filter_adc_value(channel, value);
+   }
+
+   if(mode == 1){
+      process_adc_value(channel_number, value);
+   }
+   else if(mode == 2){
+      process_adc_value_with_ranges(channel_number, value);
+   }
+   else if(mode == 3){
+      process_adc_value_with_deadband(channel_number, value);
+   }
+   else if(mode == 4){
+      process_adc_value_with_oversampling(channel_number, value);
+   }
+}
+
+// Read available samples from fifo0 in blocks of one per enabled step.
+inline void process_adc_values(){
+   unsigned int data, i, mux;
+   if(adc_step_count == 0){
+      return;
+   }
+   unsigned int count = HWREG(ADC_TSC + ADC_TSC_FIFO0COUNT);
+   while(count >= adc_step_count){
+      mux = mux_control;
+      if(sequence_start != sequence_end){
+         mux = sequence_mux[sequence_start & 3];
+         sequence_start++;
+      }
+      for(i=0; i<adc_step_count; i++){
+         data = HWREG(ADC_TSC + ADC_TSC_FIFO0DATA);
+         process_adc_sample((data & (0x000f0000)) >> 16, data & 0xfff, mux);
       }
       count = HWREG(ADC_TSC + ADC_TSC_FIFO0COUNT);
    }
 }
 
+// Continuous mode: nothing to do until the fifo reaches the threshold.
+// Then read all of it and use only the latest sample of each step, 
+// older ones are stale by now. Returns 1 if the fifo was read.
+inline unsigned int process_adc_values_continuous(){
+   unsigned int data, step_id, count;
+   unsigned int latest[ADC_AINS];
+   unsigned int found = 0;
+
+   if((HWREG(ADC_TSC + ADC_TSC_IRQSTATUS) & ADC_IRQ_FIFO0_THRESHOLD) == 0){
+      return 0;
+   }
+
+   // Samples are matched to steps by their tag, not by their position, 
+   // so an overrun (PRU was too slow) does no harm.
+   count = HWREG(ADC_TSC + ADC_TSC_FIFO0COUNT);
+   while(count > 0){
+      data = HWREG(ADC_TSC + ADC_TSC_FIFO0DATA);
+      step_id = (data & (0x000f0000)) >> 16;
+      if(step_id < ADC_AINS){
+         latest[step_id] = data & 0xfff;
+         found |= (1 << step_id);
+      }
+      count--;
+   }
+
+   // Clear status (write 1)
+   HWREG(ADC_TSC + ADC_TSC_IRQSTATUS) = ADC_IRQ_FIFO0_THRESHOLD | ADC_IRQ_FIFO0_OVERRUN;
+
+   // The mux has not moved since the last read.
+   for(step_id=0; step_id<ADC_AINS; step_id++){
+      if(found & (1 << step_id)){
+         process_adc_sample(step_id, latest[step_id], mux_control);
+      }
+   }
+   return 1;
+}
+
+inline void next_mux_control(){
+   average_counter = (average_counter + 1) & 7;
+   mux_control = (mux_control + 1) & (adc_mux_size - 1);
+   if(adc_step_mask & adc_mux_step_mask){
+      set_mux_control(mux_control);
+   }
+}
+
+void update_adc_steps(){
+   // Build the step enable mask from the channels in use. Fewer steps 
+   // make the conversion and reading the fifo shorter.
+   unsigned int ain, channel_number, last, mask = 0, count = 0;
+   for(ain=0; ain<ADC_AINS; ain++){
+      channel_number = adc_channel_base[ain];
+      last = channel_number + ((adc_mux_ains & (1<<ain)) ? adc_mux_size : 1);
+      for(; channel_number<last && channel_number<adc_channel_count; channel_number++){
+         if(adc_channels[channel_number].mode != 0){
+            mask |= 1 << (ain+1);
+            count++;
+            break;
+         }
+      }
+   }
+   adc_step_mask = mask;
+   adc_step_count = count;
+
+   // Continuous mode steps are enabled once and the fifo threshold
+   // depends on how many there are. Fifo holds 64 samples.
+   if(adc_continuous){
+      count = count * adc_threshold;
+      if(count > 64){
+         count = 64;
+      }
+      if(count > 0){
+         HWREG(ADC_TSC + ADC_TSC_FIFO0THRESHOLD) = count - 1;
+      }
+      HWREG(ADC_TSC + ADC_TSC_STEPENABLE) = mask;
+   }
+}
+
 void init_adc_values(){
    int i;
 
    adc_channel new_channel;
    new_channel.mode = 0;
-   new_channel.value = 0xFFFF;
+   new_channel.direct = 0;
+   new_channel.value = ADC_NO_VALUE;
    for(i=0; i<8; i++) {
       new_channel.past_values[i] = 0xFFFF;
    }
+   new_channel.past_samples = 0;
+   new_channel.reference = 0;
+   new_channel.filter = 0;
+   new_channel.filter_samples = 0;
    new_channel.parameter1 = 0;
    new_channel.parameter2 = 0;
    new_channel.parameter3 = 0;
@@ -513,114 +1094,863 @@ void init_adc_values(){
    for(i=0; i<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; i++){
       adc_channels[i] = new_channel; 
    }
+   for(i=0; i<ADC_AINS; i++){
+      if((adc_mux_ains & (1<<i)) == 0 && adc_channel_base[i] < adc_channel_count){
+         adc_channels[adc_channel_base[i]].direct = 1;
+      }
+   }
+   update_adc_steps();
 }
 
-inline void init_adc_channels(){
+inline void set_adc_channel(unsigned int channel_number, unsigned int config){
    /**
-    * Checks if ARM code has requested input from new adc pins (channels)
-    * and adds them to the adc_channels array. See comments in 
-    * definitions.h
+    * Sets mode and parameters of an adc channel as requested by the ARM
+    * code. Mode 0 turns the channel off. See comments in definitions.h
     */
+   if(channel_number >= adc_channel_count){
+      return;
+   }
+   adc_channel* channel = &(adc_channels[channel_number]);
    int i;
-   unsigned int config = 0;
-   int mode = 0;
-   for(i=0; i<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; i++){
-      //not inited?
-      if(adc_channels[i].mode == 0){
-         config = shared_ram[ADC0_CONFIG+i];
-         mode = ((config >> 28) & 0xF);
-         if(mode != 0){
-            adc_channels[i].mode = mode;
-            adc_channels[i].parameter1 = config & 0xFF;
-            adc_channels[i].parameter2 = (config >> 8) & 0xFF;
-            adc_channels[i].parameter3 = (config >> 16) & 0xFF;
-         }
-         if(mode == 2){
-            adc_channels[i].past_values[2] = 0xFFFF; //left_bound
-            adc_channels[i].past_values[1] = 0; //right_bound
-            adc_channels[i].past_values[0] = 0xFFFF; //current_range
-         }
-      }
+
+   channel->mode = (config >> 28) & 0xF;
+   channel->parameter1 = config & 0xFF;
+   channel->parameter2 = (config >> 8) & 0xFF;
+   channel->parameter3 = (config >> 16) & 0xFF;
+   channel->filter = (config >> 24) & 0xF;
+
+   // Start over, so the first value with the new settings is sent.
+   channel->value = ADC_NO_VALUE;
+   for(i=0; i<8; i++) {
+      channel->past_values[i] = 0xFFFF;
+   }
+   channel->past_samples = 0;
+   channel->reference = 0;
+   channel->filter_samples = 0;
+   if(channel->mode == 2){
+      channel->past_values[2] = 0xFFFF; //left_bound
+      channel->past_values[1] = 0; //right_bound
+      channel->past_values[0] = 0xFFFF; //current_range
+   }
+   else if(channel->mode == 4){
+      channel->sum = 0;
+      channel->past_values[0] = 0; //count
+   }
+
+   // A pending value was computed with the old settings.
+   if(pending_adc[channel_number]){
+      pending_adc[channel_number] = 0;
+      pending_adc_count--;
    }
+
+   update_adc_steps();
 }
 
 /////////////////////////////////////////////////////////////////////
 // ANALYZE GPIO VALUES 
 //
 
-typedef struct gpio_channel{
-   int gpio_number; 
-   unsigned int value; 
-} gpio_channel;
-
-gpio_channel gpio_channels[BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS];
-int gpio_channel_count=0;
+// One bit per gpio input pin, one word per gpio module. Last values of
+// the inputs are in state_gpio. Pins that were just added send their
+// value on the next frame even if it did not change.
+unsigned int gpio_inputs[4];
+unsigned int gpio_new_inputs[4];
+
+// Pins read for encoders, key matrix columns and velocity keys (see 
+// below) and levels read this frame from every module in use.
+unsigned int encoder_pins[4];
+unsigned int matrix_column_pins[4];
+unsigned int velocity_key_pins[4];
+unsigned int gpio_levels[4];
+
+// Key matrix rows, the direction of these pins is set by the matrix 
+// scan only (see below).
+unsigned int matrix_row_pins[4];
+
+// Software debounce, see comments for the set gpio debounce command in 
+// definitions.h. A debounced pin's new level is only accepted after it
+// has been read the same for the debounce time. gpio_debounce_levels 
+// is the last level read of each debounced pin, gpio_debounce_start 
+// the time it was first read.
+unsigned int gpio_debounced[4];
+unsigned int gpio_debounce_levels[4];
+unsigned int gpio_debounce_time[4*32];
+unsigned int gpio_debounce_start[4*32];
+
+// Returns the bits of the debounced pins of a module that changed and
+// have been stable for long enough.
+inline unsigned int debounce_gpio_module(unsigned int module_number, unsigned int levels){
+   unsigned int debounced = gpio_debounced[module_number] & gpio_inputs[module_number];
+   unsigned int moved = (levels ^ gpio_debounce_levels[module_number]) & debounced;
+   unsigned int waiting = (levels ^ state_gpio[module_number]) & debounced;
+   unsigned int accepted = 0;
+   unsigned int pin, gpio_number, now;
+
+   gpio_debounce_levels[module_number] = levels;
+   if(waiting == 0){
+      return 0;
+   }
+   now = current_time();
+   for(pin=0; waiting!=0; pin++, waiting>>=1, moved>>=1){
+      if(waiting & 1){
+         gpio_number = module_number*32 + pin;
+         if(moved & 1){
+            gpio_debounce_start[gpio_number] = now;
+         }
+         else if(now - gpio_debounce_start[gpio_number] >= gpio_debounce_time[gpio_number]){
+            accepted |= 1 << pin;
+         }
+      }
+   }
+   return accepted;
+}
 
 inline void process_gpio_values(){
-   int i, module_number, pin;
-   unsigned int new_value, message;
-   char *module;
-   gpio_channel *channel;
-
-   for(i=0; i<gpio_channel_count; i++){
-      channel = &gpio_channels[i];
-      module_number = channel->gpio_number >> 5; // integer division by 32
-      pin = channel->gpio_number % 32;
-      module = get_gpio_module_address(module_number);
-      new_value = ((HWREG(module+GPIO_DATAIN)&(1<<pin)) != 0);
-
-      if(channel->value != new_value){
-         // See message format explanation in comments in ring buffer section
-         message = (0<<31) | (new_value<<8) | channel->gpio_number; 
-         buffer_write(&message);
+   unsigned int module_number, pin, levels, changed, message;
 
-         channel->value = new_value;
+   // One read of the data in register per module in use, the changed
+   // bits tell which pins need a message.
+   for(module_number=0; module_number<4; module_number++){
+      if((gpio_inputs[module_number] | encoder_pins[module_number] | matrix_column_pins[module_number] | velocity_key_pins[module_number]) == 0){
+         continue;
+      }
+      levels = HWREG(get_gpio_module_address(module_number) + GPIO_DATAIN);
+      gpio_levels[module_number] = levels;
+      if(gpio_inputs[module_number] == 0){
+         continue;
+      }
+      changed = (levels ^ state_gpio[module_number]) & gpio_inputs[module_number] & ~gpio_debounced[module_number];
+      if(gpio_debounced[module_number]){
+         changed |= debounce_gpio_module(module_number, levels);
+      }
+      changed |= gpio_new_inputs[module_number];
+      gpio_new_inputs[module_number] = 0;
+      if(changed == 0){
+         continue;
+      }
+      state_gpio[module_number] ^= (levels ^ state_gpio[module_number]) & changed;
+      state_changed = 1;
+
+      for(pin=0; changed!=0; pin++, changed>>=1){
+         if(changed & 1){
+            // See message format explanation in comments in ring buffer section
+            message = (0<<31) | (((levels>>pin) & 1)<<8) | (module_number*32 + pin); 
+            buffer_write_gpio(&message);
+         }
       }
    }
 }
 
 void init_gpio_values(){
-   gpio_channel_count = 0;
+   int i;
+   for(i=0; i<4; i++){
+      gpio_inputs[i] = 0;
+      gpio_new_inputs[i] = 0;
+      gpio_debounced[i] = 0;
+   }
 }
 
-inline void init_gpio_channel(int gpio_module, int bit){
-   int gpio_number = gpio_module*32 + bit;
+inline void add_gpio_channel(int gpio_number){
+   unsigned int module_number = gpio_number >> 5; // integer division by 32
+   unsigned int bit = 1 << (gpio_number % 32);
+   if(module_number >= 4){
+      return;
+   }
 
    // Check if channel is already initialized
+   if(gpio_inputs[module_number] & bit){
+      return;
+   }
+   gpio_inputs[module_number] |= bit;
+   gpio_new_inputs[module_number] |= bit;
+}
+
+inline void remove_gpio_channel(int gpio_number){
+   unsigned int module_number = gpio_number >> 5; // integer division by 32
+   unsigned int bit = 1 << (gpio_number % 32);
+   if(module_number >= 4 || (gpio_inputs[module_number] & bit) == 0){
+      return;
+   }
+   gpio_inputs[module_number] &= ~bit;
+   gpio_new_inputs[module_number] &= ~bit;
+   gpio_debounced[module_number] &= ~bit;
+   HWREG(get_gpio_module_address(module_number) + GPIO_DEBOUNCENABLE) &= ~bit;
+
+   state_gpio[module_number] &= ~bit;
+   state_changed = 1;
+}
+
+inline void set_gpio_direction(int gpio_number, unsigned int parameter){
+   // See comments for the command in definitions.h
+   unsigned int module_number = gpio_number >> 5; // integer division by 32
+   unsigned int bit = 1 << (gpio_number % 32);
+   if(module_number >= 4 || (matrix_row_pins[module_number] & bit)){
+      return;
+   }
+   char *address = get_gpio_module_address(module_number);
+   if(parameter == GPIO_DIRECTION_OUTPUT){
+      HWREG(address + GPIO_OE) &= ~bit;
+   }
+   else{
+      HWREG(address + GPIO_OE) |= bit;
+   }
+}
+
+inline void set_gpio_debounce(int gpio_number, unsigned int time){
+   unsigned int module_number = gpio_number >> 5; // integer division by 32
+   unsigned int bit = 1 << (gpio_number % 32);
+   if(module_number >= 4){
+      return;
+   }
+   if(time == 0){
+      gpio_debounced[module_number] &= ~bit;
+      return;
+   }
+   gpio_debounce_time[gpio_number] = time;
+   gpio_debounce_start[gpio_number] = current_time();
+   gpio_debounce_levels[module_number] = (gpio_debounce_levels[module_number] & ~bit) | (state_gpio[module_number] & bit);
+   gpio_debounced[module_number] |= bit;
+}
+
+inline void set_gpio_hardware_debounce(int gpio_number, unsigned int parameter){
+   // See comments for the command in definitions.h
+   unsigned int module_number = gpio_number >> 5; // integer division by 32
+   unsigned int bit = 1 << (gpio_number % 32);
+   if(module_number >= 4){
+      return;
+   }
+   char *module = get_gpio_module_address(module_number);
+   if(parameter & GPIO_HARDWARE_DEBOUNCE_ENABLE){
+      HWREG(module + GPIO_DEBOUNCINGTIME) = parameter & GPIO_HARDWARE_DEBOUNCE_TIME_MASK;
+      HWREG(module + GPIO_DEBOUNCENABLE) |= bit;
+   }
+   else{
+      HWREG(module + GPIO_DEBOUNCENABLE) &= ~bit;
+   }
+}
+
+/////////////////////////////////////////////////////////////////////
+// ENCODERS
+//
+
+// See comments for the set encoder command in definitions.h. Fields 
+// are small, there is little room for variables on the PRU.
+typedef struct encoder{
+   unsigned char gpio_number; // pin a, identifies the encoder
+   unsigned char gpio_number_b;
+   unsigned char state; // last levels, a is bit 1 and b is bit 0
+   unsigned char steps_shift; // 2^n quarter steps per count
+   unsigned char acceleration;
+   short steps; // quarter steps not sent yet
+   unsigned int last_time; // when the last message was sent
+} encoder;
+
+encoder encoders[BEAGLEBONE_PRUIO_MAX_ENCODERS];
+unsigned int encoder_count;
+
+#define ENCODER_STATE_UNKNOWN 0xFF
+
+// Quarter steps for each transition, indexed by old state * 4 + new 
+// state. A leads B when turning clockwise (positive). Both pins 
+// changing at once is a missed step, counts as no movement.
+const signed char quadrature_steps[16] = {
+   0, -1, 1, 0,
+   1, 0, 0, -1,
+   -1, 0, 0, 1,
+   0, 1, -1, 0
+};
+
+inline void process_encoders(){
+   unsigned int i, state, now, interval, message;
+   int counts;
+   encoder *e;
+
+   for(i=0; i<encoder_count; i++){
+      e = &encoders[i];
+      state = (((gpio_levels[e->gpio_number >> 5] >> (e->gpio_number % 32)) & 1) << 1) | 
+              ((gpio_levels[e->gpio_number_b >> 5] >> (e->gpio_number_b % 32)) & 1);
+      if(state == e->state){
+         continue;
+      }
+      if(e->state == ENCODER_STATE_UNKNOWN){
+         e->state = state;
+         continue;
+      }
+      e->steps += quadrature_steps[(e->state << 2) | state];
+      e->state = state;
+
+      // Whole counts, the rest waits for more steps in the same 
+      // direction.
+      if(e->steps >= 0){
+         counts = e->steps >> e->steps_shift;
+      }
+      else{
+         counts = -((-e->steps) >> e->steps_shift);
+      }
+      if(counts == 0){
+         continue;
+      }
+      e->steps -= counts * (1 << e->steps_shift);
+
+      // Turning fast multiplies counts, up to 1 + acceleration times.
+      if(e->acceleration){
+         now = current_time();
+         interval = now - e->last_time;
+         e->last_time = now;
+         if(interval < ENCODER_ACCELERATION_TIME){
+            counts *= 1 + ((e->acceleration * (ENCODER_ACCELERATION_TIME - interval)) >> ENCODER_ACCELERATION_TIME_SHIFT);
+         }
+      }
+
+      // See message format explanation in comments in ring buffer section
+      message = EVENT_MESSAGE(EVENT_ENCODER, counts, e->gpio_number);
+      buffer_write_gpio(&message);
+   }
+}
+
+void init_encoders(){
    int i;
-   for(i=0; i<gpio_channel_count; ++i){
-      if(gpio_channels[i].gpio_number == gpio_number){
-         return;      
+   for(i=0; i<4; i++){
+      encoder_pins[i] = 0;
+   }
+   encoder_count = 0;
+}
+
+inline void set_encoder(int gpio_number, unsigned int parameter){
+   unsigned int i;
+   unsigned int gpio_number_b = parameter & ENCODER_PIN_B_MASK;
+   if(gpio_number >= 4*32 || gpio_number_b >= 4*32){
+      return;
+   }
+
+   // Find the encoder, remove it.
+   for(i=0; i<encoder_count; i++){
+      if(encoders[i].gpio_number == gpio_number){
+         encoder_pins[gpio_number >> 5] &= ~(1 << (gpio_number % 32));
+         encoder_pins[encoders[i].gpio_number_b >> 5] &= ~(1 << (encoders[i].gpio_number_b % 32));
+         // Order doesn't matter, move the last one here.
+         encoder_count--;
+         encoders[i] = encoders[encoder_count];
+         break;
       }
    }
+   if(!(parameter & ENCODER_ENABLE) || encoder_count >= BEAGLEBONE_PRUIO_MAX_ENCODERS){
+      return;
+   }
 
-   // Add the new channel to the gpio_channels array
-   gpio_channel new_channel;
-   new_channel.value = 2;
-   new_channel.gpio_number = gpio_number;
-   gpio_channels[gpio_channel_count] = new_channel;
-   gpio_channel_count++;
+   encoder *e = &encoders[encoder_count];
+   e->gpio_number = gpio_number;
+   e->gpio_number_b = gpio_number_b;
+   e->state = ENCODER_STATE_UNKNOWN;
+   e->steps_shift = (parameter & ENCODER_STEPS_MASK) >> ENCODER_STEPS_SHIFT;
+   e->acceleration = (parameter & ENCODER_ACCELERATION_MASK) >> ENCODER_ACCELERATION_SHIFT;
+   e->steps = 0;
+   e->last_time = current_time();
+   encoder_count++;
+   encoder_pins[gpio_number >> 5] |= 1 << (gpio_number % 32);
+   encoder_pins[gpio_number_b >> 5] |= 1 << (gpio_number_b % 32);
 }
 
-inline void init_gpio_channels(){
-   /**
-    * Checks if ARM code has requested input from new gpio pins 
-    * (channels) and adds them to the gpio_channels array. See
-    * commens in definitions.h
-    */
-   int gpio_module;
-   for(gpio_module=0; gpio_module<4; ++gpio_module){
-      unsigned int config = shared_ram[GPIO0_CONFIG+gpio_module];
-      int bit;
-      for(bit=0; bit<32; ++bit){
-         // If bit is set
-         if((config&(1<<bit)) != 0){
-            init_gpio_channel(gpio_module, bit); 
+/////////////////////////////////////////////////////////////////////
+// KEY MATRIX
+//
+
+// See comments about the key matrix in definitions.h. Bit n of a row's
+// keys is column n, 1 is pressed.
+unsigned int matrix_row_count;
+unsigned int matrix_column_count;
+unsigned int matrix_debounce;
+unsigned int matrix_diodes;
+unsigned char matrix_row_module[BEAGLEBONE_PRUIO_MAX_MATRIX_ROWS];
+unsigned int matrix_row_bit[BEAGLEBONE_PRUIO_MAX_MATRIX_ROWS];
+unsigned char matrix_column_module[BEAGLEBONE_PRUIO_MAX_MATRIX_COLUMNS];
+unsigned char matrix_column_shift[BEAGLEBONE_PRUIO_MAX_MATRIX_COLUMNS];
+
+// Row being read, keys read last time for each row, scans they have
+// read the same and keys that were sent.
+unsigned int matrix_row;
+unsigned short matrix_read[BEAGLEBONE_PRUIO_MAX_MATRIX_ROWS];
+unsigned char matrix_stable[BEAGLEBONE_PRUIO_MAX_MATRIX_ROWS];
+unsigned short matrix_keys[BEAGLEBONE_PRUIO_MAX_MATRIX_ROWS];
+
+inline void select_matrix_row(unsigned int row){
+   // Output enable bit set is an input, the row floats. PRU0 is the 
+   // only writer of these registers while it runs, the ARM code sends
+   // direction changes for other pins as commands.
+   unsigned int module;
+   for(module=0; module<4; module++){
+      if(matrix_row_pins[module]){
+         char *address = get_gpio_module_address(module);
+         unsigned int selected = (module == matrix_row_module[row]) ? matrix_row_bit[row] : 0;
+         HWREG(address + GPIO_OE) = (HWREG(address + GPIO_OE) | matrix_row_pins[module]) & ~selected;
+      }
+   }
+}
+
+// A row with two or more keys pressed that shares a column with 
+// another row could be showing a ghost key.
+inline unsigned int matrix_row_is_ambiguous(unsigned int row, unsigned int keys){
+   unsigned int i;
+   if(matrix_diodes || (keys & (keys - 1)) == 0){
+      return 0;
+   }
+   for(i=0; i<matrix_row_count; i++){
+      if(i != row && (matrix_read[i] & keys)){
+         return 1;
+      }
+   }
+   return 0;
+}
+
+inline void process_matrix(){
+   unsigned int row = matrix_row;
+   unsigned int keys = 0;
+   unsigned int column, changed, message;
+
+   if(matrix_row_count == 0){
+      return;
+   }
+
+   // Columns of the row selected last frame, pressed keys read low.
+   for(column=0; column<matrix_column_count; column++){
+      keys |= ((~gpio_levels[matrix_column_module[column]] >> matrix_column_shift[column]) & 1) << column;
+   }
+   if(keys != matrix_read[row]){
+      matrix_read[row] = keys;
+      matrix_stable[row] = 0;
+   }
+   else if(matrix_stable[row] < matrix_debounce){
+      matrix_stable[row]++;
+   }
+
+   changed = keys ^ matrix_keys[row];
+   if(changed && matrix_stable[row] >= matrix_debounce && !matrix_row_is_ambiguous(row, keys)){
+      matrix_keys[row] = keys;
+      for(column=0; changed!=0; column++, changed>>=1){
+         if(changed & 1){
+            // See message format explanation in comments in ring buffer section
+            message = EVENT_MESSAGE(EVENT_MATRIX, (keys >> column) & 1, (row << 4) | column);
+            buffer_write_gpio(&message);
+         }
+      }
+   }
+
+   // Next row has until next frame to settle.
+   matrix_row = (row + 1 < matrix_row_count) ? row + 1 : 0;
+   select_matrix_row(matrix_row);
+}
+
+void init_matrix(){
+   unsigned int config = shared_ram[MATRIX];
+   unsigned int i, gpio_number;
+
+   matrix_row_count = config & MATRIX_ROWS_MASK;
+   matrix_column_count = (config & MATRIX_COLUMNS_MASK) >> MATRIX_COLUMNS_SHIFT;
+   if(matrix_row_count > BEAGLEBONE_PRUIO_MAX_MATRIX_ROWS){
+      matrix_row_count = BEAGLEBONE_PRUIO_MAX_MATRIX_ROWS;
+   }
+   if(matrix_column_count > BEAGLEBONE_PRUIO_MAX_MATRIX_COLUMNS){
+      matrix_column_count = BEAGLEBONE_PRUIO_MAX_MATRIX_COLUMNS;
+   }
+   if(matrix_column_count == 0){
+      matrix_row_count = 0;
+   }
+   matrix_debounce = (config & MATRIX_DEBOUNCE_MASK) >> MATRIX_DEBOUNCE_SHIFT;
+   matrix_diodes = config & MATRIX_DIODES;
+
+   for(i=0; i<4; i++){
+      matrix_row_pins[i] = 0;
+      matrix_column_pins[i] = 0;
+   }
+   for(i=0; i<matrix_row_count; i++){
+      gpio_number = (shared_ram[MATRIX_ROW_PINS + i/4] >> (8*(i%4))) & 0x7F;
+      matrix_row_module[i] = gpio_number >> 5; // integer division by 32
+      matrix_row_bit[i] = 1 << (gpio_number % 32);
+      matrix_row_pins[matrix_row_module[i]] |= matrix_row_bit[i];
+      matrix_read[i] = 0;
+      matrix_stable[i] = 0;
+      matrix_keys[i] = 0;
+   }
+   for(i=0; i<matrix_column_count && matrix_row_count; i++){
+      gpio_number = (shared_ram[MATRIX_COLUMN_PINS + i/4] >> (8*(i%4))) & 0x7F;
+      matrix_column_module[i] = gpio_number >> 5;
+      matrix_column_shift[i] = gpio_number % 32;
+      matrix_column_pins[matrix_column_module[i]] |= 1 << matrix_column_shift[i];
+   }
+
+   // Rows are only ever driven low.
+   for(i=0; i<4; i++){
+      if(matrix_row_pins[i]){
+         HWREG(get_gpio_module_address(i) + GPIO_CLEARDATAOUT) = matrix_row_pins[i];
+      }
+   }
+   matrix_row = 0;
+   if(matrix_row_count){
+      select_matrix_row(0);
+   }
+}
+
+void stop_matrix(){
+   // All rows back to inputs.
+   unsigned int i;
+   for(i=0; i<4; i++){
+      if(matrix_row_pins[i]){
+         HWREG(get_gpio_module_address(i) + GPIO_OE) |= matrix_row_pins[i];
+      }
+   }
+}
+
+/////////////////////////////////////////////////////////////////////
+// VELOCITY KEYS
+//
+
+// See comments for the set velocity key command in definitions.h. 
+// Contacts are sampled every frame and, between frames, every time 
+// the timer is polled, so their times are accurate to about a 
+// microsecond instead of a frame. Messages are only sent from the 
+// frame.
+typedef struct velocity_key{
+   unsigned char gpio_number; // first contact, identifies the key
+   unsigned char gpio_number_b; // second contact
+   unsigned char state;
+   unsigned short fastest; // 1024ns units, time for velocity 127
+   unsigned int first_time;
+   unsigned int second_time;
+} velocity_key;
+
+velocity_key velocity_keys[BEAGLEBONE_PRUIO_MAX_VELOCITY_KEYS];
+unsigned int velocity_key_count;
+
+#define VELOCITY_KEY_UP 0
+#define VELOCITY_KEY_FIRST 1 // first contact closed
+#define VELOCITY_KEY_SECOND 2 // both closed, note on not sent yet
+#define VELOCITY_KEY_DOWN 3 // note on sent
+#define VELOCITY_KEY_RELEASED 4 // first contact open, note off not sent yet
+
+// A closed contact pulls its pin low, like a button to ground.
+inline void sample_velocity_keys(unsigned int *levels, unsigned int now){
+   unsigned int i, first, second;
+   velocity_key *k;
+
+   for(i=0; i<velocity_key_count; i++){
+      k = &velocity_keys[i];
+      first = !((levels[k->gpio_number >> 5] >> (k->gpio_number % 32)) & 1);
+      switch(k->state){
+         case VELOCITY_KEY_UP:
+            if(first){
+               k->first_time = now;
+               k->state = VELOCITY_KEY_FIRST;
+            }
+            break;
+         case VELOCITY_KEY_FIRST:
+            second = !((levels[k->gpio_number_b >> 5] >> (k->gpio_number_b % 32)) & 1);
+            if(!first){
+               k->state = VELOCITY_KEY_UP;
+            }
+            else if(second){
+               k->second_time = now;
+               k->state = VELOCITY_KEY_SECOND;
+            }
+            break;
+         case VELOCITY_KEY_DOWN:
+            if(!first){
+               k->state = VELOCITY_KEY_RELEASED;
+            }
+            break;
+      }
+   }
+}
+
+inline void poll_velocity_keys(unsigned int now){
+   unsigned int levels[4];
+   unsigned int module_number;
+   if(velocity_key_count == 0){
+      return;
+   }
+   for(module_number=0; module_number<4; module_number++){
+      if(velocity_key_pins[module_number]){
+         levels[module_number] = HWREG(get_gpio_module_address(module_number) + GPIO_DATAIN);
+      }
+   }
+   sample_velocity_keys(levels, now);
+}
+
+inline void process_velocity_keys(){
+   unsigned int i, units, velocity, message;
+   velocity_key *k;
+
+   if(velocity_key_count == 0){
+      return;
+   }
+   sample_velocity_keys(gpio_levels, current_time());
+
+   for(i=0; i<velocity_key_count; i++){
+      k = &velocity_keys[i];
+      if(k->state == VELOCITY_KEY_SECOND){
+         // Velocity is inversely proportional to the time between 
+         // contacts, 127 at the fastest time or less, 1 at 127 times 
+         // that or more.
+         units = (k->second_time - k->first_time) >> 10;
+         velocity = 127;
+         if(units > k->fastest){
+            velocity = (127 * k->fastest) / units;
+            if(velocity == 0){
+               velocity = 1;
+            }
+         }
+         // See message format explanation in comments in ring buffer section
+         message = EVENT_MESSAGE(EVENT_VELOCITY_KEY, velocity, k->gpio_number);
+         buffer_write_gpio(&message);
+         k->state = VELOCITY_KEY_DOWN;
+      }
+      else if(k->state == VELOCITY_KEY_RELEASED){
+         message = EVENT_MESSAGE(EVENT_VELOCITY_KEY, 0, k->gpio_number);
+         buffer_write_gpio(&message);
+         k->state = VELOCITY_KEY_UP;
+      }
+   }
+}
+
+void init_velocity_keys(){
+   int i;
+   for(i=0; i<4; i++){
+      velocity_key_pins[i] = 0;
+   }
+   velocity_key_count = 0;
+}
+
+inline void set_velocity_key(int gpio_number, unsigned int parameter){
+   unsigned int i;
+   unsigned int gpio_number_b = parameter & VELOCITY_KEY_PIN_B_MASK;
+   if(gpio_number >= 4*32 || gpio_number_b >= 4*32){
+      return;
+   }
+
+   // Find the key, remove it.
+   for(i=0; i<velocity_key_count; i++){
+      if(velocity_keys[i].gpio_number == gpio_number){
+         velocity_key_pins[gpio_number >> 5] &= ~(1 << (gpio_number % 32));
+         velocity_key_pins[velocity_keys[i].gpio_number_b >> 5] &= ~(1 << (velocity_keys[i].gpio_number_b % 32));
+         // Order doesn't matter, move the last one here.
+         velocity_key_count--;
+         velocity_keys[i] = velocity_keys[velocity_key_count];
+         break;
+      }
+   }
+   if(!(parameter & VELOCITY_KEY_ENABLE) || velocity_key_count >= BEAGLEBONE_PRUIO_MAX_VELOCITY_KEYS){
+      return;
+   }
+
+   velocity_key *k = &velocity_keys[velocity_key_count];
+   k->gpio_number = gpio_number;
+   k->gpio_number_b = gpio_number_b;
+   k->state = VELOCITY_KEY_UP;
+   k->fastest = (parameter & VELOCITY_KEY_FASTEST_MASK) >> VELOCITY_KEY_FASTEST_SHIFT;
+   if(k->fastest == 0){
+      k->fastest = 1;
+   }
+   velocity_key_pins[gpio_number >> 5] |= 1 << (gpio_number % 32);
+   velocity_key_pins[gpio_number_b >> 5] |= 1 << (gpio_number_b % 32);
+   velocity_key_count++;
+}
+
+/////////////////////////////////////////////////////////////////////
+// PWM OUTPUTS
+//
+
+// See comments for the set pwm output command in definitions.h. One 
+// bit per slot in use. Period and duty in use are copied from shared
+// ram when each period starts. Edges are made while waiting for the 
+// timer and between phases of the frame, so they can be late by up to
+// the longest phase.
+typedef struct pwm_output{
+   unsigned char module_number;
+   unsigned char high;
+   unsigned int bit;
+   unsigned int period;
+   unsigned int duty;
+   unsigned int start; // time the current period started
+} pwm_output;
+
+pwm_output pwm_outputs[BEAGLEBONE_PRUIO_MAX_PWM_OUTPUTS];
+unsigned int pwm_slots;
+
+inline void update_pwm_outputs(unsigned int now){
+   // Pins are set and cleared with the set and clear registers, at most 
+   // two writes per gpio module.
+   unsigned int set[4] = {0, 0, 0, 0};
+   unsigned int clear[4] = {0, 0, 0, 0};
+   unsigned int slots = pwm_slots;
+   unsigned int i, module, elapsed;
+   pwm_output *p;
+
+   if(slots == 0){
+      return;
+   }
+   for(i=0; slots!=0; i++, slots>>=1){
+      if((slots & 1) == 0){
+         continue;
+      }
+      p = &pwm_outputs[i];
+      elapsed = now - p->start;
+      if(elapsed >= p->period){
+         // A late period starts now instead of trying to catch up.
+         p->start += p->period;
+         if(now - p->start >= p->period){
+            p->start = now;
+         }
+         elapsed = now - p->start;
+         p->period = shared_ram[PWM_OUTPUTS + 2*i];
+         p->duty = shared_ram[PWM_OUTPUTS + 2*i + 1];
+         if(p->period < PWM_PERIOD_MIN){
+            p->period = PWM_PERIOD_MIN;
          }
+         if(p->duty){
+            set[p->module_number] |= p->bit;
+            p->high = 1;
+         }
+      }
+      if(p->high && elapsed >= p->duty){
+         clear[p->module_number] |= p->bit;
+         p->high = 0;
+      }
+   }
+   for(module=0; module<4; module++){
+      if(set[module]){
+         HWREG(get_gpio_module_address(module) + GPIO_SETDATAOUT) = set[module];
+      }
+      if(clear[module]){
+         HWREG(get_gpio_module_address(module) + GPIO_CLEARDATAOUT) = clear[module];
       }
    }
 }
 
+void init_pwm_outputs(){
+   pwm_slots = 0;
+}
+
+// All pins low.
+void stop_pwm_outputs(){
+   unsigned int i;
+   for(i=0; i<BEAGLEBONE_PRUIO_MAX_PWM_OUTPUTS; i++){
+      if(pwm_slots & (1 << i)){
+         HWREG(get_gpio_module_address(pwm_outputs[i].module_number) + GPIO_CLEARDATAOUT) = pwm_outputs[i].bit;
+      }
+   }
+   pwm_slots = 0;
+}
+
+inline void set_pwm_output(int gpio_number, unsigned int parameter){
+   unsigned int slot = parameter & PWM_OUTPUT_SLOT_MASK;
+   if(gpio_number >= 4*32 || slot >= BEAGLEBONE_PRUIO_MAX_PWM_OUTPUTS){
+      return;
+   }
+   pwm_output *p = &pwm_outputs[slot];
+
+   // Slot in use, leave its pin low.
+   if(pwm_slots & (1 << slot)){
+      HWREG(get_gpio_module_address(p->module_number) + GPIO_CLEARDATAOUT) = p->bit;
+      pwm_slots &= ~(1 << slot);
+   }
+   if(!(parameter & PWM_OUTPUT_ENABLE)){
+      return;
+   }
+
+   // First period starts on the next update.
+   p->module_number = gpio_number >> 5; // integer division by 32
+   p->bit = 1 << (gpio_number % 32);
+   p->high = 0;
+   p->period = 0;
+   p->duty = 0;
+   p->start = current_time();
+   pwm_slots |= 1 << slot;
+}
+
+/////////////////////////////////////////////////////////////////////
+// COMMANDS
+//
+
+// Read the comments in definitions.h
+
+volatile unsigned int *command_data;
+volatile unsigned int *command_start;
+volatile unsigned int *command_end;
+
+void init_commands(){
+   // Pointers are inited by the ARM code, which might have sent 
+   // commands already.
+   command_data = &(shared_ram[COMMAND_BUFFER_DATA]);
+   command_start = &(shared_ram[COMMAND_BUFFER_START]);
+   command_end = &(shared_ram[COMMAND_BUFFER_END]);
+}
+
+// Returns 1 if the PRU has to stop.
+inline unsigned int process_commands(){
+   unsigned int position, command, parameter, number;
+   unsigned int stop = 0;
+
+   while(*command_start != *command_end){
+      position = *command_start & (COMMAND_BUFFER_SIZE-1);
+      command = command_data[position];
+      parameter = command_data[position+1];
+      number = command & 0xFF;
+
+      switch(command >> 24){
+         case COMMAND_ADD_GPIO_INPUT:
+            add_gpio_channel(number);
+            break;
+
+         case COMMAND_REMOVE_GPIO_INPUT:
+            remove_gpio_channel(number);
+            break;
+
+         case COMMAND_SET_ADC_CHANNEL:
+            set_adc_channel(number, parameter);
+            break;
+
+         case COMMAND_STOP:
+            stop = 1;
+            break;
+
+         case COMMAND_SET_FRAME_PERIOD:
+            set_frame_period(parameter);
+            break;
+
+         case COMMAND_RESET_TIMING:
+            reset_timing();
+            break;
+
+         case COMMAND_SET_GPIO_DEBOUNCE:
+            set_gpio_debounce(number, parameter);
+            break;
+
+         case COMMAND_SET_GPIO_HARDWARE_DEBOUNCE:
+            set_gpio_hardware_debounce(number, parameter);
+            break;
+
+         case COMMAND_SET_ENCODER:
+            set_encoder(number, parameter);
+            break;
+
+         case COMMAND_SET_VELOCITY_KEY:
+            set_velocity_key(number, parameter);
+            break;
+
+         case COMMAND_SET_PWM_OUTPUT:
+            set_pwm_output(number, parameter);
+            break;
+
+         case COMMAND_SET_GPIO_DIRECTION:
+            set_gpio_direction(number, parameter);
+            break;
+      }
+
+      // Increment buffer start, wrap around 2*size
+      *command_start = (*command_start + 2) & (2*COMMAND_BUFFER_SIZE - 1);
+   }
+   return stop;
+}
+
 /////////////////////////////////////////////////////////////////////
 // MAIN
 //
@@ -631,36 +1961,82 @@ void init_ocp(){
    HWREG(PRU_ICSS_CFG + PRU_ICSS_CFG_SYSCFG) &= ~(1 << 4);
 
    // Pointer to shared memory region
-   shared_ram = (volatile unsigned int *)0x10000;
+   shared_ram = &(HWREG(PRU_SHARED_RAM));
 }
 
-int main(int argc, const char *argv[]){
+void init_pru0(){
    init_ocp();
    init_buffer();
+   init_state();
+   init_mux();
    init_adc();
    init_adc_values();
    init_gpio();
+   set_mux_control(mux_control); // select lines match the first sample
    init_gpio_values();
+   init_encoders();
+   init_matrix();
+   init_velocity_keys();
+   init_pwm_outputs();
+   init_commands();
+   reset_timing();
    init_iep_timer();
+}
 
-   // Debug:
-   /* unsigned int i; */
+// One pass of the main loop, everything but waiting for the timer.
+// Returns 1 when the ARM code asked us to stop.
+inline unsigned int process_frame(){
+   unsigned int finished;
 
-   mux_control = 7;
+   start_cycle_counter();
 
-   unsigned int finished = 0;
+   buffer_flush_pending();
+   end_phase(TIMING_PHASE_BUFFER);
 
-   // TODO: exit condition
-   while(!finished){
-      mux_control>6 ? mux_control=0 : mux_control++;
-      set_mux_control(mux_control);
+   if(adc_continuous){
+      // Adc runs by itself, the mux moves on after each fifo read.
+      if(process_adc_values_continuous()){
+         next_mux_control();
+      }
+   }
+   else{
+      next_mux_control();
       adc_start_sampling();
-      
       process_adc_values();
-      process_gpio_values();
+   }
+   end_phase(TIMING_PHASE_ADC);
+   if(pwm_slots){
+      update_pwm_outputs(current_time());
+   }
+   process_gpio_values();
+   process_encoders();
+   process_matrix();
+   process_velocity_keys();
+   end_phase(TIMING_PHASE_GPIO);
+   if(pwm_slots){
+      update_pwm_outputs(current_time());
+   }
+   publish_state();
+   end_phase(TIMING_PHASE_STATE);
 
-      init_gpio_channels();
-      init_adc_channels();
+   finished = process_commands();
+   end_phase(TIMING_PHASE_COMMANDS);
+   end_frame();
+
+   return finished;
+}
+
+int main(int argc, const char *argv[]){
+   init_pru0();
+
+   // Debug:
+   /* unsigned int i; */
+
+   unsigned int finished = 0;
+   shared_ram[PRU_STATE] = PRU_STATE_RUNNING;
+
+   while(!finished){
+      finished = process_frame();
 
       // Debug:
       /* HWREG(GPIO0 + GPIO_DATAOUT) |= (1<<30); */
@@ -682,7 +2058,13 @@ int main(int argc, const char *argv[]){
       wait_for_timer(); // Timer resets itself after this
    }
 
+   // Leave the hardware quiet, ARM code might start us again later.
+   HWREG(ADC_TSC + ADC_TSC_STEPENABLE) = 0;
+   stop_pwm_outputs();
+   stop_matrix();
+   HWREG(IEP + IEP_TMR_GLB_CFG) &= ~(1); 
+   shared_ram[PRU_STATE] = PRU_STATE_HALTED;
+
    __halt();
    return 0;
 }
-
@@ -0,0 +1,39 @@
+/* Beaglebone Pru IO 
+ * 
+ * Copyright (C) 2015 Rafael Vega <rvega@elsoftwarehamuerto.org> 
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PRU0_SIMULATOR_H
+#define PRU0_SIMULATOR_H
+
+/**
+ * Included by pru0_main.c when it is built for the host with 
+ * -DBEAGLEBONE_PRUIO_SIMULATOR. Register accesses go to the simulated
+ * registers in beaglebone_pruio_simulator.c and main() becomes the 
+ * function run by the simulator's PRU0 thread. benchmark/pru0_benchmark.c
+ * uses the same hooks with mock registers to run single frames.
+ */
+
+volatile unsigned int* beaglebone_pruio_simulator_register(unsigned long address);
+extern volatile unsigned int beaglebone_pruio_simulator_r31;
+int beaglebone_pruio_simulator_pru0_main(int argc, const char *argv[]);
+
+#define HWREG(x) (*beaglebone_pruio_simulator_register((unsigned long)(x)))
+#define __R31 beaglebone_pruio_simulator_r31
+#define __halt()
+#define main beaglebone_pruio_simulator_pru0_main
+
+#endif //PRU0_SIMULATOR_H
@@ -94,18 +94,28 @@ static void *adc_input_new(t_symbol *s, int argc, t_atom *argv) {
    #endif
    int bits = 7;
    int ranges = 0;
-   if(argc == 3){ 
-      char* param1 = atom_getsymbol(argv+1)->s_name;
+   int deadband = 0;
+   int smoothing = 0;
+   int median = 0;
+   int i;
+   for(i=1; i+1<argc; i+=2){ 
+      char* param1 = atom_getsymbol(argv+i)->s_name;
       
       // 1.2 Parse number of bits
       if(strcmp(param1, "bits") == 0){
-         bits = atom_getfloat(argv+2);
+         bits = atom_getfloat(argv+i+1);
          if(bits<=0){
             bits = 7;
          }
-         if(bits>12){
-            bits = 12;
+         if(bits>16){
+            bits = 16;
          }
+         #ifdef IS_BEAGLEBONE
+            // More bits than the adc has, channels 0 to 5 only.
+            if(bits>12){
+               mode = BEAGLEBONE_PRUIO_ADC_MODE_OVERSAMPLING;
+            }
+         #endif
 
          // Debug
          /* error("Bits: %i", bits); */
@@ -113,7 +123,7 @@ static void *adc_input_new(t_symbol *s, int argc, t_atom *argv) {
 
       // 1.3 Parse number of ranges
       else if(strcmp(param1, "ranges") == 0){
-         ranges = atom_getfloat(argv+2);
+         ranges = atom_getfloat(argv+i+1);
          if(ranges<=0){
             ranges = 12;
          }
@@ -127,7 +137,37 @@ static void *adc_input_new(t_symbol *s, int argc, t_atom *argv) {
          // Debug
          /* error("Ranges: %i", ranges); */
       }
+
+      // 1.4 Parse deadband
+      else if(strcmp(param1, "deadband") == 0){
+         deadband = atom_getfloat(argv+i+1);
+         if(deadband<0){
+            deadband = 0;
+         }
+         if(deadband>255){
+            deadband = 255;
+         }
+      }
+
+      // 1.5 Parse filter
+      else if(strcmp(param1, "smoothing") == 0){
+         smoothing = atom_getfloat(argv+i+1);
+         if(smoothing<0){
+            smoothing = 0;
+         }
+         if(smoothing>7){
+            smoothing = 7;
+         }
+      }
+      else if(strcmp(param1, "median") == 0){
+         median = (atom_getfloat(argv+i+1) != 0);
+      }
    }
+   #ifdef IS_BEAGLEBONE
+      if(deadband>0 && mode==BEAGLEBONE_PRUIO_ADC_MODE_NORMAL){
+         mode = BEAGLEBONE_PRUIO_ADC_MODE_DEADBAND;
+      }
+   #endif
    
    // 2. Try to initialize the adc input
    #ifdef IS_BEAGLEBONE
@@ -139,6 +179,12 @@ static void *adc_input_new(t_symbol *s, int argc, t_atom *argv) {
          case BEAGLEBONE_PRUIO_ADC_MODE_RANGES:
             err = beaglebone_pruio_init_adc_pin_with_ranges((int)f, ranges);
             break;
+         case BEAGLEBONE_PRUIO_ADC_MODE_DEADBAND:
+            err = beaglebone_pruio_init_adc_pin_with_deadband((int)f, bits, deadband);
+            break;
+         case BEAGLEBONE_PRUIO_ADC_MODE_OVERSAMPLING:
+            err = beaglebone_pruio_init_adc_pin_with_oversampling((int)f, bits);
+            break;
          case BEAGLEBONE_PRUIO_ADC_MODE_OFF:
             //get rid of compiler warning
             break;
@@ -148,6 +194,13 @@ static void *adc_input_new(t_symbol *s, int argc, t_atom *argv) {
          error("beaglebone/adc_input: Could not init adc channel %s (%f), is it already in use?", atom_getsymbol(argv)->s_name, f);
          return NULL;
       }
+
+      if((smoothing || median) && beaglebone_pruio_set_adc_filter((int)f, smoothing, median)){
+         error("beaglebone/adc_input: Could not set filter for adc channel %s (%f)", atom_getsymbol(argv)->s_name, f);
+      }
+   #else
+      (void)smoothing;
+      (void)median;
    #endif 
 
    // 3. Create pd object instance
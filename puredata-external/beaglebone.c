@@ -54,17 +54,21 @@ void beaglebone_setup(void){
 
 // The main idea here is that instances of pd objects register themselves
 // to receive callbacks for their input of interest (analog or digital)
-// using the beaglebone_clock_new function. This adds a new entry to the
-// callbacks array. The callbacks array will be checked when a new 
+// using the beaglebone_register_callback function. This adds a new entry
+// to the callbacks array. The callbacks array will be checked when a new 
 // message from the PRU arrives and the callback will be triggered.
+//
+// On the Beaglebone, Pd's scheduler polls the library's event file
+// descriptor and calls beaglebone_fd_ready when the PRU has written 
+// new messages. Elsewhere a clock generates random values.
 
-#ifdef IS_BEAGLEBONE
-#define CLOCK_PERIOD 0.6666 // milliseconds
-#else
+#ifndef IS_BEAGLEBONE
 #define CLOCK_PERIOD 1000 // milliseconds
-/* #define CLOCK_PERIOD 0.6666 // milliseconds */
 #endif
 
+// How many messages are taken out of the PRU ring buffer at once.
+#define BEAGLEBONE_MESSAGES_PER_READ 64
+
 typedef struct callback{
    void(*callback_function)(void*, t_float);
    void* instance;
@@ -74,65 +78,91 @@ callback digital_callbacks[BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS];
 callback analog_callbacks[BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS];
 
 static int beaglebone_number_of_instances = 0;
-static t_clock* beaglebone_clock = NULL;
 
-void beaglebone_clock_tick(void* x){
+#ifdef IS_BEAGLEBONE
+static int beaglebone_event_fd = -1;
+
+void beaglebone_fd_ready(void* x, int fd){
    (void)x; // Do not use x, means nothing here, 
-            // we're passing null to the "owner" in clock_new
-   
+            // we're passing null to sys_addpollfn
+   (void)fd;
+
+   // Acknowledge the PRU event. 
+   if(beaglebone_pruio_wait(0) <= 0){
+      return;
+   }
+
    callback *cbk;
-   #ifdef IS_BEAGLEBONE
-      beaglebone_pruio_message message;
-      while(beaglebone_pruio_messages_are_available()){
-         beaglebone_pruio_read_message(&message);
+   beaglebone_pruio_message messages[BEAGLEBONE_MESSAGES_PER_READ];
+   beaglebone_pruio_message *message;
+   int count, i;
+   do{
+      count = beaglebone_pruio_read_messages(messages, BEAGLEBONE_MESSAGES_PER_READ);
+      for(i=0; i<count; ++i){
+         message = &messages[i];
 
          // Message from gpio
-         if(message.is_gpio){
-            cbk = &digital_callbacks[message.gpio_number];
+         if(message->is_gpio){
+            cbk = &digital_callbacks[message->gpio_number];
+
+            // Pin was released, messages sent before that can still arrive.
+            if(cbk->callback_function == NULL){
+               continue;
+            }
 
             // Debug
-            /* if(message.gpio_number >= BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS || cbk->instance == NULL || cbk->callback_function==NULL){ */
-            /*    printf("A! i:%p cbk:%p val:%i gpio_num:%i \n", cbk->instance, cbk->callback_function, message.value, message.gpio_number); */
-            /*    continue; //while */
+            /* if(message->gpio_number >= BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS || cbk->instance == NULL || cbk->callback_function==NULL){ */
+            /*    printf("A! i:%p cbk:%p val:%i gpio_num:%i \n", cbk->instance, cbk->callback_function, message->value, message->gpio_number); */
+            /*    continue; //for */
             /* } */
 
-            /* if(message.gpio_number<BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS && cbk->instance!=NULL && cbk->callback_function!=NULL){ */
-               cbk->callback_function(cbk->instance, message.value);
-            /* } */
+            cbk->callback_function(cbk->instance, message->value);
          }
-         else{ // adc
-            cbk = &analog_callbacks[message.adc_channel];
+         else if(message->type == BEAGLEBONE_PRUIO_MESSAGE_ADC){
+            cbk = &analog_callbacks[message->adc_channel];
+
+            if(cbk->callback_function == NULL){
+               continue;
+            }
 
             // Debug
-            /* if(message.adc_channel >= BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS || cbk->instance == NULL || cbk->callback_function==NULL){ */
-            /*    printf("A! i:%p cbk:%p val:%i chan:%i \n", cbk->instance, cbk->callback_function, message.value, message.adc_channel); */
-            /*    continue; //while */
+            /* if(message->adc_channel >= BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS || cbk->instance == NULL || cbk->callback_function==NULL){ */
+            /*    printf("A! i:%p cbk:%p val:%i chan:%i \n", cbk->instance, cbk->callback_function, message->value, message->adc_channel); */
+            /*    continue; //for */
             /* } */
 
-            /* if(message.adc_channel<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS && cbk->instance!=NULL && cbk->callback_function!=NULL){ */
-               cbk->callback_function(cbk->instance, (t_float)message.value);
-            /* } */
+            cbk->callback_function(cbk->instance, (t_float)message->value);
          }
       }
-   #else
-      int i;
-      for(i=0; i<BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS; ++i){
-         cbk = &digital_callbacks[i];
-         if(cbk->instance != NULL){
-            cbk->callback_function(cbk->instance, rand()%2);
-         }
+   } while(count == BEAGLEBONE_MESSAGES_PER_READ);
+}
+
+#else
+static t_clock* beaglebone_clock = NULL;
+
+void beaglebone_clock_tick(void* x){
+   (void)x; // Do not use x, means nothing here, 
+            // we're passing null to the "owner" in clock_new
+   
+   callback *cbk;
+   int i;
+   for(i=0; i<BEAGLEBONE_PRUIO_MAX_GPIO_CHANNELS; ++i){
+      cbk = &digital_callbacks[i];
+      if(cbk->instance != NULL){
+         cbk->callback_function(cbk->instance, rand()%2);
       }
+   }
 
-      for(i=0; i<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; ++i){
-         cbk = &analog_callbacks[i];
-         if(cbk->instance != NULL){
-            cbk->callback_function(cbk->instance, (t_float)rand()/(t_float)RAND_MAX);
-         }
+   for(i=0; i<BEAGLEBONE_PRUIO_MAX_ADC_CHANNELS; ++i){
+      cbk = &analog_callbacks[i];
+      if(cbk->instance != NULL){
+         cbk->callback_function(cbk->instance, (t_float)rand()/(t_float)RAND_MAX);
       }
-   #endif 
+   }
 
    clock_delay(beaglebone_clock, CLOCK_PERIOD);
 }
+#endif 
 
 int beaglebone_register_callback(
       int is_digital, 
@@ -182,10 +212,15 @@ int beaglebone_register_callback(
       analog_callbacks[channel] = new_callback;
    }
 
-   // First time here. Start the clock.
+   // First time here. Start listening for messages.
    if(beaglebone_number_of_instances==0){
-      beaglebone_clock = clock_new(NULL,  (t_method)beaglebone_clock_tick); 
-      clock_delay(beaglebone_clock, CLOCK_PERIOD);
+      #ifdef IS_BEAGLEBONE
+         beaglebone_event_fd = beaglebone_pruio_get_event_fd();
+         sys_addpollfn(beaglebone_event_fd, beaglebone_fd_ready, NULL);
+      #else
+         beaglebone_clock = clock_new(NULL,  (t_method)beaglebone_clock_tick); 
+         clock_delay(beaglebone_clock, CLOCK_PERIOD);
+      #endif
    }
 
    beaglebone_number_of_instances++;
@@ -194,24 +229,32 @@ int beaglebone_register_callback(
 }
 
 void beaglebone_unregister_callback(int is_digital, int channel){
-   // TODO uninit pin?
-   
    callback *cbk;
    if(is_digital==1){
       cbk = &(digital_callbacks[channel]);
+      #ifdef IS_BEAGLEBONE
+         beaglebone_pruio_deinit_gpio_pin(channel);
+      #endif
    }
    else{
       cbk = &(analog_callbacks[channel]);
+      #ifdef IS_BEAGLEBONE
+         beaglebone_pruio_deinit_adc_pin(channel);
+      #endif
    }
    cbk->callback_function = NULL;
    cbk->instance = NULL;
 
+   // The PRU keeps running without channels, it is only started once 
+   // in beaglebone_setup and new objects may be created at any time.
    beaglebone_number_of_instances--;
    if(beaglebone_number_of_instances==0){
-      clock_free(beaglebone_clock);
-      beaglebone_clock = NULL;
       #ifdef IS_BEAGLEBONE
-         beaglebone_pruio_stop();
+         sys_rmpollfn(beaglebone_event_fd);
+         beaglebone_event_fd = -1;
+      #else
+         clock_free(beaglebone_clock);
+         beaglebone_clock = NULL;
       #endif
    }
 }
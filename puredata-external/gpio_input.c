@@ -52,7 +52,7 @@ void gpio_input_callback(void* x, float value){
 // Constructor, destructor
 //
 
-static void *gpio_input_new(t_symbol *s) {
+static void *gpio_input_new(t_symbol *s, t_floatarg debounce) {
    int gpio_number = beaglebone_pruio_get_gpio_number(s->s_name);
    if(gpio_number==-1){
       error("beaglebone/gpio_input: %s is not a valid GPIO pin.", s->s_name);
@@ -64,6 +64,12 @@ static void *gpio_input_new(t_symbol *s) {
          error("beaglebone/gpio_input: Could not init pin %s (%i), is it already in use?", s->s_name, gpio_number); 
          return NULL;
       }
+      // Second parameter is the debounce time in milliseconds.
+      if(debounce > 0 && beaglebone_pruio_set_gpio_debounce(gpio_number, (int)(debounce*1000))){
+         error("beaglebone/gpio_input: Could not set debounce time for pin %s.", s->s_name); 
+      }
+   #else
+      (void)debounce;
    #endif 
 
    t_gpio_input *x = (t_gpio_input *)pd_new(gpio_input_class);
@@ -94,6 +100,7 @@ void gpio_input_setup(void) {
       sizeof(t_gpio_input), 
       CLASS_NOINLET, 
       A_DEFSYMBOL,
+      A_DEFFLOAT,
       (t_atomtype)0
    );
 }
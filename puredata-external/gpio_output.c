@@ -87,8 +87,11 @@ static void *gpio_output_new(t_symbol *s) {
 }
 
 static void gpio_output_free(t_gpio_output *x) { 
-   // TODO: Uninit pin?
-   (void)x;
+   #ifdef IS_BEAGLEBONE
+      beaglebone_pruio_deinit_gpio_pin(x->gpio_number);
+   #else
+      (void)x;
+   #endif
 }
 
 /////////////////////////////////////////////////////////////////////////